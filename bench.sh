@@ -0,0 +1,60 @@
+#!/bin/sh
+
+# Benchmark the Jitify lexers on a synthetic corpus
+# Usage:
+#   make bench
+# or, with the tools already built,
+#   bench.sh
+#
+# Writes one JSON object per run to stdout.  Settings can be
+# overridden through the environment:
+#   BENCH_SIZE           size of each corpus document in bytes
+#   BENCH_ITERATIONS     times each document is processed per run
+#   BENCH_BLOCK_SIZES    values of --block-size to sweep
+#   BENCH_MAX_SETASIDES  values of --max-setaside to sweep
+#   BENCH_RAGEL_STYLES   Ragel code-generation options to compare,
+#                        e.g. "-T0 -G2"; each one regenerates and
+#                        rebuilds the lexers.  If empty, the current
+#                        build is used as-is.
+
+BENCH_SIZE=${BENCH_SIZE:-1048576}
+BENCH_ITERATIONS=${BENCH_ITERATIONS:-5}
+BENCH_BLOCK_SIZES=${BENCH_BLOCK_SIZES:-"1024 8192 65536"}
+BENCH_MAX_SETASIDES=${BENCH_MAX_SETASIDES:-"1024 262144"}
+MAKE=${MAKE:-make}
+
+CORPUS_DIR=build/corpus/$BENCH_SIZE
+mkdir -p $CORPUS_DIR
+
+for TYPE in html css js ;do
+  for SHAPE in tag-dense comment-heavy script-heavy minified ;do
+    FILE=$CORPUS_DIR/$SHAPE.$TYPE
+    if [ ! -f $FILE ] ;then
+      build/jitify-corpus --$TYPE --shape=$SHAPE --size=$BENCH_SIZE > $FILE || exit 1
+    fi
+  done
+done
+
+run_style() {
+  STYLE=$1
+  for FILE in $CORPUS_DIR/* ;do
+    for BLOCK_SIZE in $BENCH_BLOCK_SIZES ;do
+      for MAX_SETASIDE in $BENCH_MAX_SETASIDES ;do
+        build/jitify --minify --stats=json --iterations=$BENCH_ITERATIONS \
+          --block-size=$BLOCK_SIZE --max-setaside=$MAX_SETASIDE $FILE 2>&1 >/dev/null |
+          sed -e "s|^{|{\"ragel_style\":\"$STYLE\",\"corpus\":\"`basename $FILE`\",|"
+      done
+    done
+  done
+}
+
+if [ -z "$BENCH_RAGEL_STYLES" ] ;then
+  run_style default
+else
+  for STYLE in $BENCH_RAGEL_STYLES ;do
+    $MAKE ragel tools RAGELFLAGS=$STYLE >/dev/null || exit 1
+    run_style $STYLE
+  done
+  # Leave the lexers built with the default options
+  $MAKE ragel tools >/dev/null
+fi
@@ -16,6 +16,6 @@ VERSION=$1
 STAGEDIR="jitify-core-$VERSION"
 mkdir -p $STAGEDIR
 rm -rf $STAGEDIR/*
-FILES="CHANGES INSTALL LICENSE README Makefile src"
+FILES="CHANGES INSTALL LICENSE README Makefile bench.sh src"
 find $FILES |cpio -dump $STAGEDIR
 tar cf - $STAGEDIR | bzip2 > jitify-core-$VERSION.tar.bz2
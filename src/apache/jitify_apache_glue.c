@@ -27,18 +27,32 @@ jitify_pool_t *jitify_apache_pool_create(apr_pool_t *pool)
 
 #define JITIFY_OUTPUT_BUF_SIZE 8000
 
+typedef struct {
+  apr_bucket *bucket;
+  const char *data;
+  apr_size_t len;
+} apache_input_t;
+
+typedef struct {
+  apr_bucket_brigade *bb;
+  apache_input_t inputs[JITIFY_APACHE_MAX_INPUTS]; /* Buckets being scanned */
+  size_t num_inputs;
+  apr_bucket *last_heap; /* Heap bucket allocated by apache_brigade_write */
+} apache_stream_state_t;
+
 static int apache_brigade_write(jitify_output_stream_t *stream, const void *data, size_t len)
 {
-  apr_bucket_brigade *bb = stream->state;
+  apache_stream_state_t *state = stream->state;
+  apr_bucket_brigade *bb = state->bb;
   /* Case 1 of 3: the target brigade ends with a heap
-   * buffer that has enough space left over to hold
-   * this write
+   * buffer that we allocated and that has enough space
+   * left over to hold this write
    */
   if (!APR_BRIGADE_EMPTY(bb)) {
     apr_bucket *b;
 
     b = APR_BRIGADE_LAST(bb);
-    if (APR_BUCKET_IS_HEAP(b)) {
+    if (b == state->last_heap) {
       apr_bucket_heap *h;
       size_t avail;
       
@@ -66,6 +80,7 @@ static int apache_brigade_write(jitify_output_stream_t *stream, const void *data
     memcpy(heap_buf, data, len);
     b->length = len;
     APR_BRIGADE_INSERT_TAIL(bb, b);
+    state->last_heap = b;
   }
   
   /* Case 3 of 3: this write is larger than the normal
@@ -80,10 +95,64 @@ static int apache_brigade_write(jitify_output_stream_t *stream, const void *data
   return len;
 }
 
+/* Output that lies within an input bucket is emitted as a copy of
+ * that bucket, trimmed to the span, so the data is shared rather
+ * than copied
+ */
+static int apache_brigade_write_ref(jitify_output_stream_t *stream, const void *data, size_t len)
+{
+  apache_stream_state_t *state = stream->state;
+  apache_input_t *input = NULL;
+  apr_bucket *b;
+  size_t i;
+  for (i = 0; i < state->num_inputs; i++) {
+    const char *start = state->inputs[i].data;
+    if (((const char *)data >= start) && ((const char *)data + len <= start + state->inputs[i].len)) {
+      input = &(state->inputs[i]);
+      break;
+    }
+  }
+  if (!input || (apr_bucket_copy(input->bucket, &b) != APR_SUCCESS)) {
+    return apache_brigade_write(stream, data, len);
+  }
+  b->start += (const char *)data - input->data;
+  b->length = len;
+  APR_BRIGADE_INSERT_TAIL(state->bb, b);
+  return len;
+}
+
 jitify_output_stream_t *jitify_apache_output_stream_create(jitify_pool_t *pool)
 {
   jitify_output_stream_t *stream = jitify_calloc(pool, sizeof(*stream));
   stream->pool = pool;
+  stream->state = jitify_calloc(pool, sizeof(apache_stream_state_t));
   stream->write = apache_brigade_write;
+  stream->write_ref = apache_brigade_write_ref;
   return stream;
 }
+
+void jitify_apache_set_brigade(jitify_output_stream_t *stream, apr_bucket_brigade *bb)
+{
+  apache_stream_state_t *state = stream->state;
+  state->bb = bb;
+  state->last_heap = NULL;
+}
+
+int jitify_apache_add_input(jitify_output_stream_t *stream, apr_bucket *input, const char *data, apr_size_t len)
+{
+  apache_stream_state_t *state = stream->state;
+  if (state->num_inputs == JITIFY_APACHE_MAX_INPUTS) {
+    return 0;
+  }
+  state->inputs[state->num_inputs].bucket = input;
+  state->inputs[state->num_inputs].data = data;
+  state->inputs[state->num_inputs].len = len;
+  state->num_inputs++;
+  return 1;
+}
+
+void jitify_apache_clear_inputs(jitify_output_stream_t *stream)
+{
+  apache_stream_state_t *state = stream->state;
+  state->num_inputs = 0;
+}
@@ -3,6 +3,7 @@
 
 #include <ap_config.h>
 #include <httpd.h>
+#include <apr_buckets.h>
 
 #include "jitify.h"
 
@@ -10,4 +11,19 @@ extern jitify_pool_t *jitify_apache_pool_create(apr_pool_t *pool);
 
 extern jitify_output_stream_t *jitify_apache_output_stream_create(jitify_pool_t *pool);
 
+/* Set the brigade that output is appended to */
+extern void jitify_apache_set_brigade(jitify_output_stream_t *stream, apr_bucket_brigade *bb);
+
+/* Maximum number of buckets scanned in one call */
+#define JITIFY_APACHE_MAX_INPUTS 16
+
+/* Register a bucket about to be scanned, and the data read from it,
+ * so that output can share that bucket's memory
+ * @return 0 if JITIFY_APACHE_MAX_INPUTS buckets are already registered
+ */
+extern int jitify_apache_add_input(jitify_output_stream_t *stream, apr_bucket *input, const char *data, apr_size_t len);
+
+/* Forget the registered buckets once they are no longer being scanned */
+extern void jitify_apache_clear_inputs(jitify_output_stream_t *stream);
+
 #endif /* !defined(jitify_apache_glue_h) */
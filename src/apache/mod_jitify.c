@@ -2,8 +2,10 @@
 #include <httpd.h>
 #include <http_config.h>
 #include <http_log.h>
+#include <http_protocol.h>
 #include <http_request.h>
 #include <apr_strings.h>
+#include <apr_thread_mutex.h>
 #include <stdbool.h>
 
 #define JITIFY_INTERNAL
@@ -17,10 +19,14 @@ module AP_MODULE_DECLARE_DATA jitify_module;
 
 typedef struct {
   int minify; /* 0 for false, >0 for true, <0 for unset */
+  const char *capture; /* Chunk boundary trace file, or NULL */
+  apr_size_t flush_bytes; /* Flush after this much output, or 0 */
+  int flush_head; /* Flush HTML once the head has been scanned; <0 if JitifyFlush is unset */
 } jitify_dir_conf_t;
 
 typedef struct {
   const char *orig_accept_encoding;
+  const char *orig_if_match;
 } jitify_request_ctx_t;
 
 typedef struct {
@@ -28,8 +34,59 @@ typedef struct {
   jitify_pool_t *pool;
   jitify_lexer_t *lexer;
   jitify_output_stream_t *out;
+  apr_array_header_t *chunks; /* Lengths of the input buckets, as strings, if capturing */
+  apr_size_t flush_bytes;
+  apr_size_t unflushed; /* Output passed downstream since the last flush */
+  int head_end; /* Set by jitify_head_trace once the HTML head has been scanned */
 } jitify_filter_ctx_t;
 
+/* Lexers are reused across requests within each child process; with
+ * a threaded MPM the cache is shared by the worker threads
+ */
+#define MAX_IDLE_LEXERS 32
+
+static jitify_lexer_cache_t *lexer_cache;
+#if APR_HAS_THREADS
+static apr_thread_mutex_t *lexer_cache_mutex;
+#endif
+
+static void lock_lexer_cache()
+{
+#if APR_HAS_THREADS
+  apr_thread_mutex_lock(lexer_cache_mutex);
+#endif
+}
+
+static void unlock_lexer_cache()
+{
+#if APR_HAS_THREADS
+  apr_thread_mutex_unlock(lexer_cache_mutex);
+#endif
+}
+
+static apr_status_t release_lexer(void *data)
+{
+  lock_lexer_cache();
+  jitify_lexer_cache_release(lexer_cache, data);
+  unlock_lexer_cache();
+  return APR_SUCCESS;
+}
+
+static jitify_lexer_t *acquire_lexer(request_rec *r, jitify_pool_t *pool, jitify_output_stream_t *out)
+{
+  jitify_lexer_t *lexer;
+  if (!lexer_cache) {
+    return jitify_lexer_for_content_type(r->content_type, pool, out);
+  }
+  lock_lexer_cache();
+  lexer = jitify_lexer_cache_acquire(lexer_cache, r->content_type, out);
+  unlock_lexer_cache();
+  if (lexer) {
+    apr_pool_cleanup_register(r->pool, lexer, release_lexer, apr_pool_cleanup_null);
+  }
+  return lexer;
+}
+
 static request_rec *main_request(request_rec *r)
 {
   if (r && r->main) {
@@ -40,6 +97,16 @@ static request_rec *main_request(request_rec *r)
   }
 }
 
+/* Token trace callback that watches for the end of the HTML head */
+static void jitify_head_trace(const jitify_token_trace_t *token, void *arg)
+{
+  jitify_filter_ctx_t *ctx = arg;
+  if (jitify_html_head_end(token)) {
+    ctx->head_end = 1;
+    jitify_lexer_set_trace(ctx->lexer, NULL, NULL);
+  }
+}
+
 static jitify_filter_ctx_t *jitify_filter_init(ap_filter_t *f)
 {
   jitify_pool_t *pool = jitify_apache_pool_create(f->r->pool);
@@ -47,13 +114,23 @@ static jitify_filter_ctx_t *jitify_filter_init(ap_filter_t *f)
   jitify_dir_conf_t *jconf = ap_get_module_config(f->r->per_dir_config, &jitify_module);
   request_rec *r_main;
   jitify_request_ctx_t *jctx;
+  int content_type_index;
   ctx->pool = pool;
   if (jconf->minify > 0) {
     jitify_output_stream_t *out = jitify_apache_output_stream_create(pool);
-    ctx->lexer = jitify_lexer_for_content_type(f->r->content_type, pool, out);
+    ctx->lexer = acquire_lexer(f->r, pool, out);
     if (ctx->lexer) {
       ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, f->r, "found lexer for content-type %s for %s", f->r->content_type, f->r->uri);
       jitify_lexer_set_minify_rules(ctx->lexer, 1, 1);
+      if (jconf->capture) {
+        ctx->chunks = apr_array_make(f->r->pool, 16, sizeof(const char *));
+      }
+      ctx->flush_bytes = jconf->flush_bytes;
+      content_type_index = jitify_content_type_index(f->r->content_type);
+      if ((jconf->flush_head > 0) && (content_type_index >= 0) &&
+          !strcmp(jitify_content_type_name(content_type_index), "text/html")) {
+        jitify_lexer_set_trace(ctx->lexer, jitify_head_trace, ctx);
+      }
     }
     else {
       ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, f->r, "no lexer for content-type %s for %s", f->r->content_type, f->r->uri);
@@ -73,11 +150,72 @@ static jitify_filter_ctx_t *jitify_filter_init(ap_filter_t *f)
     ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, f->r, "Not restoring Accept-Encoding because %s for %s",
       (jctx == NULL) ? "there is no request context"  : "original Accept-Encoding was NULL", r_main->uri);
   }
+  if (jctx && jctx->orig_if_match) {
+    apr_table_setn(r_main->headers_in, "If-Match", jctx->orig_if_match);
+  }
   return ctx;
 }
 
+/* Appended to the origin's ETag to make that of the minified response;
+ * minification is the only transform, so it needs no fingerprint of
+ * the settings
+ */
+#define JITIFY_ETAG_SUFFIX "-jitify"
+
+/* Replace the origin's ETag with one for the minified response, which
+ * changes exactly when the origin does; a weak ETag stays weak, and one
+ * that can't be parsed, or that of any response but a 200, is dropped
+ */
+static void jitify_set_etag(request_rec *r)
+{
+  const char *etag = apr_table_get(r->headers_out, "ETag");
+  const char *weak = "";
+  size_t len;
+  if (!etag) {
+    return;
+  }
+  if (r->status != HTTP_OK) {
+    apr_table_unset(r->headers_out, "ETag");
+    return;
+  }
+  if (!strncmp(etag, "W/", 2)) {
+    weak = "W/";
+    etag += 2;
+  }
+  len = strlen(etag);
+  if ((len < 2) || (etag[0] != '"') || (etag[len - 1] != '"')) {
+    apr_table_unset(r->headers_out, "ETag");
+    return;
+  }
+  apr_table_setn(r->headers_out, "ETag",
+                 apr_psprintf(r->pool, "%s%.*s" JITIFY_ETAG_SUFFIX "\"", weak, (int)(len - 1), etag));
+}
+
 #define DEFAULT_ERR_LEN 80
 
+/* Append a record of the chunk boundaries of this response to the
+ * capture file, in the format read by "jitify --replay":
+ *   <uri> <len> <len> ...
+ */
+static void jitify_write_capture(ap_filter_t *f, jitify_filter_ctx_t *ctx)
+{
+  jitify_dir_conf_t *jconf = ap_get_module_config(f->r->per_dir_config, &jitify_module);
+  apr_file_t *file;
+  apr_status_t rv;
+  const char *record;
+  apr_size_t len;
+  record = apr_pstrcat(f->r->pool, f->r->unparsed_uri, " ", apr_array_pstrcat(f->r->pool, ctx->chunks, ' '), "\n", NULL);
+  len = strlen(record);
+  rv = apr_file_open(&file, jconf->capture, APR_FOPEN_WRITE|APR_FOPEN_CREATE|APR_FOPEN_APPEND, APR_OS_DEFAULT, f->r->pool);
+  if (rv == APR_SUCCESS) {
+    rv = apr_file_write_full(file, record, len, NULL);
+    apr_file_close(file);
+  }
+  if (rv != APR_SUCCESS) {
+    ap_log_rerror(APLOG_MARK, APLOG_WARNING, rv, f->r, "cannot write to jitify capture file %s", jconf->capture);
+  }
+}
+
 static apr_status_t jitify_filter(ap_filter_t *f, apr_bucket_brigade *bb)
 {
   apr_status_t rv;
@@ -94,42 +232,96 @@ static apr_status_t jitify_filter(ap_filter_t *f, apr_bucket_brigade *bb)
   }
   
   if (!ctx->response_started) {
+    /* Last-Modified stays valid, since the output changes only when the
+     * input does.  The default handler has already compared the
+     * request's validators with the origin's; a client holding our
+     * ETag is answered here, before anything is scanned.
+     */
     apr_table_unset(f->r->headers_out, "Content-Length");
-    apr_table_unset(f->r->headers_out, "Last-modified");
     apr_table_unset(f->r->headers_out, "Accept-Ranges");
+    jitify_set_etag(f->r);
     ctx->response_started = 1;
+    if ((f->r->status == HTTP_OK) && (ap_meets_conditions(f->r) == HTTP_NOT_MODIFIED)) {
+      ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, f->r, "not modified: %s", f->r->uri);
+      f->r->status = HTTP_NOT_MODIFIED;
+      ap_remove_output_filter(f);
+      return ap_pass_brigade(f->next, bb);
+    }
   }
   out = apr_brigade_create(f->r->pool, f->c->bucket_alloc);
-  ctx->out->state = out;
+  jitify_apache_set_brigade(ctx->out, out);
   rv = APR_SUCCESS;
-  while (!APR_BRIGADE_EMPTY(bb)) {
-    apr_bucket *b;
-    const char *data;
-    apr_size_t len;
-    b = APR_BRIGADE_FIRST(bb);
-    APR_BUCKET_REMOVE(b);
-    rv = apr_bucket_read(b, &data, &len, APR_BLOCK_READ);
-    if (rv != APR_SUCCESS) {
-      break;
+  while (!APR_BRIGADE_EMPTY(bb) && (rv == APR_SUCCESS)) {
+    jitify_iovec_t segs[JITIFY_APACHE_MAX_INPUTS];
+    apr_bucket *batch[JITIFY_APACHE_MAX_INPUTS];
+    apr_bucket *eos = NULL, *flush = NULL;
+    size_t num_segs = 0, i;
+
+    /* Gather the buckets in the brigade so the lexer can scan them in one call */
+    while (!APR_BRIGADE_EMPTY(bb) && (num_segs < JITIFY_APACHE_MAX_INPUTS)) {
+      apr_bucket *b;
+      const char *data;
+      apr_size_t len;
+      b = APR_BRIGADE_FIRST(bb);
+      if (APR_BUCKET_IS_EOS(b)) {
+        APR_BUCKET_REMOVE(b);
+        eos = b;
+        break;
+      }
+      /* A flush ends the batch, and follows the output scanned before it */
+      if (APR_BUCKET_IS_FLUSH(b)) {
+        APR_BUCKET_REMOVE(b);
+        flush = b;
+        break;
+      }
+      rv = apr_bucket_read(b, &data, &len, APR_BLOCK_READ);
+      if (rv != APR_SUCCESS) {
+        break;
+      }
+      APR_BUCKET_REMOVE(b);
+      if (len > 0) {
+        segs[num_segs].data = data;
+        segs[num_segs].len = len;
+        batch[num_segs++] = b;
+        jitify_apache_add_input(ctx->out, b, data, len);
+        if (ctx->chunks) {
+          *(const char **)apr_array_push(ctx->chunks) = apr_psprintf(f->r->pool, "%" APR_SIZE_T_FMT, len);
+        }
+      }
+      else {
+        apr_bucket_destroy(b);
+      }
     }
-    if (len > 0) {
+
+    if (num_segs || eos) {
+      size_t bytes_out = jitify_lexer_get_bytes_out(ctx->lexer);
       const char *err;
-      ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, f->r, "scanning %d bytes of %s", (int)len, f->r->uri);
-      jitify_lexer_scan(ctx->lexer, data, len, 0);
+      ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, f->r, "scanning %d buckets of %s", (int)num_segs, f->r->uri);
+      jitify_lexer_scanv(ctx->lexer, segs, num_segs, (eos != NULL));
+      ctx->unflushed += jitify_lexer_get_bytes_out(ctx->lexer) - bytes_out;
       err = jitify_lexer_get_err(ctx->lexer);
-      if (err) {
-        char err_buf[DEFAULT_ERR_LEN + 1];
-        size_t err_len = DEFAULT_ERR_LEN;
-        size_t max_err_len = (data + len) - err;
-        if (err_len > max_err_len) {
-          err_len = max_err_len;
+      for (i = 0; err && (i < num_segs); i++) {
+        const char *seg_start = segs[i].data;
+        const char *seg_end = seg_start + segs[i].len;
+        if ((err >= seg_start) && (err < seg_end)) {
+          char err_buf[DEFAULT_ERR_LEN + 1];
+          size_t err_len = DEFAULT_ERR_LEN;
+          size_t max_err_len = seg_end - err;
+          if (err_len > max_err_len) {
+            err_len = max_err_len;
+          }
+          memcpy(err_buf, err, err_len);
+          err_buf[err_len] = 0;
+          ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, f->r, "parse error in %s near '%s', entering failsafe mode", f->r->uri, err_buf);
         }
-        memcpy(err_buf, err, err_len);
-        err_buf[err_len] = 0;
-        ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, f->r, "parse error in %s near '%s', entering failsafe mode", f->r->uri, err_buf);
       }
     }
-    if (APR_BUCKET_IS_EOS(b)) {
+    jitify_apache_clear_inputs(ctx->out);
+    for (i = 0; i < num_segs; i++) {
+      apr_bucket_destroy(batch[i]);
+    }
+
+    if (eos) {
       size_t processing_time_in_usec = jitify_lexer_get_processing_time(ctx->lexer);
       size_t bytes_in = jitify_lexer_get_bytes_in(ctx->lexer);
       size_t bytes_out = jitify_lexer_get_bytes_out(ctx->lexer);
@@ -137,14 +329,27 @@ static apr_status_t jitify_filter(ap_filter_t *f, apr_bucket_brigade *bb)
         (unsigned long)bytes_in, (unsigned long)bytes_out,
         (unsigned long)(bytes_in ? processing_time_in_usec * 1000 / bytes_in : 0),
         f->r->uri);
-      jitify_lexer_scan(ctx->lexer, NULL, 0, 1);
-      APR_BRIGADE_INSERT_TAIL(out, b);
+      if (ctx->chunks) {
+        jitify_write_capture(f, ctx);
+      }
+      APR_BRIGADE_INSERT_TAIL(out, eos);
     }
     else {
-      apr_bucket_destroy(b);
+      /* The flush policy of JitifyFlush; downstream filters, such as
+       * the core output filter with small writes, may otherwise hold the
+       * output back
+       */
+      if (!flush && (ctx->head_end || (ctx->flush_bytes && (ctx->unflushed >= ctx->flush_bytes)))) {
+        flush = apr_bucket_flush_create(f->c->bucket_alloc);
+      }
+      if (flush) {
+        APR_BRIGADE_INSERT_TAIL(out, flush);
+        ctx->unflushed = 0;
+        ctx->head_end = 0;
+      }
     }
   }
-  ctx->out->state = NULL;
+  jitify_apache_set_brigade(ctx->out, NULL);
   if (APR_BRIGADE_EMPTY(out)) {
     return APR_SUCCESS;
   }
@@ -153,6 +358,24 @@ static apr_status_t jitify_filter(ap_filter_t *f, apr_bucket_brigade *bb)
   }
 }
 
+/* @return value with the suffix taken off every ETag it lists */
+static const char *jitify_strip_etag_suffix(apr_pool_t *pool, const char *value)
+{
+  static const char suffix[] = JITIFY_ETAG_SUFFIX "\"";
+  char *stripped = apr_palloc(pool, strlen(value) + 1);
+  char *q = stripped;
+  while (*value) {
+    if (!strncmp(value, suffix, sizeof(suffix) - 1)) {
+      value += sizeof(suffix) - 2;
+    }
+    else {
+      *q++ = *value++;
+    }
+  }
+  *q = '\0';
+  return stripped;
+}
+
 static int jitify_translate_name(request_rec *r)
 {
   jitify_dir_conf_t *jconf;
@@ -172,6 +395,14 @@ static int jitify_translate_name(request_rec *r)
         ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, "Hiding Accept-Encoding until output filter for %s", r_main->uri);
         apr_table_unset(r_main->headers_in, "Accept-Encoding");
       }
+      /* The default handler compares If-Match with the origin's ETag,
+       * before the filter derives ours; a client holding our ETag would
+       * be refused with 412, so until the filter it sees the origin's
+       */
+      jctx->orig_if_match = apr_table_get(r_main->headers_in, "If-Match");
+      if (jctx->orig_if_match) {
+        apr_table_setn(r_main->headers_in, "If-Match", jitify_strip_etag_suffix(r_main->pool, jctx->orig_if_match));
+      }
     }
   }
   return DECLINED;
@@ -184,10 +415,51 @@ static int jitify_fixup(request_rec *r)
   return DECLINED;
 }
 
+/* JitifyFlush [bytes=<size>] [head] | off */
+static const char *jitify_set_flush(cmd_parms *cmd, void *conf, const char *arg)
+{
+  jitify_dir_conf_t *jconf = conf;
+  if (jconf->flush_head < 0) {
+    jconf->flush_bytes = 0;
+    jconf->flush_head = 0;
+  }
+  if (!strcasecmp(arg, "off")) {
+    jconf->flush_bytes = 0;
+    jconf->flush_head = 0;
+  }
+  else if (!strncmp(arg, "bytes=", 6)) {
+    char *end;
+    apr_int64_t bytes = apr_strtoi64(arg + 6, &end, 10);
+    if ((*end == 'k') || (*end == 'K')) {
+      bytes *= 1024;
+      end++;
+    }
+    else if ((*end == 'm') || (*end == 'M')) {
+      bytes *= 1024 * 1024;
+      end++;
+    }
+    if ((bytes <= 0) || *end) {
+      return "JitifyFlush has an invalid bytes value";
+    }
+    jconf->flush_bytes = (apr_size_t)bytes;
+  }
+  else if (!strcmp(arg, "head")) {
+    jconf->flush_head = 1;
+  }
+  else {
+    return apr_pstrcat(cmd->pool, "JitifyFlush has an invalid parameter ", arg, NULL);
+  }
+  return NULL;
+}
+
 static const command_rec jitify_cmds[] =
 {
   AP_INIT_FLAG("Minify", ap_set_flag_slot, APR_OFFSETOF(jitify_dir_conf_t, minify),
                RSRC_CONF|ACCESS_CONF, "Enable dynamic content minification"),
+  AP_INIT_TAKE1("JitifyCapture", ap_set_file_slot, APR_OFFSETOF(jitify_dir_conf_t, capture),
+                RSRC_CONF|ACCESS_CONF, "Append the chunk boundaries of minified responses to this file"),
+  AP_INIT_ITERATE("JitifyFlush", jitify_set_flush, NULL,
+                  RSRC_CONF|ACCESS_CONF, "Flush minified output after bytes=<size> of it, at the end of the HTML head, or off"),
 /*
   AP_SOMETHING("CDNify", something, something,
                RSRC_CONF|ACCESS_CONF, "Rewrite links to use a new base URL"),
@@ -195,8 +467,24 @@ static const command_rec jitify_cmds[] =
   {NULL}
 };
 
+static void jitify_child_init(apr_pool_t *pchild, server_rec *s)
+{
+  jitify_pool_t *pool;
+#if APR_HAS_THREADS
+  if (apr_thread_mutex_create(&lexer_cache_mutex, APR_THREAD_MUTEX_DEFAULT, pchild) != APR_SUCCESS) {
+    ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s, "cannot create lexer cache mutex, lexers will not be reused");
+    return;
+  }
+#endif
+  pool = jitify_malloc_pool_create();
+  if (pool) {
+    lexer_cache = jitify_lexer_cache_create(pool, MAX_IDLE_LEXERS);
+  }
+}
+
 static void register_jitify_hooks(apr_pool_t *p)
 {
+  ap_hook_child_init(jitify_child_init, NULL, NULL, APR_HOOK_MIDDLE);
   ap_hook_translate_name(jitify_translate_name, NULL, NULL, APR_HOOK_REALLY_FIRST);
   ap_hook_fixups(jitify_fixup, NULL, NULL, APR_HOOK_REALLY_FIRST);
   ap_register_output_filter(JITIFY_FILTER_KEY, jitify_filter, NULL, AP_FTYPE_RESOURCE);
@@ -206,6 +494,7 @@ static void *create_jitify_dir_config(apr_pool_t *pool, char *unused)
 {
   jitify_dir_conf_t *conf = apr_pcalloc(pool, sizeof(*conf));
   conf->minify = -1;
+  conf->flush_head = -1;
   return conf;
 }
 
@@ -220,6 +509,15 @@ static void *merge_jitify_dir_config(apr_pool_t *pool, void *base_conf, void *ad
   else {
     merged->minify = add->minify;
   }
+  merged->capture = add->capture ? add->capture : base->capture;
+  if (add->flush_head < 0) {
+    merged->flush_bytes = base->flush_bytes;
+    merged->flush_head = base->flush_head;
+  }
+  else {
+    merged->flush_bytes = add->flush_bytes;
+    merged->flush_head = add->flush_head;
+  }
   return merged;
 }
 
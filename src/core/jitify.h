@@ -26,6 +26,42 @@ extern void jitify_pool_destroy(jitify_pool_t *pool);
 
 extern jitify_pool_t *jitify_malloc_pool_create();
 
+/**
+ * Create a pool that carves allocations out of large chunks with a bump
+ * pointer.  jitify_free() is a no-op; memory is reclaimed all at once by
+ * jitify_pool_reset() or jitify_pool_destroy().
+ * @param chunk_size bytes per chunk, or 0 for the default
+ * @param alignment alignment of each allocation, a power of 2, or 0 for the default
+ */
+extern jitify_pool_t *jitify_arena_pool_create(size_t chunk_size, size_t alignment);
+
+/**
+ * Create a pool that passes every request on to parent and keeps
+ * count of them, for jitify_pool_get_stats().  Destroying it doesn't
+ * destroy parent; resetting it resets parent, if parent supports that.
+ */
+extern jitify_pool_t *jitify_counting_pool_create(jitify_pool_t *parent);
+
+/**
+ * Release everything allocated from the pool, keeping the pool usable
+ * @return JITIFY_ERROR if the pool doesn't support bulk reset
+ */
+extern jitify_status_t jitify_pool_reset(jitify_pool_t *pool);
+
+typedef struct {
+  size_t allocs;           /* Allocations since creation or last reset */
+  size_t bytes_allocated;  /* Bytes requested since creation or last reset */
+  size_t bytes_live;       /* Bytes allocated and not yet freed */
+  size_t bytes_high_water; /* Maximum of bytes_live since creation */
+  size_t bytes_reserved;   /* Bytes currently obtained from the system */
+  size_t chunks;           /* Blocks currently obtained from the system */
+} jitify_pool_stats_t;
+
+/**
+ * @return JITIFY_ERROR if the pool doesn't keep statistics
+ */
+extern jitify_status_t jitify_pool_get_stats(jitify_pool_t *pool, jitify_pool_stats_t *stats);
+
 /* Dynamically growing arrays */
 
 extern jitify_array_t *jitify_array_create(jitify_pool_t *pool, size_t element_size);
@@ -54,6 +90,22 @@ typedef struct jitify_lexer_s jitify_lexer_t;
 
 extern jitify_lexer_t *jitify_lexer_for_content_type(const char *content_type, jitify_pool_t *pool, jitify_output_stream_t *out);
 
+/**
+ * @return the number of content types that have a lexer
+ */
+extern int jitify_num_content_types();
+
+/**
+ * @return the index of content_type (parameters such as "; charset=..."
+ * are ignored) in [0, jitify_num_content_types()), or -1 if it has no lexer
+ */
+extern int jitify_content_type_index(const char *content_type);
+
+/**
+ * @return the name of the index'th content type, e.g. "text/css"
+ */
+extern const char *jitify_content_type_name(int index);
+
 extern jitify_lexer_t *jitify_css_lexer_create(jitify_pool_t *pool, jitify_output_stream_t *out);
 
 extern jitify_lexer_t *jitify_html_lexer_create(jitify_pool_t *pool, jitify_output_stream_t *out);
@@ -66,23 +118,149 @@ extern void jitify_lexer_add_cdnify_rule(jitify_lexer_t *lexer, const char *pref
 
 extern void jitify_lexer_set_max_setaside(jitify_lexer_t *lexer, size_t max);
 
+/**
+ * Declare that every buffer passed to jitify_lexer_scan() will remain
+ * valid and unmodified until the lexer is reset or destroyed (e.g. the
+ * whole document is in memory), so tokens that span buffers can be
+ * held by reference instead of being copied
+ */
+extern void jitify_lexer_set_retain_input(jitify_lexer_t *lexer, int retain_input);
+
 extern size_t jitify_lexer_get_bytes_in(jitify_lexer_t *lexer);
 
 extern size_t jitify_lexer_get_bytes_out(jitify_lexer_t *lexer);
 
+/**
+ * @return cumulative time spent scanning, in usec
+ */
 extern size_t jitify_lexer_get_processing_time(jitify_lexer_t *lexer);
 
 extern const char *jitify_lexer_get_err(jitify_lexer_t *lexer);
 
+/**
+ * @return number of tokens that spanned buffers and were sent unmodified
+ * because they were longer than the max setaside
+ */
+extern size_t jitify_lexer_get_setaside_overflows(jitify_lexer_t *lexer);
+
+#define JITIFY_MAX_TOKEN_TYPES 32
+
+typedef struct {
+  const char *name; /* e.g. "HTML comment" */
+  size_t tokens;
+  size_t bytes_in;
+  size_t bytes_out;
+  size_t bytes_removed; /* bytes_in - bytes_out, or 0 if the tokens grew */
+} jitify_token_stats_t;
+
+typedef struct {
+  size_t bytes_in;
+  size_t bytes_out;
+  unsigned long long processing_time; /* nsec */
+  size_t setasides; /* Partial tokens held over from one buffer to the next */
+  size_t setaside_overflows;
+  size_t failsafe_events; /* Times a syntax error made the lexer pass the rest of the input through unmodified */
+  size_t failsafe_bytes;
+  size_t num_token_types;
+  jitify_token_stats_t token_types[JITIFY_MAX_TOKEN_TYPES];
+  int has_pool_stats; /* Whether the lexer's pool keeps statistics, e.g. a counting pool */
+  jitify_pool_stats_t pool;
+} jitify_lexer_stats_t;
+
+/**
+ * Fill in stats with the counters accumulated since the lexer was
+ * created or last reset; the first num_token_types entries of
+ * token_types are filled in.
+ */
+extern void jitify_lexer_get_stats(jitify_lexer_t *lexer, jitify_lexer_stats_t *stats);
+
+typedef struct {
+  int type;          /* Index of the token type in jitify_lexer_stats_t.token_types */
+  const char *name;  /* Name of the token type */
+  size_t offset;     /* Offset of the token's first byte from the start of the document */
+  size_t length_in;
+  size_t length_out;
+  int setaside;      /* Whether the token spanned input buffers */
+  const char *data;  /* The token's input, in one piece even if it spanned buffers; valid only during the callback */
+} jitify_token_trace_t;
+
+typedef void (*jitify_trace_callback_t)(const jitify_token_trace_t *token, void *arg);
+
+/**
+ * Call callback with a description of every token after the lexer's
+ * transform has processed it, or stop tracing if callback is NULL
+ */
+extern void jitify_lexer_set_trace(jitify_lexer_t *lexer, jitify_trace_callback_t callback, void *arg);
+
+/**
+ * @return whether a traced token of the HTML lexer is the "</head>" or
+ * "<body>" tag, either of which ends the head of the document
+ */
+extern int jitify_html_head_end(const jitify_token_trace_t *token);
+
 extern int jitify_write(jitify_lexer_t *lexer, const void *data, size_t length);
 
+/**
+ * Like jitify_write, but for data that may point into the buffer
+ * currently being scanned.  If it does and the output stream supports
+ * write_ref, the stream is handed a reference instead of a copy.
+ */
+extern int jitify_write_ref(jitify_lexer_t *lexer, const void *data, size_t length);
+
 /**
  * @return number of bytes scanned, or a negative number if an unrecoverable error occurs
  */
 extern int jitify_lexer_scan(jitify_lexer_t *lexer, const void *data, size_t len, int is_eof);
 
+typedef struct {
+  const void *data;
+  size_t len;
+} jitify_iovec_t;
+
+/**
+ * Scan several buffers as consecutive parts of the document in one
+ * call.  A token spanning buffers is held by reference while the call
+ * lasts and is only copied if it is still incomplete when it returns.
+ * is_eof applies to the last buffer.
+ * @return total number of bytes scanned, or a negative number if an unrecoverable error occurs
+ */
+extern int jitify_lexer_scanv(jitify_lexer_t *lexer, const jitify_iovec_t *segs, size_t num_segs, int is_eof);
+
 extern void jitify_lexer_destroy(jitify_lexer_t *lexer);
 
+/**
+ * Return a lexer to the state it was in when created, keeping the
+ * memory it has allocated, so it can be used for another document.
+ * Minify rules and CDNify rules are cleared.
+ */
+extern void jitify_lexer_reset(jitify_lexer_t *lexer);
+
+extern void jitify_lexer_set_output_stream(jitify_lexer_t *lexer, jitify_output_stream_t *out);
+
+/* Free lists of reset lexers, one per kind of lexer.  A cache is not
+ * thread-safe; use one per thread or serialize access to it.
+ */
+
+typedef struct jitify_lexer_cache_s jitify_lexer_cache_t;
+
+/**
+ * @param pool pool for the cache and its lexers, which must outlive them
+ * @param max_idle maximum number of idle lexers of each kind to keep
+ */
+extern jitify_lexer_cache_t *jitify_lexer_cache_create(jitify_pool_t *pool, size_t max_idle);
+
+/**
+ * Like jitify_lexer_for_content_type(), but reuses an idle lexer if
+ * there is one.  Give the lexer back with jitify_lexer_cache_release()
+ * instead of destroying it.
+ */
+extern jitify_lexer_t *jitify_lexer_cache_acquire(jitify_lexer_cache_t *cache, const char *content_type,
+  jitify_output_stream_t *out);
+
+extern void jitify_lexer_cache_release(jitify_lexer_cache_t *cache, jitify_lexer_t *lexer);
+
+extern void jitify_lexer_cache_destroy(jitify_lexer_cache_t *cache);
+
 #ifdef JITIFY_INTERNAL
 
 struct jitify_pool_s {
@@ -91,12 +269,20 @@ struct jitify_pool_s {
   void *(*calloc)(jitify_pool_t *p, size_t size);
   void (*free)(jitify_pool_t *p, void *object);
   void (*cleanup)(jitify_pool_t *p);
+  void (*reset)(jitify_pool_t *p);                            /* Optional */
+  void (*stats)(jitify_pool_t *p, jitify_pool_stats_t *stats); /* Optional */
 };
 
 struct jitify_output_stream_s {
   void *state;
   jitify_pool_t *pool;
   int (*write)(jitify_output_stream_t *stream, const void *data, size_t length);
+  /* Optional.  Like write, but data lies within the input buffer passed
+   * to the current jitify_lexer_scan() call, so the stream may keep a
+   * reference to it rather than copying it, as long as it keeps the
+   * input buffer alive until the output has been consumed.
+   */
+  int (*write_ref)(jitify_output_stream_t *stream, const void *data, size_t length);
   void (*cleanup)(jitify_output_stream_t *stream);
 };
 
@@ -2,24 +2,31 @@
 #define JITIFY_INTERNAL
 #include "jitify.h"
 
+/* Elements are stored in chunks of doubling size: chunk k holds
+ * INITIAL_ARRAY_SIZE << k elements.  Growing the array allocates one
+ * more chunk and never moves existing elements, so nothing is copied
+ * and, with pools whose free is a no-op, nothing is leaked.  Chunks
+ * are kept when the array is cleared.
+ */
+
+#define INITIAL_ARRAY_SIZE 2
+#define MAX_CHUNKS (8 * sizeof(size_t) - 1)
+
 struct jitify_array_s {
   jitify_pool_t *pool;
   size_t len;
-  size_t size;
+  size_t num_chunks;
   size_t element_size;
-  char *data;
+  char *chunks[MAX_CHUNKS];
 };
 
-#define INITIAL_ARRAY_SIZE 2
-
 jitify_array_t *jitify_array_create(jitify_pool_t *pool, size_t element_size)
 {
   jitify_array_t *array = jitify_malloc(pool, sizeof(*array));
   array->pool = pool;
   array->len = 0;
-  array->size = INITIAL_ARRAY_SIZE;
+  array->num_chunks = 0;
   array->element_size = element_size;
-  array->data = jitify_malloc(pool, array->size * element_size);
   return array;
 }
 
@@ -28,28 +35,39 @@ size_t jitify_array_length(const jitify_array_t *array)
   return array->len;
 }
 
+/* Chunk k starts at index INITIAL_ARRAY_SIZE * (2^k - 1) */
+static char *element_address(jitify_array_t *array, size_t index)
+{
+  size_t biased = index / INITIAL_ARRAY_SIZE + 1;
+  size_t chunk = 0;
+  size_t chunk_start;
+  while (biased >>= 1) {
+    chunk++;
+  }
+  chunk_start = INITIAL_ARRAY_SIZE * (((size_t)1 << chunk) - 1);
+  return array->chunks[chunk] + (index - chunk_start) * array->element_size;
+}
+
 void *jitify_array_get(jitify_array_t *array, size_t index)
 {
   if (index >= array->len) {
     return NULL;
   }
   else {
-    return array->data + index * array->element_size;
+    return element_address(array, index);
   }
 }
 
 void *jitify_array_push(jitify_array_t *array)
 {
-  if (array->len == array->size) {
-    char *new_data;
-    array->size *= 2;
-    new_data = jitify_malloc(array->pool, array->size * array->element_size);
-    memcpy(new_data, array->data, array->len * array->element_size);
-    jitify_free(array->pool, array->data);
-    array->data = new_data;
+  char *element;
+  if (array->len == INITIAL_ARRAY_SIZE * (((size_t)1 << array->num_chunks) - 1)) {
+    size_t chunk_size = (size_t)INITIAL_ARRAY_SIZE << array->num_chunks;
+    array->chunks[array->num_chunks++] = jitify_malloc(array->pool, chunk_size * array->element_size);
   }
-  memset(array->data + array->len * array->element_size, 0, array->element_size);
-  return array->data + array->len++ * array->element_size;
+  element = element_address(array, array->len++);
+  memset(element, 0, array->element_size);
+  return element;
 }
 
 void jitify_array_clear(jitify_array_t *array)
@@ -59,6 +77,9 @@ void jitify_array_clear(jitify_array_t *array)
 
 void jitify_array_destroy(jitify_array_t *array)
 {
-  jitify_free(array->pool, array->data);
+  size_t i;
+  for (i = 0; i < array->num_chunks; i++) {
+    jitify_free(array->pool, array->chunks[i]);
+  }
   jitify_free(array->pool, array);
 }
@@ -3,37 +3,35 @@
 
 extern int jitify_css_scan(jitify_lexer_t *lexer, const void *data, size_t length, int is_eof);
 
-jitify_token_type_t jitify_type_css_selector = "CSS selector";
-jitify_token_type_t jitify_type_css_term = "CSS term";
-jitify_token_type_t jitify_type_css_comment = "CSS comment";
-jitify_token_type_t jitify_type_css_optional_whitespace = "CSS optional space";
-jitify_token_type_t jitify_type_css_required_whitespace = "CSS required space";
-jitify_token_type_t jitify_type_css_url = "CSS URL";
-
-
-static jitify_status_t css_transform(jitify_lexer_t *lexer, const void *data, size_t length, size_t offset)
+static JITIFY_INLINE jitify_status_t css_transform(jitify_lexer_t *lexer, const void *data, size_t length, size_t offset,
+  int remove_space, int remove_comments)
 {
   jitify_css_state_t *state = lexer->state;
-  if (lexer->token_type == jitify_type_css_optional_whitespace) {
-    if (lexer->remove_space) {
-      return JITIFY_OK;
-    }
-  }
-  else if (lexer->token_type == jitify_type_css_comment) {
-    if (lexer->remove_comments) {
-      return JITIFY_OK;
-    }
-  }
-  else if ((lexer->token_type == jitify_type_css_selector) || (lexer->token_type == jitify_type_css_term)) {
-    if (lexer->remove_space && (state->last_token_type == lexer->token_type)) {
-      /* The space we just skipped was actually necessary, so add a space back in */
-      if (jitify_write(lexer, " ", 1) < 0) {
-        return JITIFY_ERROR;
+  switch (lexer->token_type) {
+    case jitify_type_css_optional_whitespace:
+      if (remove_space) {
+        return JITIFY_OK;
+      }
+      break;
+    case jitify_type_css_comment:
+      if (remove_comments) {
+        return JITIFY_OK;
       }
-    }
+      break;
+    case jitify_type_css_selector:
+    case jitify_type_css_term:
+      if (remove_space && (state->last_token_type == lexer->token_type)) {
+        /* The space we just skipped was actually necessary, so add a space back in */
+        if (jitify_write(lexer, " ", 1) < 0) {
+          return JITIFY_ERROR;
+        }
+      }
+      break;
+    default:
+      break;
   }
   state->last_token_type = lexer->token_type;
-  if (jitify_write(lexer, data, length) < 0) {
+  if (jitify_write_ref(lexer, data, length) < 0) {
     return JITIFY_ERROR;
   }
   else {
@@ -41,6 +39,13 @@ static jitify_status_t css_transform(jitify_lexer_t *lexer, const void *data, si
   }
 }
 
+TRANSFORM_VARIANTS(css_transform);
+
+static void css_reset(jitify_lexer_t *lexer)
+{
+  memset(lexer->state, 0, sizeof(jitify_css_state_t));
+}
+
 static void css_cleanup(jitify_lexer_t *lexer)
 {
   jitify_free(lexer->pool, lexer->state);
@@ -52,7 +57,9 @@ jitify_lexer_t *jitify_css_lexer_create(jitify_pool_t *pool, jitify_output_strea
   jitify_css_state_t *state = jitify_calloc(pool, sizeof(*state));
   lexer->state = state;
   lexer->scan = jitify_css_scan;
-  lexer->transform = css_transform;
+  lexer->transform_variants = css_transform_variants;
+  jitify_lexer_set_minify_rules(lexer, 0, 0);
+  lexer->reset = css_reset;
   lexer->cleanup = css_cleanup;
   return lexer;
 }
@@ -7,12 +7,12 @@
   machine css_grammar;
   
   css_comment = (
-    '/*' ( any )* :>> '*/'
-  ) >{ TOKEN_TYPE(jitify_type_css_comment); } %{ TOKEN_END; } ;
+    '/*' ( any @{ SKIP_UNTIL_UNLESS(jitify_charset_css_comment_end, jitify_charset_css_comment_end); } )* :>> '*/'
+  ) >{ PROFILE_ENTER(css_comment); TOKEN_TYPE(jitify_type_css_comment); } %{ TOKEN_END; PROFILE_LEAVE(css_comment); } ;
 
   optional_space = (
     space+
-  ) >{ TOKEN_START(jitify_token_type_misc); } %{ TOKEN_TYPE(jitify_type_css_optional_whitespace); TOKEN_END; };
+  ) >{ PROFILE_ENTER(css_space); TOKEN_START(jitify_token_type_misc); } %{ TOKEN_TYPE(jitify_type_css_optional_whitespace); TOKEN_END; PROFILE_LEAVE(css_space); };
 
   optional_space_or_comment = (
     optional_space |
@@ -21,7 +21,7 @@
   
   required_space = (
     space+
-    ) >{ TOKEN_START(jitify_token_type_misc); } %{ TOKEN_TYPE(jitify_type_css_required_whitespace); TOKEN_END; };
+    ) >{ PROFILE_ENTER(css_space); TOKEN_START(jitify_token_type_misc); } %{ TOKEN_TYPE(jitify_type_css_required_whitespace); TOKEN_END; PROFILE_LEAVE(css_space); };
 
   combinator = (
     '+' | '>'
@@ -32,11 +32,11 @@
   );
 
   _single_quoted = (
-    "'" ( [^'\\] | /\\./)* "'"
+    "'" ( [^'\\] @{ SKIP_UNTIL(jitify_charset_single_quoted_end); } | /\\./)* "'"
   );
 
   _double_quoted = (
-    '"' ( [^"\\] | /\\./ )* '"'
+    '"' ( [^"\\] @{ SKIP_UNTIL(jitify_charset_double_quoted_end); } | /\\./ )* '"'
   );
 
   _ident = (
@@ -66,7 +66,7 @@
     ( (_ident | '*') (_hash | _css_class | _attrib | _pseudo)* )
     |
     (_hash | _css_class | _attrib | _pseudo)+
-  ) >{ TOKEN_START(jitify_token_type_misc); } %{ TOKEN_TYPE(jitify_type_css_selector); TOKEN_END; };
+  ) >{ PROFILE_ENTER(css_selector); TOKEN_START(jitify_token_type_misc); } %{ TOKEN_TYPE(jitify_type_css_selector); TOKEN_END; PROFILE_LEAVE(css_selector); };
 
   comma = (
     ','
@@ -126,30 +126,33 @@
   
   base_term = (
     _single_quoted | _double_quoted | _misc_term
-  ) >{ TOKEN_START(jitify_type_css_term); } %{ TOKEN_END; };
+  ) >{ PROFILE_ENTER(css_term); TOKEN_START(jitify_type_css_term); } %{ TOKEN_END; PROFILE_LEAVE(css_term); };
   
   function_arg = ( _single_quoted | _double_quoted | _misc_function_arg )
     >{ TOKEN_START(jitify_token_type_misc); } %{ TOKEN_END; } <: optional_space_or_comment?;
   
   arg_delimiter = ( ',' | '=' | '<' | '>' | '?' | ':' ) >{ TOKEN_START(jitify_token_type_misc); } %{ TOKEN_END; };
   
-  function_args = open_paren optional_space_or_comment?
+  function_args = (
+    open_paren optional_space_or_comment?
     ( function_arg  (arg_delimiter optional_space_or_comment? function_arg)* )?
-    close_paren %{ state->last_token_type = jitify_type_css_term; };
+    close_paren
+  ) >{ PROFILE_ENTER(css_function_args); }
+    %{ state->last_token_type = jitify_type_css_term; PROFILE_LEAVE(css_function_args); };
   
   term = base_term optional_space_or_comment? (function_args optional_space_or_comment?)?;
 
   declaration = (
     property optional_space_or_comment? colon optional_space_or_comment? term <: ((comma optional_space_or_comment?)? term)**
     (priority optional_space_or_comment?)?
-  );
+  ) >{ PROFILE_ENTER(css_declaration); } %{ PROFILE_LEAVE(css_declaration); };
 
   ruleset = (
     simple_selector <: optional_space_or_comment? ( (simple_selector|combinator|comma) optional_space_or_comment? )**
     open_curly_brace
     optional_space_or_comment? declaration? ( semicolon optional_space_or_comment? declaration? )*
     close_curly_brace
-  );
+  ) >{ PROFILE_ENTER(css_ruleset); } %{ PROFILE_LEAVE(css_ruleset); };
 
   html_open_comment = (
     '<!--'
@@ -164,12 +167,12 @@
   )** >{ TOKEN_START(jitify_token_type_misc); } %{ TOKEN_END; };
   
   css_import = (
-    ( '@' /import/i ) >{ TOKEN_START(jitify_token_type_misc); } %{ TOKEN_END; }
+    ( '@' /import/i ) >{ PROFILE_ENTER(css_at_rule); TOKEN_START(jitify_token_type_misc); } %{ TOKEN_END; }
     required_space term semicolon
-  );
+  ) %{ PROFILE_LEAVE(css_at_rule); };
   
   media = (
-    ( '@' /media/i ) >{ TOKEN_START(jitify_token_type_misc); } %{ TOKEN_END; }
+    ( '@' /media/i ) >{ PROFILE_ENTER(css_at_rule); TOKEN_START(jitify_token_type_misc); } %{ TOKEN_END; }
     css_comment?
     required_space
     (css_comment optional_space?)*
@@ -178,12 +181,12 @@
     optional_space_or_comment?
     (ruleset optional_space_or_comment?)*
     close_curly_brace
-  );
+  ) %{ PROFILE_LEAVE(css_at_rule); };
   
   css_charset = (
-    ( '@' /charset/i ) >{ TOKEN_START(jitify_token_type_misc); } %{ TOKEN_END; }
+    ( '@' /charset/i ) >{ PROFILE_ENTER(css_at_rule); TOKEN_START(jitify_token_type_misc); } %{ TOKEN_END; }
     required_space (base_term optional_space_or_comment?)** semicolon
-  );
+  ) %{ PROFILE_LEAVE(css_at_rule); };
   
   css_document = (
     optional_space_or_comment |
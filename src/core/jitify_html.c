@@ -3,18 +3,10 @@
 #include "jitify_css.h"
 #include "jitify_html.h"
 
-jitify_token_type_t jitify_type_html_anchor_open = "HTML anchor";
-jitify_token_type_t jitify_type_html_comment = "HTML comment";
-jitify_token_type_t jitify_type_html_img_open = "HTML img";
-jitify_token_type_t jitify_type_html_link_open = "HTML link";
-jitify_token_type_t jitify_type_html_script_open = "HTML script";
-jitify_token_type_t jitify_type_html_space = "HTML space";
-jitify_token_type_t jitify_type_html_tag = "HTML tag";
-
 extern int jitify_html_scan(jitify_lexer_t *lexer, const void *data, size_t length, int is_eof);
 
 static jitify_status_t html_tag_transform(jitify_lexer_t *lexer, const char *buf, size_t length,
-  size_t starting_offset, const char *attr_name)
+  size_t starting_offset, const char *attr_name, int remove_space)
 {
   int modified = 0;
   jitify_html_state_t *state = lexer->state;
@@ -24,14 +16,14 @@ static jitify_status_t html_tag_transform(jitify_lexer_t *lexer, const char *buf
    * modified=true to force the tag to be
    * reconstructed with minimal spacing.
    */
-  if (lexer->remove_space) {
+  if (remove_space) {
     modified = 1;
   }
   
   jitify_lexer_resolve_attrs(lexer, buf, starting_offset);
-  num_attrs = jitify_array_length(lexer->attrs);
+  num_attrs = lexer->num_attrs;
   if (num_attrs) {
-    jitify_attr_t *attr = jitify_array_get(lexer->attrs, 0);
+    jitify_attr_t *attr = jitify_lexer_get_attr(lexer, 0);
     switch (attr->key.len) {
       case 3:
         if (!strncasecmp(attr->key.data.buf, "pre", 3)) {
@@ -60,7 +52,7 @@ static jitify_status_t html_tag_transform(jitify_lexer_t *lexer, const char *buf
   if (!modified)
   {
     /* No modification needed; send the full token as-is */
-    if (jitify_write(lexer, buf, length) < 0) {
+    if (jitify_write_ref(lexer, buf, length) < 0) {
       return JITIFY_ERROR;
     }
     else {
@@ -74,20 +66,19 @@ static jitify_status_t html_tag_transform(jitify_lexer_t *lexer, const char *buf
     if (state->leading_slash) {
       jitify_write(lexer, "/", 1);
     }
-    num_attrs = jitify_array_length(lexer->attrs);
     for (i = 0; i < num_attrs; i++) {
-      jitify_attr_t *attr = jitify_array_get(lexer->attrs, i);
+      jitify_attr_t *attr = jitify_lexer_get_attr(lexer, i);
       if (attr->key.len) {
         if (i) {
           jitify_write(lexer, " ", 1);
         }
-        jitify_write(lexer, attr->key.data.buf, attr->key.len);
+        jitify_write_ref(lexer, attr->key.data.buf, attr->key.len);
         if (attr->value.len) {
           jitify_write(lexer, "=", 1);
           if (attr->quote) {
             jitify_write(lexer, &(attr->quote), 1);
           }
-          jitify_write(lexer, attr->value.data.buf, attr->value.len);
+          jitify_write_ref(lexer, attr->value.data.buf, attr->value.len);
           if (attr->quote) {
             jitify_write(lexer, &(attr->quote), 1);
           }
@@ -102,65 +93,66 @@ static jitify_status_t html_tag_transform(jitify_lexer_t *lexer, const char *buf
   }
 }
 
-static jitify_status_t html_transform(jitify_lexer_t *lexer, const void *data, size_t length, size_t starting_offset)
+static JITIFY_INLINE jitify_status_t html_transform(jitify_lexer_t *lexer, const void *data, size_t length, size_t starting_offset,
+  int remove_space, int remove_comments)
 {
   const char *buf = data;
   jitify_html_state_t *state = lexer->state;
   
-  if (lexer->token_type == jitify_type_html_space) {
-    if (lexer->remove_space &&
-        (state->nominify_depth == 0)) {
-      if (state->space_contains_newlines) {
-        buf = "\n";
+  switch (lexer->token_type) {
+    case jitify_type_html_space:
+      if (remove_space &&
+          (state->nominify_depth == 0)) {
+        if (state->space_contains_newlines) {
+          buf = "\n";
+        }
+        else {
+          buf = " ";
+        }
+        length = 1;
       }
-      else {
+      break;
+    case jitify_type_html_comment:
+      if (remove_comments && !state->conditional_comment) {
         buf = " ";
+        length = 1;
       }
-      length = 1;
-    }
-  }
-  else if (lexer->token_type == jitify_type_html_comment) {
-    if (lexer->remove_comments && !state->conditional_comment) {
-      buf = " ";
-      length = 1;
-    }
-  }
-  else if (lexer->token_type == jitify_type_css_comment) {
-    if (lexer->remove_comments) {
-      return JITIFY_OK;
-    }
-  }
-  else if (lexer->token_type == jitify_type_css_optional_whitespace) {
-    if (lexer->remove_space) {
-      return JITIFY_OK;
-    }
-  }
-  else if ((lexer->token_type == jitify_type_css_selector) || (lexer->token_type == jitify_type_css_term)) {
-    if (lexer->remove_space && (state->last_token_type == lexer->token_type)) {
-      /* The space we just skipped was actually necessary, so add a space back in */
-      if (jitify_write(lexer, " ", 1) < 0) {
-        return JITIFY_ERROR;
+      break;
+    case jitify_type_css_comment:
+      if (remove_comments) {
+        return JITIFY_OK;
       }
-    }
-  }
-  else if (lexer->token_type == jitify_type_html_tag) {
-    return html_tag_transform(lexer, buf, length, starting_offset, "?");
-  }
-  else if (lexer->token_type == jitify_type_html_anchor_open) {
-    return html_tag_transform(lexer, buf, length, starting_offset, "href");
-  }
-  else if (lexer->token_type == jitify_type_html_img_open) {
-    return html_tag_transform(lexer, buf, length, starting_offset, "src");
-  }
-  else if (lexer->token_type == jitify_type_html_link_open) {
-    return html_tag_transform(lexer, buf, length, starting_offset, "href");
-  }
-  else if (lexer->token_type == jitify_type_html_script_open) {
-    return html_tag_transform(lexer, buf, length, starting_offset, "src");
+      break;
+    case jitify_type_css_optional_whitespace:
+      if (remove_space) {
+        return JITIFY_OK;
+      }
+      break;
+    case jitify_type_css_selector:
+    case jitify_type_css_term:
+      if (remove_space && (state->last_token_type == lexer->token_type)) {
+        /* The space we just skipped was actually necessary, so add a space back in */
+        if (jitify_write(lexer, " ", 1) < 0) {
+          return JITIFY_ERROR;
+        }
+      }
+      break;
+    case jitify_type_html_tag:
+      return html_tag_transform(lexer, buf, length, starting_offset, "?", remove_space);
+    case jitify_type_html_anchor_open:
+      return html_tag_transform(lexer, buf, length, starting_offset, "href", remove_space);
+    case jitify_type_html_img_open:
+      return html_tag_transform(lexer, buf, length, starting_offset, "src", remove_space);
+    case jitify_type_html_link_open:
+      return html_tag_transform(lexer, buf, length, starting_offset, "href", remove_space);
+    case jitify_type_html_script_open:
+      return html_tag_transform(lexer, buf, length, starting_offset, "src", remove_space);
+    default:
+      break;
   }
   
   state->last_token_type = lexer->token_type;
-  if (jitify_write(lexer, buf, length) < 0) {
+  if (jitify_write_ref(lexer, buf, length) < 0) {
     return JITIFY_ERROR;
   }
   else {
@@ -168,11 +160,40 @@ static jitify_status_t html_transform(jitify_lexer_t *lexer, const void *data, s
   }
 }
 
+TRANSFORM_VARIANTS(html_transform);
+
+static void html_reset(jitify_lexer_t *lexer)
+{
+  memset(lexer->state, 0, sizeof(jitify_html_state_t));
+}
+
 static void html_cleanup(jitify_lexer_t *lexer)
 {
   jitify_free(lexer->pool, lexer->state);
 }
 
+/* @return whether a tag token is the named tag, and not merely one whose
+ * name starts the same way
+ */
+static int html_tag_is(const jitify_token_trace_t *token, const char *tag, size_t len)
+{
+  char c;
+  if ((token->length_in <= len) || strncasecmp(token->data, tag, len)) {
+    return 0;
+  }
+  c = token->data[len];
+  return (c == '>') || (c == '/') || (c == ' ') || (c == '\t') || (c == '\r') || (c == '\n') || (c == '\f');
+}
+
+/* The lexer has told tags apart from comments, scripts and text, and
+ * traces a tag that spanned input buffers in one piece
+ */
+int jitify_html_head_end(const jitify_token_trace_t *token)
+{
+  return (token->type == jitify_type_html_tag) &&
+    (html_tag_is(token, "</head", 6) || html_tag_is(token, "<body", 5));
+}
+
 jitify_lexer_t *jitify_html_lexer_create(jitify_pool_t *pool, jitify_output_stream_t *out)
 {
   jitify_lexer_t *lexer = jitify_lexer_create(pool, out);
@@ -181,7 +202,9 @@ jitify_lexer_t *jitify_html_lexer_create(jitify_pool_t *pool, jitify_output_stre
   state->space_contains_newlines = 0;
   lexer->state = state;
   lexer->scan = jitify_html_scan;
-  lexer->transform = html_transform;
+  lexer->transform_variants = html_transform_variants;
+  jitify_lexer_set_minify_rules(lexer, 0, 0);
+  lexer->reset = html_reset;
   lexer->cleanup = html_cleanup;
   return lexer;
 }
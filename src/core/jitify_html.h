@@ -5,14 +5,6 @@
 
 #ifdef JITIFY_INTERNAL
 
-extern jitify_token_type_t jitify_type_html_anchor_open;
-extern jitify_token_type_t jitify_type_html_comment;
-extern jitify_token_type_t jitify_type_html_img_open;
-extern jitify_token_type_t jitify_type_html_link_open;
-extern jitify_token_type_t jitify_type_html_script_open;
-extern jitify_token_type_t jitify_type_html_space;
-extern jitify_token_type_t jitify_type_html_tag;
-
 typedef struct {
   int conditional_comment;
   int space_contains_newlines;
@@ -23,8 +23,9 @@
 
   conditional_comment = '[if' %{ state->conditional_comment = 1; };
 
-  comment = '--' %{ TOKEN_TYPE(jitify_type_html_comment); state->conditional_comment = 0; }
-    (any | conditional_comment)* :>> '-->' %{ TOKEN_END; };
+  comment = '--' %{ TOKEN_TYPE(jitify_type_html_comment); state->conditional_comment = 0; PROFILE_ENTER(html_comment); }
+    ( any @{ SKIP_UNTIL_UNLESS(jitify_charset_html_comment_hold, jitify_charset_html_comment_end); } |
+      conditional_comment )* :>> '-->' %{ TOKEN_END; PROFILE_LEAVE(html_comment); };
 
   misc_directive = any* :>> '>';
 
@@ -45,11 +46,13 @@
     %{ ATTR_VALUE_END; };
   
   single_quoted_attr_value = "'" @{ ATTR_SET_QUOTE('\''); }
-  ( /[^']*/ ) >{ ATTR_VALUE_START; } %{ ATTR_VALUE_END; }
+  ( /[^']*/ ${ SKIP_UNTIL(jitify_charset_single_quote); } )
+    >{ ATTR_VALUE_START; }
+    %{ ATTR_VALUE_END; }
   "'";
   
   double_quoted_attr_value = '"' @{ ATTR_SET_QUOTE('"'); }
-  ( /[^"]*/ )
+  ( /[^"]*/ ${ SKIP_UNTIL(jitify_charset_double_quote); } )
     >{ ATTR_VALUE_START; }
     %{ ATTR_VALUE_END; }
   '"';
@@ -81,7 +84,9 @@
   
   script_close = '</' /script/i '>';
 
-  tag_attrs = (space+ %{ ATTR_END;} ( attr_name <: space* ( '=' space* attr_value <: space*)? )*);
+  tag_attrs = (space+ %{ ATTR_END;} ( attr_name <: space* ( '=' space* attr_value <: space*)? )*)
+    >{ PROFILE_ENTER(html_attrs); }
+    %{ PROFILE_LEAVE(html_attrs); };
   
   script = (
     /script/i
@@ -90,8 +95,10 @@
          ATTR_KEY_END; }
     tag_attrs? tag_close
       %{ TOKEN_END;
-         TOKEN_START(jitify_token_type_misc); }
-      (any* - ( any* script_close any* ) ) script_close
+         TOKEN_START(jitify_token_type_misc);
+         PROFILE_ENTER(html_script); }
+      ( any* ${ SKIP_UNTIL_UNLESS(jitify_charset_script_close_hold, jitify_charset_less_than); }
+        - ( any* script_close any* ) ) script_close
   );
 
   style = (
@@ -100,7 +107,8 @@
       %{ TOKEN_TYPE(jitify_type_html_tag);
          ATTR_KEY_END; }
     tag_attrs? tag_close
-      %{ TOKEN_END; }
+      %{ TOKEN_END;
+         PROFILE_ENTER(html_style); }
     css_document? ( '</' /style/i '>' )
       >{ TOKEN_TYPE(jitify_token_type_misc); }
       %{ TOKEN_END; }
@@ -136,26 +144,37 @@
     ( space - ( '\r' | '\n' ) ) |
     ( '\r' | '\n' ) @{ state->space_contains_newlines = 1; }
   )+
-    >{ TOKEN_START(jitify_type_html_space);
-       state->space_contains_newlines = 0; }
-    %{ TOKEN_END; };
+    >{ PROFILE_ENTER(html_space);
+       TOKEN_START(jitify_type_html_space);
+       state->space_contains_newlines = 0;
+       SKIP_WHILE(jitify_charset_space);
+       if (jitify_find_first_of(lexer->token_start, p + 1, &jitify_charset_newline) <= p) {
+         state->space_contains_newlines = 1;
+       } }
+    %{ TOKEN_END;
+       PROFILE_LEAVE(html_space); };
   
   content = (
     any - (space | '<' )
   )+
-    >{ TOKEN_START(jitify_token_type_misc); }
-    %{ TOKEN_END; };
+    >{ PROFILE_ENTER(html_content);
+       TOKEN_START(jitify_token_type_misc);
+       SKIP_UNTIL(jitify_charset_html_content_end); }
+    %{ TOKEN_END;
+       PROFILE_LEAVE(html_content); };
   
   main := (
     byte_order_mark?
     (
       ( '<'
-          >{ TOKEN_START(jitify_token_type_misc);
+          >{ PROFILE_ENTER(html_tag);
+            TOKEN_START(jitify_token_type_misc);
             state->leading_slash = 0;
             state->trailing_slash = 0; }
         element
           %{ TOKEN_END;
-             RESET_ATTRS; }
+             RESET_ATTRS;
+             PROFILE_LEAVE(html_tag); }
       )
       |
       html_space
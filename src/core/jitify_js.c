@@ -8,17 +8,13 @@
 
 extern int jitify_js_scan(jitify_lexer_t *lexer, const void *data, size_t length, int is_eof);
 
-jitify_token_type_t jitify_type_js_whitespace = "JS space";
-jitify_token_type_t jitify_type_js_newline = "JS newline";
-jitify_token_type_t jitify_type_js_comment = "JS block comment";
-jitify_token_type_t jitify_type_js_line_comment = "JS line comment";
-
 static int is_ident_char(char c)
 {
   return isalnum(c) || (c == '_') || (c == '$') || (c == '\\') || (c >= 127) || (c < 0);
 }
 
-static jitify_status_t js_transform(jitify_lexer_t *lexer, const void *data, size_t length, size_t starting_offset)
+static JITIFY_INLINE jitify_status_t js_transform(jitify_lexer_t *lexer, const void *data, size_t length, size_t starting_offset,
+  int remove_space, int remove_comments)
 {
   const char *buf = data;
   jitify_js_state_t *state = lexer->state;
@@ -31,20 +27,24 @@ static jitify_status_t js_transform(jitify_lexer_t *lexer, const void *data, siz
    * a newline and any block comment with a space.  The minify logic
    * that happens later might further reduce these.
    */
-  if (lexer->remove_comments) {
-    if (lexer->token_type == jitify_type_js_comment) {
-      buf = " ";
-      length = 1;
-      lexer->token_type = jitify_type_js_whitespace;
-    }
-    else if (lexer->token_type == jitify_type_js_line_comment) {
-      buf = "\n";
-      length = 1;
-      lexer->token_type = jitify_type_js_newline;
+  if (remove_comments) {
+    switch (lexer->token_type) {
+      case jitify_type_js_comment:
+        buf = " ";
+        length = 1;
+        lexer->token_type = jitify_type_js_whitespace;
+        break;
+      case jitify_type_js_line_comment:
+        buf = "\n";
+        length = 1;
+        lexer->token_type = jitify_type_js_newline;
+        break;
+      default:
+        break;
     }
   }
   
-  if (!lexer->remove_space) {
+  if (!remove_space) {
     const char *last = buf + length;
     while (--last >= buf) {
       if ((*last != ' ') && (*last != '\t')) {
@@ -52,7 +52,7 @@ static jitify_status_t js_transform(jitify_lexer_t *lexer, const void *data, siz
         break;
       }
     }
-    if (jitify_write(lexer, buf, length) < 0) {
+    if (jitify_write_ref(lexer, buf, length) < 0) {
       return JITIFY_ERROR;
     }
     else {
@@ -68,61 +68,69 @@ static jitify_status_t js_transform(jitify_lexer_t *lexer, const void *data, siz
    * state->last_written and hold any space or newline in
    * state->pending until the next token is seen.
    */
-  if (lexer->token_type == jitify_type_js_whitespace) {
-    if (state->pending) {
-      /* There's already a space or newline pending, so we don't need this space */
-    }
-    else if (is_ident_char(state->last_written)) {
-      /* We might need to output this space, so hold onto it */
-      state->pending = ' ';
-    }
-    return JITIFY_OK;
-  }
-  else if (lexer->token_type == jitify_type_js_newline) {
-    if (state->pending == '\n') {
-      /* There's already a newline pending, so we don't need this one */
-    }
-    else if (state->pending == ' ') {
-      /* There was a space at the end of the line; discard it */
-      state->pending = '\n';
-    }
-    else if (is_ident_char(state->last_written) ||
-             (state->last_written == '}') || (state->last_written == ']') || (state->last_written == ')') ||
-             (state->last_written == '+') || (state->last_written == '-') || (state->last_written == '"') ||
-             (state->last_written == '\'')) {
-      /* We might need to output this newline, depending on what follows it */
-      state->pending = '\n';
-    }
-    return JITIFY_OK;
-  }
-  else {
-    if (state->pending == '\n') {
-      if (is_ident_char(*buf) || (*buf == '{') || (*buf == '[') || (*buf == '(') || (*buf == '+') || (*buf == '-')) {
-        if (jitify_write(lexer, &(state->pending), 1) < 0) {
-          return JITIFY_ERROR;
+  switch (lexer->token_type) {
+    case jitify_type_js_whitespace:
+      if (state->pending) {
+        /* There's already a space or newline pending, so we don't need this space */
+      }
+      else if (is_ident_char(state->last_written)) {
+        /* We might need to output this space, so hold onto it */
+        state->pending = ' ';
+      }
+      return JITIFY_OK;
+    case jitify_type_js_newline:
+      if (state->pending == '\n') {
+        /* There's already a newline pending, so we don't need this one */
+      }
+      else if (state->pending == ' ') {
+        /* There was a space at the end of the line; discard it */
+        state->pending = '\n';
+      }
+      else if (is_ident_char(state->last_written) ||
+               (state->last_written == '}') || (state->last_written == ']') || (state->last_written == ')') ||
+               (state->last_written == '+') || (state->last_written == '-') || (state->last_written == '"') ||
+               (state->last_written == '\'')) {
+        /* We might need to output this newline, depending on what follows it */
+        state->pending = '\n';
+      }
+      return JITIFY_OK;
+    default:
+      if (state->pending == '\n') {
+        if (is_ident_char(*buf) || (*buf == '{') || (*buf == '[') || (*buf == '(') || (*buf == '+') || (*buf == '-')) {
+          if (jitify_write(lexer, &(state->pending), 1) < 0) {
+            return JITIFY_ERROR;
+          }
+          state->last_written = state->pending;
         }
-        state->last_written = state->pending;
+        state->pending = 0;
       }
-      state->pending = 0;
-    }
-    else if (state->pending == ' ') {
-      if (is_ident_char(*buf)) {
-        if (jitify_write(lexer, &(state->pending), 1) < 0) {
-          return JITIFY_ERROR;
+      else if (state->pending == ' ') {
+        if (is_ident_char(*buf)) {
+          if (jitify_write(lexer, &(state->pending), 1) < 0) {
+            return JITIFY_ERROR;
+          }
         }
+        state->pending = 0;
+      }
+      state->last_written = buf[length - 1];
+      if (jitify_write_ref(lexer, buf, length) < 0) {
+        return JITIFY_ERROR;
+      }
+      else {
+        return JITIFY_OK;
       }
-      state->pending = 0;
-    }
-    state->last_written = buf[length - 1];
-    if (jitify_write(lexer, buf, length) < 0) {
-      return JITIFY_ERROR;
-    }
-    else {
-      return JITIFY_OK;
-    }
   }
 }
 
+TRANSFORM_VARIANTS(js_transform);
+
+static void js_reset(jitify_lexer_t *lexer)
+{
+  jitify_js_state_t *state = lexer->state;
+  memset(state, 0, sizeof(*state));
+  state->last_written = '\n';
+}
+
 static void js_cleanup(jitify_lexer_t *lexer)
 {
   jitify_free(lexer->pool, lexer->state);
@@ -137,7 +145,9 @@ jitify_lexer_t *jitify_js_lexer_create(jitify_pool_t *pool, jitify_output_stream
   state->html_comment = 0;
   lexer->state = state;
   lexer->scan = jitify_js_scan;
-  lexer->transform = js_transform;
+  lexer->transform_variants = js_transform_variants;
+  jitify_lexer_set_minify_rules(lexer, 0, 0);
+  lexer->reset = js_reset;
   lexer->cleanup = js_cleanup;
   return lexer;
 }
@@ -5,11 +5,6 @@
 
 #ifdef JITIFY_INTERNAL
 
-extern jitify_token_type_t jitify_type_js_whitespace;
-extern jitify_token_type_t jitify_type_js_newline;
-extern jitify_token_type_t jitify_type_js_comment;
-extern jitify_token_type_t jitify_type_js_line_comment;
-
 typedef struct {
   char last_written;
   char pending;
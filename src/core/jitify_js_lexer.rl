@@ -11,40 +11,49 @@
   include jitify_common "jitify_lexer_common.rl";
   
   js_space = /[ \t]/+
-    >{ TOKEN_START(jitify_type_js_whitespace); } %{ TOKEN_END; };
+    >{ PROFILE_ENTER(js_space);
+       TOKEN_START(jitify_type_js_whitespace);
+       SKIP_WHILE(jitify_charset_js_space); }
+    %{ TOKEN_END;
+       PROFILE_LEAVE(js_space); };
   
   _line_end = ( /\r/? /\n/ );
   
   js_line_end = _line_end+
-    >{ TOKEN_START(jitify_type_js_newline); } %{ TOKEN_END; };
+    >{ PROFILE_ENTER(js_line_end); TOKEN_START(jitify_type_js_newline); } %{ TOKEN_END; PROFILE_LEAVE(js_line_end); };
   
   html_comment ='-->' %{ state->html_comment = 1; };
   
   single_quoted = (
-    "'" ( [^'\\] | /\\./)* "'"
-  ) >{ TOKEN_START(jitify_token_type_misc); } %{ TOKEN_END; };
+    "'" ( [^'\\] @{ SKIP_UNTIL(jitify_charset_single_quoted_end); } | /\\./)* "'"
+  ) >{ PROFILE_ENTER(js_string); TOKEN_START(jitify_token_type_misc); } %{ TOKEN_END; PROFILE_LEAVE(js_string); };
 
   double_quoted = (
-    '"' ( [^"\\] | /\\./ )* '"'
-  ) >{ TOKEN_START(jitify_token_type_misc); } %{ TOKEN_END; };
+    '"' ( [^"\\] @{ SKIP_UNTIL(jitify_charset_double_quoted_end); } | /\\./ )* '"'
+  ) >{ PROFILE_ENTER(js_string); TOKEN_START(jitify_token_type_misc); } %{ TOKEN_END; PROFILE_LEAVE(js_string); };
   
   js_misc = (
     any - [ \t\r\n'"/]
-  )+ >{ TOKEN_START(jitify_token_type_misc); } %{ TOKEN_END; };
+  )+ >{ PROFILE_ENTER(js_misc);
+        TOKEN_START(jitify_token_type_misc);
+        SKIP_UNTIL(jitify_charset_js_misc_end); }
+     %{ TOKEN_END;
+        PROFILE_LEAVE(js_misc); };
 
   line_comment = (
-    ( ( any | html_comment ) - _line_end )* :>> _line_end @{ state->slash_elem_complete = 1; }
-  ) >{ TOKEN_TYPE(jitify_type_js_line_comment); state->html_comment = 0; }
-  $eof{ state->slash_elem_complete = 1; }
+    ( ( any @{ SKIP_UNTIL_UNLESS(jitify_charset_js_line_comment_hold, jitify_charset_js_line_comment_end); } |
+        html_comment ) - _line_end )* :>> _line_end @{ state->slash_elem_complete = 1; PROFILE_FINISH(js_line_comment); }
+  ) >{ PROFILE_ENTER(js_line_comment); TOKEN_TYPE(jitify_type_js_line_comment); state->html_comment = 0; }
+  $eof{ state->slash_elem_complete = 1; PROFILE_LEAVE(js_line_comment); }
   ;
 
   block_comment = (
-    ( any )* :>> '*/' @{ state->slash_elem_complete = 1; }
-  ) >{ TOKEN_TYPE(jitify_type_js_comment); };
+    ( any @{ SKIP_UNTIL_UNLESS(jitify_charset_star, jitify_charset_star); } )* :>> '*/' @{ state->slash_elem_complete = 1; PROFILE_FINISH(js_block_comment); }
+  ) >{ PROFILE_ENTER(js_block_comment); TOKEN_TYPE(jitify_type_js_comment); };
 
   regex = (
-    ( [^\\/] | /\\./ )+ :>> '/' @{ state->slash_elem_complete = 1; }
-  );
+    ( [^\\/] | /\\./ )+ :>> '/' @{ state->slash_elem_complete = 1; PROFILE_FINISH(js_regex); }
+  ) >{ PROFILE_ENTER(js_regex); };
   
   slash_element_perhaps_regex := (
     '/' @{ TOKEN_START(jitify_token_type_misc); state->slash_elem_complete = 0; }
@@ -1,14 +1,64 @@
 #include <string.h>
-#include <sys/time.h>
+#include <time.h>
 #define JITIFY_INTERNAL
 #include "jitify_lexer.h"
 
-jitify_token_type_t jitify_token_type_misc = "Miscellaneous";
+static const char *token_type_names[JITIFY_NUM_TOKEN_TYPES] = {
+  [jitify_token_type_misc] = "Miscellaneous",
+  [jitify_type_css_selector] = "CSS selector",
+  [jitify_type_css_term] = "CSS term",
+  [jitify_type_css_comment] = "CSS comment",
+  [jitify_type_css_optional_whitespace] = "CSS optional space",
+  [jitify_type_css_required_whitespace] = "CSS required space",
+  [jitify_type_css_url] = "CSS URL",
+  [jitify_type_html_anchor_open] = "HTML anchor",
+  [jitify_type_html_comment] = "HTML comment",
+  [jitify_type_html_img_open] = "HTML img",
+  [jitify_type_html_link_open] = "HTML link",
+  [jitify_type_html_script_open] = "HTML script",
+  [jitify_type_html_space] = "HTML space",
+  [jitify_type_html_tag] = "HTML tag",
+  [jitify_type_js_whitespace] = "JS space",
+  [jitify_type_js_newline] = "JS newline",
+  [jitify_type_js_comment] = "JS block comment",
+  [jitify_type_js_line_comment] = "JS line comment"
+};
+
+/* jitify_lexer_get_stats() reports every token type */
+typedef char jitify_token_types_fit_in_stats[(JITIFY_NUM_TOKEN_TYPES <= JITIFY_MAX_TOKEN_TYPES) ? 1 : -1];
+
+const char *jitify_token_type_name(jitify_token_type_t type)
+{
+  if ((unsigned)type >= JITIFY_NUM_TOKEN_TYPES) {
+    return NULL;
+  }
+  return token_type_names[type];
+}
+
+/* CLOCK_MONOTONIC_COARSE is read without a syscall or a hardware
+ * timer access, so it costs next to nothing per buffer.  Its resolution
+ * is a scheduler tick, but a scan that spans a tick is charged a whole
+ * tick, so the cumulative total remains accurate over many buffers.
+ * Build with -DJITIFY_PRECISE_CLOCK for exact per-scan times.
+ */
+#if defined(CLOCK_MONOTONIC_COARSE) && !defined(JITIFY_PRECISE_CLOCK)
+#define JITIFY_CLOCK CLOCK_MONOTONIC_COARSE
+#else
+#define JITIFY_CLOCK CLOCK_MONOTONIC
+#endif
+
+static unsigned long long clock_nsec()
+{
+  struct timespec now;
+  clock_gettime(JITIFY_CLOCK, &now);
+  return (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
 
 static int failsafe_send(jitify_lexer_t *lexer, const void *data, size_t len, size_t offset)
 {
   lexer->token_type = jitify_token_type_misc;
-  switch (lexer->transform(lexer, data, len, offset)) {
+  lexer->failsafe_bytes += len;
+  switch (jitify_lexer_transform(lexer, data, len, offset, 0)) {
     case JITIFY_OK:
     return (int)len;
     case JITIFY_AGAIN:
@@ -22,6 +72,9 @@ void jitify_lexer_set_minify_rules(jitify_lexer_t *lexer, int remove_space, int
 {
   lexer->remove_space = remove_space;
   lexer->remove_comments = remove_comments;
+  if (lexer->transform_variants) {
+    lexer->transform = lexer->transform_variants[MINIFY_VARIANT(remove_space, remove_comments)];
+  }
 }
 
 void jitify_lexer_set_max_setaside(jitify_lexer_t *lexer, size_t max)
@@ -29,58 +82,249 @@ void jitify_lexer_set_max_setaside(jitify_lexer_t *lexer, size_t max)
   lexer->setaside_max = max;
 }
 
-static void setaside_buffer(jitify_lexer_t *lexer, size_t remaining)
+void jitify_lexer_set_retain_input(jitify_lexer_t *lexer, int retain_input)
+{
+  lexer->retain_input = retain_input;
+}
+
+/* Copy segments are allocated at least this large, so that a token
+ * arriving in many small buffers uses few segments
+ */
+#define SETASIDE_SEG_SIZE 4096
+
+static jitify_setaside_seg_t *setaside_seg_alloc(jitify_lexer_t *lexer, size_t len)
 {
-  if (!lexer->setaside) {
-    lexer->setaside = jitify_malloc(lexer->pool, lexer->setaside_max);
+  jitify_setaside_seg_t *seg = lexer->setaside_free;
+  if (seg && (seg->size >= len)) {
+    lexer->setaside_free = seg->next;
   }
-  if (lexer->setaside_len == 0) {
-    lexer->setaside_offset = lexer->starting_offset + (lexer->token_start - lexer->buf);
+  else {
+    seg = jitify_malloc(lexer->pool, sizeof(*seg));
+    seg->size = (len > SETASIDE_SEG_SIZE) ? len : SETASIDE_SEG_SIZE;
+    seg->copy = jitify_malloc(lexer->pool, seg->size);
   }
-  memcpy(lexer->setaside + lexer->setaside_len, lexer->token_start, remaining);
-  lexer->setaside_len += remaining;
+  seg->next = NULL;
+  seg->data = seg->copy;
+  seg->len = 0;
+  return seg;
 }
 
-int jitify_lexer_scan(jitify_lexer_t *lexer, const void *data, size_t len, int is_eof)
+static jitify_setaside_seg_t *setaside_ref_alloc(jitify_lexer_t *lexer)
+{
+  jitify_setaside_seg_t *seg = lexer->setaside_ref_free;
+  if (seg) {
+    lexer->setaside_ref_free = seg->next;
+  }
+  else {
+    seg = jitify_malloc(lexer->pool, sizeof(*seg));
+  }
+  return seg;
+}
+
+static void setaside_ref_release(jitify_lexer_t *lexer, jitify_setaside_seg_t *seg)
+{
+  seg->next = lexer->setaside_ref_free;
+  lexer->setaside_ref_free = seg;
+}
+
+/* Append data to the setaside, referencing it if copy is false and
+ * copying it otherwise; the caller sets setaside_offset if the
+ * setaside was empty.  Copies are packed into the tail segment when
+ * it has room, so each byte is copied only once.
+ */
+static void setaside_append(jitify_lexer_t *lexer, const char *data, size_t len, int copy)
+{
+  jitify_setaside_seg_t *tail = lexer->setaside_tail;
+  jitify_setaside_seg_t *seg;
+  lexer->setaside_len += len;
+  if (copy && tail && tail->copy && (tail->size - tail->len >= len)) {
+    memcpy(tail->copy + tail->len, data, len);
+    tail->len += len;
+    return;
+  }
+  if (copy) {
+    seg = setaside_seg_alloc(lexer, len);
+    memcpy(seg->copy, data, len);
+  }
+  else {
+    seg = setaside_ref_alloc(lexer);
+    seg->next = NULL;
+    seg->data = data;
+    seg->copy = NULL;
+    seg->size = 0;
+  }
+  seg->len = len;
+  if (tail) {
+    tail->next = seg;
+  }
+  else {
+    lexer->setaside_head = seg;
+  }
+  lexer->setaside_tail = seg;
+}
+
+static void setaside_clear(jitify_lexer_t *lexer)
+{
+  jitify_setaside_seg_t *seg = lexer->setaside_head;
+  while (seg) {
+    jitify_setaside_seg_t *next = seg->next;
+    if (seg->copy) {
+      seg->next = lexer->setaside_free;
+      lexer->setaside_free = seg;
+    }
+    else {
+      setaside_ref_release(lexer, seg);
+    }
+    seg = next;
+  }
+  lexer->setaside_head = lexer->setaside_tail = NULL;
+  lexer->setaside_len = 0;
+}
+
+/* Replace the segments that reference input with copies */
+static void setaside_own(jitify_lexer_t *lexer)
+{
+  jitify_setaside_seg_t *seg = lexer->setaside_head;
+  while (seg && seg->copy) {
+    seg = seg->next;
+  }
+  if (!seg) {
+    return;
+  }
+  seg = lexer->setaside_head;
+  lexer->setaside_head = lexer->setaside_tail = NULL;
+  lexer->setaside_len = 0;
+  while (seg) {
+    jitify_setaside_seg_t *next = seg->next;
+    if (seg->copy) {
+      seg->next = NULL;
+      if (lexer->setaside_tail) {
+        lexer->setaside_tail->next = seg;
+      }
+      else {
+        lexer->setaside_head = seg;
+      }
+      lexer->setaside_tail = seg;
+      lexer->setaside_len += seg->len;
+    }
+    else {
+      setaside_append(lexer, seg->data, seg->len, 1);
+      setaside_ref_release(lexer, seg);
+    }
+    seg = next;
+  }
+}
+
+static void setaside_seg_list_free(jitify_lexer_t *lexer, jitify_setaside_seg_t *seg)
+{
+  while (seg) {
+    jitify_setaside_seg_t *next = seg->next;
+    jitify_free(lexer->pool, seg->copy);
+    jitify_free(lexer->pool, seg);
+    seg = next;
+  }
+}
+
+/* Send the setaside unmodified, one segment at a time, for tokens
+ * too long to reassemble
+ */
+static void setaside_send_unmodified(jitify_lexer_t *lexer)
+{
+  jitify_setaside_seg_t *seg;
+  size_t offset = lexer->setaside_offset;
+  lexer->token_type = jitify_token_type_misc;
+  for (seg = lexer->setaside_head; seg; seg = seg->next) {
+    jitify_lexer_transform(lexer, seg->data, seg->len, offset, 1);
+    offset += seg->len;
+  }
+  setaside_clear(lexer);
+}
+
+/* Reassemble the setaside followed by [data, data+len) into one
+ * contiguous span.  When the setaside is a single copy segment with
+ * room to spare, the tail is appended in place; otherwise everything
+ * is gathered into lexer->setaside, which grows by doubling and is
+ * kept for reuse.
+ */
+static const char *setaside_gather(jitify_lexer_t *lexer, const char *data, size_t len)
+{
+  jitify_setaside_seg_t *seg = lexer->setaside_head;
+  size_t total = lexer->setaside_len + len;
+  char *dst;
+  if (!seg->next && seg->copy && (seg->size - seg->len >= len)) {
+    memcpy(seg->copy + seg->len, data, len);
+    return seg->copy;
+  }
+  if (lexer->setaside_size < total) {
+    size_t new_size = lexer->setaside_size ? lexer->setaside_size : SETASIDE_SEG_SIZE;
+    while (new_size < total) {
+      new_size *= 2;
+    }
+    jitify_free(lexer->pool, lexer->setaside);
+    lexer->setaside = jitify_malloc(lexer->pool, new_size);
+    lexer->setaside_size = new_size;
+  }
+  dst = lexer->setaside;
+  for (; seg; seg = seg->next) {
+    memcpy(dst, seg->data, seg->len);
+    dst += seg->len;
+  }
+  memcpy(dst, data, len);
+  return lexer->setaside;
+}
+
+/* Scan one segment of input, setting aside any partial token at its
+ * end by reference; the caller must make the setaside its own before
+ * the segment's memory can go away
+ */
+static int scan_segment(jitify_lexer_t *lexer, const char *data, size_t len, int is_eof)
 {
   int rc;
-  struct timeval start_time, end_time;
-  long elapsed_usec;
   int bytes_scanned;
 
-  lexer->setaside_overflow = 0;
   lexer->buf = data;
-  lexer->err = NULL;
-  gettimeofday(&start_time, NULL);
+  lexer->buf_end = data + len;
   if (lexer->failsafe_mode) {
     rc = failsafe_send(lexer, data, len, lexer->starting_offset);
     bytes_scanned = len;
   }
   else {
     lexer->token_start = data;
+#ifdef JITIFY_PROFILE
+    jitify_profile_resume(lexer);
+    bytes_scanned = lexer->scan(lexer, data, len, is_eof);
+    jitify_profile_pause(lexer);
+#else
     bytes_scanned = lexer->scan(lexer, data, len, is_eof);
+#endif
+    if (lexer->failsafe_mode) {
+      lexer->failsafe_events++;
+    }
     if (bytes_scanned < 0) {
       rc = bytes_scanned;
     }
     else if (bytes_scanned == (int)len) {
       if (lexer->token_start) {
-        size_t remaining = (const char *)data + len - lexer->token_start;
+        size_t remaining = data + len - lexer->token_start;
         if (remaining) {
           /* Partially matched token at end of buffer */
           if (remaining + lexer->setaside_len <= lexer->setaside_max) {
             /* We have enough space to set aside this partial token until we get more data */
-            setaside_buffer(lexer, remaining);
+            if (lexer->setaside_len == 0) {
+              lexer->setaside_offset = CURRENT_OFFSET(lexer->token_start);
+              lexer->setasides++;
+            }
+            setaside_append(lexer, lexer->token_start, remaining, 0);
           }
           else {
             /* Not enough space to set aside this token, so send it unmodified */
-            lexer->token_type = jitify_token_type_misc;
             if (lexer->setaside_len) {
-              lexer->transform(lexer, lexer->setaside, lexer->setaside_len, lexer->setaside_offset);
-              lexer->setaside_len = 0;
+              setaside_send_unmodified(lexer);
             }
-            lexer->transform(lexer, lexer->token_start, remaining, CURRENT_OFFSET(lexer->token_start));
-            /* TODO check transform return code */
+            lexer->token_type = jitify_token_type_misc;
+            jitify_lexer_transform(lexer, lexer->token_start, remaining, CURRENT_OFFSET(lexer->token_start), 1);
             lexer->setaside_overflow = 1;
+            lexer->setaside_overflows++;
           }
         }
       }
@@ -88,7 +332,7 @@ int jitify_lexer_scan(jitify_lexer_t *lexer, const void *data, size_t len, int i
     }
     else {
       if (lexer->failsafe_mode) {
-        rc = failsafe_send(lexer, (char *)data + bytes_scanned, len - bytes_scanned, lexer->starting_offset + bytes_scanned);
+        rc = failsafe_send(lexer, data + bytes_scanned, len - bytes_scanned, lexer->starting_offset + bytes_scanned);
         bytes_scanned = len;
       }
       else {
@@ -96,9 +340,6 @@ int jitify_lexer_scan(jitify_lexer_t *lexer, const void *data, size_t len, int i
       }
     }
   }
-  gettimeofday(&end_time, NULL);
-  elapsed_usec = (end_time.tv_sec * 1000000 + end_time.tv_usec) - (start_time.tv_sec * 1000000 + start_time.tv_usec);
-  lexer->duration += elapsed_usec;
   lexer->bytes_in += bytes_scanned;
   if (bytes_scanned > 0) {
     lexer->starting_offset += bytes_scanned;
@@ -106,19 +347,78 @@ int jitify_lexer_scan(jitify_lexer_t *lexer, const void *data, size_t len, int i
   return rc;
 }
 
+int jitify_lexer_scanv(jitify_lexer_t *lexer, const jitify_iovec_t *segs, size_t num_segs, int is_eof)
+{
+  static const jitify_iovec_t empty = { NULL, 0 };
+  int rc = 0;
+  int total = 0;
+  size_t i;
+  unsigned long long start_time;
+
+  if (num_segs == 0) {
+    segs = &empty;
+    num_segs = 1;
+  }
+  lexer->setaside_overflow = 0;
+  lexer->output_failed = 0;
+  lexer->err = NULL;
+  start_time = clock_nsec();
+  for (i = 0; i < num_segs; i++) {
+    rc = scan_segment(lexer, segs[i].data, segs[i].len, is_eof && (i + 1 == num_segs));
+    if (rc < 0) {
+      break;
+    }
+    total += rc;
+    if (rc != (int)segs[i].len) {
+      break;
+    }
+  }
+  if (!lexer->retain_input) {
+    setaside_own(lexer);
+  }
+  if (rc >= 0) {
+    rc = total;
+  }
+  /* Transforms run deep within the generated scanners, which carry on
+   * regardless, so a failed write is only reported once the scan ends
+   */
+  if ((jitify_flush(lexer) < 0) || lexer->output_failed) {
+    rc = -1;
+  }
+  lexer->duration += clock_nsec() - start_time;
+  return rc;
+}
+
+int jitify_lexer_scan(jitify_lexer_t *lexer, const void *data, size_t len, int is_eof)
+{
+  jitify_iovec_t seg;
+  seg.data = data;
+  seg.len = len;
+  return jitify_lexer_scanv(lexer, &seg, 1, is_eof);
+}
+
 void jitify_lexer_destroy(jitify_lexer_t *lexer)
 {
   if (lexer) {
+#ifdef JITIFY_PROFILE
+    jitify_profile_dump(lexer, stderr);
+#endif
     if (lexer->cleanup) {
       lexer->cleanup(lexer);
     }
     jitify_array_destroy(lexer->attrs);
+    setaside_clear(lexer);
+    setaside_seg_list_free(lexer, lexer->setaside_free);
+    setaside_seg_list_free(lexer, lexer->setaside_ref_free);
     jitify_free(lexer->pool, lexer->setaside);
     jitify_free(lexer->pool, lexer);
   }
 }
 
-#define DEFAULT_MAX_SETASIDE 1024
+/* Setaside memory is only used as needed, so the limit can be
+ * generous; it bounds the memory held by a single runaway token
+ */
+#define DEFAULT_MAX_SETASIDE (256 * 1024)
 
 jitify_lexer_t *jitify_lexer_create(jitify_pool_t *pool, jitify_output_stream_t *out)
 {
@@ -135,9 +435,63 @@ jitify_lexer_t *jitify_lexer_create(jitify_pool_t *pool, jitify_output_stream_t
   return lexer;
 }
 
+void jitify_lexer_reset(jitify_lexer_t *lexer)
+{
+  size_t i;
+  lexer->initialized = 0;
+  lexer->failsafe_mode = 0;
+  jitify_lexer_set_minify_rules(lexer, 0, 0);
+  for (i = 0; i < lexer->cdnify_rules_len; i++) {
+    jitify_free(lexer->pool, lexer->cdnify_rules[i].replacement);
+  }
+  lexer->cdnify_rules_len = 0;
+  setaside_clear(lexer);
+  lexer->retain_input = 0;
+  lexer->setaside_max = DEFAULT_MAX_SETASIDE;
+  lexer->setaside_overflow = 0;
+  lexer->output_failed = 0;
+  lexer->setaside_overflows = 0;
+  lexer->setaside_offset = 0;
+  lexer->token_type = jitify_token_type_misc;
+  lexer->token_start = NULL;
+  lexer->duration = 0;
+  lexer->bytes_in = 0;
+  lexer->bytes_out = 0;
+  memset(lexer->token_counts, 0, sizeof(lexer->token_counts));
+  lexer->trace = NULL;
+  lexer->trace_arg = NULL;
+  lexer->setasides = 0;
+  lexer->failsafe_events = 0;
+  lexer->failsafe_bytes = 0;
+  lexer->staging_len = 0;
+  lexer->err = NULL;
+  lexer->buf = lexer->buf_end = NULL;
+  lexer->starting_offset = 0;
+  lexer->subtoken_offset = 0;
+  lexer->num_attrs = 0;
+  lexer->current_attr = NULL;
+  lexer->attrs_resolved = 0;
+  lexer->cs = 0;
+  lexer->act = 0;
+#ifdef JITIFY_PROFILE
+  /* Counts accumulate across documents until the lexer is destroyed */
+  lexer->profile.depth = 0;
+#endif
+  if (lexer->reset) {
+    lexer->reset(lexer);
+  }
+}
+
+void jitify_lexer_set_output_stream(jitify_lexer_t *lexer, jitify_output_stream_t *out)
+{
+  lexer->out = out;
+}
+
+typedef jitify_lexer_t *(*create_lexer_t)(jitify_pool_t *pool, jitify_output_stream_t *out);
+
 typedef struct {
   const char *content_type;
-  jitify_lexer_t *(*create_lexer)(jitify_pool_t *pool, jitify_output_stream_t *out);
+  create_lexer_t create_lexer;
 } content_type_to_lexer_t;
 
 static content_type_to_lexer_t content_type_map[] = {
@@ -149,30 +503,147 @@ static content_type_to_lexer_t content_type_map[] = {
   { NULL, NULL }
 };
 
-jitify_lexer_t *jitify_lexer_for_content_type(const char *content_type, jitify_pool_t *pool, jitify_output_stream_t *out)
+#define NUM_CONTENT_TYPES (sizeof(content_type_map) / sizeof(content_type_map[0]) - 1)
+
+int jitify_num_content_types()
+{
+  return NUM_CONTENT_TYPES;
+}
+
+int jitify_content_type_index(const char *content_type)
 {
   const char *delimiter;
-  content_type_to_lexer_t *mapping;
+  size_t length;
+  int i;
   if (!content_type) {
-    return NULL;
+    return -1;
   }
   delimiter = strchr(content_type, ';');
-  if (delimiter) {
-    size_t length = delimiter - content_type;
-    char *new_content_type = jitify_malloc(pool, length + 1);
-    memcpy(new_content_type, content_type, length);
-    new_content_type[length] = 0;
-    content_type = new_content_type;
-  }
+  length = delimiter ? (size_t)(delimiter - content_type) : strlen(content_type);
   // TODO: replace with a sub-O(n) lookup if the number of map entries ever exceeds single digits
-  for (mapping = content_type_map; mapping->content_type; mapping++) {
-    if (!strcasecmp(content_type, mapping->content_type)) {
-      return mapping->create_lexer(pool, out);
+  for (i = 0; content_type_map[i].content_type; i++) {
+    if ((strlen(content_type_map[i].content_type) == length) &&
+        !strncasecmp(content_type, content_type_map[i].content_type, length)) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+const char *jitify_content_type_name(int index)
+{
+  if ((index < 0) || (index >= (int)NUM_CONTENT_TYPES)) {
+    return NULL;
+  }
+  return content_type_map[index].content_type;
+}
+
+static create_lexer_t create_fn_for_content_type(const char *content_type)
+{
+  int index = jitify_content_type_index(content_type);
+  return (index < 0) ? NULL : content_type_map[index].create_lexer;
+}
+
+jitify_lexer_t *jitify_lexer_for_content_type(const char *content_type, jitify_pool_t *pool, jitify_output_stream_t *out)
+{
+  create_lexer_t create = create_fn_for_content_type(content_type);
+  return create ? create(pool, out) : NULL;
+}
+
+typedef struct {
+  create_lexer_t create;
+  jitify_lexer_t *idle;
+  size_t num_idle;
+} lexer_free_list_t;
+
+struct jitify_lexer_cache_s {
+  jitify_pool_t *pool;
+  size_t max_idle;
+  lexer_free_list_t free_lists[NUM_CONTENT_TYPES]; /* At most one per content type */
+};
+
+jitify_lexer_cache_t *jitify_lexer_cache_create(jitify_pool_t *pool, size_t max_idle)
+{
+  jitify_lexer_cache_t *cache = jitify_calloc(pool, sizeof(*cache));
+  cache->pool = pool;
+  cache->max_idle = max_idle;
+  return cache;
+}
+
+static lexer_free_list_t *free_list_for(jitify_lexer_cache_t *cache, create_lexer_t create)
+{
+  size_t i;
+  for (i = 0; i < NUM_CONTENT_TYPES; i++) {
+    lexer_free_list_t *list = &(cache->free_lists[i]);
+    if (!list->create) {
+      list->create = create;
+    }
+    if (list->create == create) {
+      return list;
     }
   }
   return NULL;
 }
 
+jitify_lexer_t *jitify_lexer_cache_acquire(jitify_lexer_cache_t *cache, const char *content_type,
+  jitify_output_stream_t *out)
+{
+  create_lexer_t create = create_fn_for_content_type(content_type);
+  lexer_free_list_t *list;
+  jitify_lexer_t *lexer;
+  if (!create) {
+    return NULL;
+  }
+  list = free_list_for(cache, create);
+  if (list->idle) {
+    lexer = list->idle;
+    list->idle = lexer->next_idle;
+    list->num_idle--;
+    lexer->next_idle = NULL;
+    jitify_lexer_set_output_stream(lexer, out);
+  }
+  else {
+    lexer = create(cache->pool, out);
+    lexer->create = create;
+  }
+  return lexer;
+}
+
+void jitify_lexer_cache_release(jitify_lexer_cache_t *cache, jitify_lexer_t *lexer)
+{
+  lexer_free_list_t *list;
+  if (!lexer) {
+    return;
+  }
+  list = lexer->create ? free_list_for(cache, lexer->create) : NULL;
+  if (!list || (list->num_idle >= cache->max_idle)) {
+    jitify_lexer_destroy(lexer);
+    return;
+  }
+  jitify_lexer_reset(lexer);
+  lexer->out = NULL;
+  lexer->next_idle = list->idle;
+  list->idle = lexer;
+  list->num_idle++;
+}
+
+void jitify_lexer_cache_destroy(jitify_lexer_cache_t *cache)
+{
+  size_t i;
+  if (!cache) {
+    return;
+  }
+  for (i = 0; i < NUM_CONTENT_TYPES; i++) {
+    jitify_lexer_t *lexer = cache->free_lists[i].idle;
+    while (lexer) {
+      jitify_lexer_t *next = lexer->next_idle;
+      jitify_lexer_destroy(lexer);
+      lexer = next;
+    }
+  }
+  jitify_free(cache->pool, cache);
+}
+
 size_t jitify_lexer_get_bytes_in(jitify_lexer_t *lexer)
 {
   return lexer->bytes_in;
@@ -185,7 +656,7 @@ size_t jitify_lexer_get_bytes_out(jitify_lexer_t *lexer)
 
 size_t jitify_lexer_get_processing_time(jitify_lexer_t *lexer)
 {
-  return lexer->duration;
+  return (size_t)(lexer->duration / 1000);
 }
 
 const char *jitify_lexer_get_err(jitify_lexer_t *lexer)
@@ -193,35 +664,111 @@ const char *jitify_lexer_get_err(jitify_lexer_t *lexer)
   return lexer->err;
 }
 
+size_t jitify_lexer_get_setaside_overflows(jitify_lexer_t *lexer)
+{
+  return lexer->setaside_overflows;
+}
+
+void jitify_lexer_get_stats(jitify_lexer_t *lexer, jitify_lexer_stats_t *stats)
+{
+  size_t i;
+  memset(stats, 0, sizeof(*stats));
+  stats->bytes_in = lexer->bytes_in;
+  stats->bytes_out = lexer->bytes_out;
+  stats->processing_time = lexer->duration;
+  stats->setasides = lexer->setasides;
+  stats->setaside_overflows = lexer->setaside_overflows;
+  stats->failsafe_events = lexer->failsafe_events;
+  stats->failsafe_bytes = lexer->failsafe_bytes;
+  stats->num_token_types = JITIFY_NUM_TOKEN_TYPES;
+  stats->has_pool_stats = (jitify_pool_get_stats(lexer->pool, &(stats->pool)) == JITIFY_OK);
+  for (i = 0; i < JITIFY_NUM_TOKEN_TYPES; i++) {
+    const jitify_token_counts_t *counts = &(lexer->token_counts[i]);
+    jitify_token_stats_t *token_stats = &(stats->token_types[i]);
+    token_stats->name = token_type_names[i];
+    token_stats->tokens = counts->tokens;
+    token_stats->bytes_in = counts->bytes_in;
+    token_stats->bytes_out = counts->bytes_out;
+    if (counts->bytes_in > counts->bytes_out) {
+      token_stats->bytes_removed = counts->bytes_in - counts->bytes_out;
+    }
+  }
+}
+
+void jitify_lexer_set_trace(jitify_lexer_t *lexer, jitify_trace_callback_t callback, void *arg)
+{
+  lexer->trace = callback;
+  lexer->trace_arg = arg;
+}
+
+void jitify_lexer_trace(jitify_lexer_t *lexer, jitify_token_type_t type, const void *data,
+  size_t offset, size_t length_in, size_t length_out, int setaside)
+{
+  jitify_token_trace_t token;
+  token.type = type;
+  token.name = token_type_names[type];
+  token.offset = offset;
+  token.length_in = length_in;
+  token.length_out = length_out;
+  token.setaside = setaside;
+  token.data = data;
+  lexer->trace(&token, lexer->trace_arg);
+}
+
 void jitify_transform_with_setaside(jitify_lexer_t *lexer, const char *p)
 {
   size_t length = p - lexer->token_start;
   if (length + lexer->setaside_len <= lexer->setaside_max) {
-    memcpy(lexer->setaside + lexer->setaside_len, lexer->token_start, length);
-    lexer->transform(lexer, lexer->setaside, lexer->setaside_len + length, lexer->setaside_offset);
-    // TODO: check transform return code
+    const char *token = setaside_gather(lexer, lexer->token_start, length);
+    jitify_lexer_transform(lexer, token, lexer->setaside_len + length, lexer->setaside_offset, 1);
+    setaside_clear(lexer);
   }
   else {
+    setaside_send_unmodified(lexer);
+    lexer->setaside_overflows++;
     lexer->token_type = jitify_token_type_misc;
-    lexer->transform(lexer, lexer->setaside, lexer->setaside_len, lexer->setaside_offset);
-    lexer->transform(lexer, lexer->token_start, length, lexer->starting_offset); // TODO: double-check the offset
+    jitify_lexer_transform(lexer, lexer->token_start, length, CURRENT_OFFSET(lexer->token_start), 1);
+  }
+}
+
+jitify_attr_t *jitify_lexer_push_attr(jitify_lexer_t *lexer)
+{
+  jitify_attr_t *attr;
+  if (lexer->num_attrs < JITIFY_INLINE_ATTRS) {
+    attr = &(lexer->inline_attrs[lexer->num_attrs]);
+    memset(attr, 0, sizeof(*attr));
+  }
+  else {
+    if (lexer->num_attrs == JITIFY_INLINE_ATTRS) {
+      jitify_array_clear(lexer->attrs);
+    }
+    attr = jitify_array_push(lexer->attrs);
+  }
+  lexer->num_attrs++;
+  return attr;
+}
+
+jitify_attr_t *jitify_lexer_get_attr(jitify_lexer_t *lexer, size_t index)
+{
+  if (index >= lexer->num_attrs) {
+    return NULL;
+  }
+  else if (index < JITIFY_INLINE_ATTRS) {
+    return &(lexer->inline_attrs[index]);
+  }
+  else {
+    return jitify_array_get(lexer->attrs, index - JITIFY_INLINE_ATTRS);
   }
-  lexer->setaside_len = 0;
 }
 
 void jitify_lexer_resolve_attrs(jitify_lexer_t *lexer, const char *buf, size_t starting_offset)
 {
-  size_t i, num_attrs;
+  size_t i;
   if (!lexer || lexer->attrs_resolved) {
     return;
   }
-  if (!lexer->attrs) {
-    lexer->attrs_resolved = 1;
-    return;
-  }
-  num_attrs = jitify_array_length(lexer->attrs);
-  for (i = 0; i < num_attrs; i++) {
-    jitify_attr_t *attr = jitify_array_get(lexer->attrs, i);
+  for (i = 0; i < lexer->num_attrs; i++) {
+    jitify_attr_t *attr = jitify_lexer_get_attr(lexer, i);
     if (attr->key.len) {
       attr->key.data.buf = buf + attr->key.data.offset - starting_offset;
     }
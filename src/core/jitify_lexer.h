@@ -7,9 +7,74 @@
 
 #ifdef JITIFY_INTERNAL
 
-typedef const char *jitify_token_type_t;
+/* Token types of all the lexers, numbered densely so that transforms
+ * can dispatch on them with a switch
+ */
+typedef enum {
+  jitify_token_type_misc,
 
-extern jitify_token_type_t jitify_token_type_misc;
+  /* CSS, also used for <style> blocks within HTML */
+  jitify_type_css_selector,
+  jitify_type_css_term,
+  jitify_type_css_comment,
+  jitify_type_css_optional_whitespace,
+  jitify_type_css_required_whitespace,
+  jitify_type_css_url,
+
+  /* HTML */
+  jitify_type_html_anchor_open,
+  jitify_type_html_comment,
+  jitify_type_html_img_open,
+  jitify_type_html_link_open,
+  jitify_type_html_script_open,
+  jitify_type_html_space,
+  jitify_type_html_tag,
+
+  /* JavaScript */
+  jitify_type_js_whitespace,
+  jitify_type_js_newline,
+  jitify_type_js_comment,
+  jitify_type_js_line_comment,
+
+  JITIFY_NUM_TOKEN_TYPES
+} jitify_token_type_t;
+
+extern const char *jitify_token_type_name(jitify_token_type_t type);
+
+/* Grammar rules instrumented in a JITIFY_PROFILE build */
+typedef enum {
+  /* CSS, also used for <style> blocks within HTML */
+  jitify_rule_css_at_rule,
+  jitify_rule_css_comment,
+  jitify_rule_css_declaration,
+  jitify_rule_css_function_args,
+  jitify_rule_css_ruleset,
+  jitify_rule_css_selector,
+  jitify_rule_css_space,
+  jitify_rule_css_term,
+
+  /* HTML */
+  jitify_rule_html_attrs,
+  jitify_rule_html_comment,
+  jitify_rule_html_content,
+  jitify_rule_html_script,
+  jitify_rule_html_space,
+  jitify_rule_html_style,
+  jitify_rule_html_tag,
+
+  /* JavaScript */
+  jitify_rule_js_block_comment,
+  jitify_rule_js_line_comment,
+  jitify_rule_js_line_end,
+  jitify_rule_js_misc,
+  jitify_rule_js_regex,
+  jitify_rule_js_space,
+  jitify_rule_js_string,
+
+  JITIFY_NUM_PROFILE_RULES
+} jitify_profile_rule_t;
+
+extern const char *jitify_profile_rule_name(jitify_profile_rule_t rule);
 
 typedef struct {
   const char *data;
@@ -37,6 +102,65 @@ typedef struct {
   jitify_str_t *replacement; /* NULL means "don't CDNify a link that matches this prefix" */
 } jitify_cdnify_rule_t;
 
+/* Most tags have only a few attributes, so the first JITIFY_INLINE_ATTRS
+ * of each tag are stored in the lexer itself and only the rest spill
+ * into a jitify_array_t
+ */
+#define JITIFY_INLINE_ATTRS 8
+
+/* Small writes are combined in a per-lexer staging buffer and passed
+ * to the output stream in one call when it fills up or the scan ends
+ */
+#define JITIFY_STAGING_SIZE 512
+
+/* A piece of a token that spans input buffers.  The data is either
+ * copied into the segment's own buffer or, if the lexer may retain its
+ * input, referenced where it lies.
+ */
+typedef struct jitify_setaside_seg_s jitify_setaside_seg_t;
+
+struct jitify_setaside_seg_s {
+  jitify_setaside_seg_t *next;
+  const char *data;
+  size_t len;
+  char *copy;  /* Buffer owned by this segment, NULL for a reference */
+  size_t size; /* Bytes allocated for copy */
+};
+
+/* Per-token-type counters reported by jitify_lexer_get_stats() */
+typedef struct {
+  size_t tokens;
+  size_t bytes_in;
+  size_t bytes_out;
+} jitify_token_counts_t;
+
+#ifdef JITIFY_PROFILE
+
+#define JITIFY_PROFILE_MAX_DEPTH 16
+
+typedef struct {
+  size_t entries;
+  size_t bytes;
+  unsigned long long nsec; /* Time spent in the rule itself, excluding nested rules */
+} jitify_profile_counts_t;
+
+/* Rules currently being matched, innermost last.  A rule whose
+ * leaving action never runs (e.g. an alternative that was abandoned,
+ * or one that ends where its enclosing rule does) is closed when an
+ * enclosing rule is left.
+ */
+typedef struct {
+  jitify_profile_counts_t rules[JITIFY_NUM_PROFILE_RULES];
+  jitify_profile_rule_t stack[JITIFY_PROFILE_MAX_DEPTH];
+  size_t start_offset[JITIFY_PROFILE_MAX_DEPTH];
+  size_t depth;
+  unsigned long long last_event; /* Time of the last enter, leave or resume */
+} jitify_profile_t;
+
+#endif /* JITIFY_PROFILE */
+
+typedef jitify_status_t (*jitify_transform_t)(jitify_lexer_t *lexer, const void *data, size_t length, size_t offset);
+
 struct jitify_lexer_s {
   void *state;
   jitify_pool_t *pool;
@@ -54,34 +178,66 @@ struct jitify_lexer_s {
   size_t cdnify_rules_len;   /* Number of items in cdnify_rules */
   size_t cdnify_rules_size;  /* Max @ of items that cdnify_rules is sized to hold */
   
-  jitify_status_t (*transform)(jitify_lexer_t *lexer, const void *data, size_t length, size_t offset);
+  jitify_transform_t transform;
+  const jitify_transform_t *transform_variants; /* Indexed by MINIFY_VARIANT() */
   int (*scan)(jitify_lexer_t *lexer, const void *data, size_t length, int is_eof);
+  void (*reset)(jitify_lexer_t *lexer); /* Reinitializes state for jitify_lexer_reset() */
   void (*cleanup)(jitify_lexer_t *lexer);
   
-  char *setaside;
+  /* Set by jitify_lexer_cache_t for the lexers it manages */
+  jitify_lexer_t *(*create)(jitify_pool_t *pool, jitify_output_stream_t *out);
+  jitify_lexer_t *next_idle;
+  
+  /* Partial token carried over from previous buffers */
+  jitify_setaside_seg_t *setaside_head;
+  jitify_setaside_seg_t *setaside_tail;
+  jitify_setaside_seg_t *setaside_free; /* Segments with copy buffers, kept for reuse */
+  jitify_setaside_seg_t *setaside_ref_free; /* Segments that referenced input, kept for reuse */
   size_t setaside_max;
-  size_t setaside_len;
+  size_t setaside_len; /* Total length of the segments */
   int setaside_overflow; /* True iff a cross-buffer token exceeded setaside_max */
+  int output_failed; /* True iff a transform failed to write its output during this scan */
+  size_t setaside_overflows; /* Cumulative number of tokens sent unmodified because they exceeded setaside_max */
   size_t setaside_offset; /* Offset from start of document of 1st byte of setaside */
+  int retain_input; /* Whether input buffers stay valid after jitify_lexer_scan() returns */
+  char *setaside; /* Contiguous buffer in which a completed token is reassembled */
+  size_t setaside_size; /* Bytes allocated for setaside */
   
   jitify_token_type_t token_type;
   const char *token_start;
   
-  long duration; /* Cumulative time spent in this lexer, in usec */
+  unsigned long long duration; /* Cumulative time spent in this lexer, in nsec */
   size_t bytes_in; /* Cumulative input bytes processed by this lexer */
   size_t bytes_out; /* Cumulative bytes of output produced by this lexer */
   
+  jitify_token_counts_t token_counts[JITIFY_NUM_TOKEN_TYPES];
+  jitify_trace_callback_t trace;
+  void *trace_arg;
+  size_t setasides; /* Number of partial tokens set aside at the end of a buffer */
+  size_t failsafe_events; /* Number of times the lexer switched to failsafe mode */
+  size_t failsafe_bytes; /* Input bytes passed through unmodified in failsafe mode */
+  
+  char staging[JITIFY_STAGING_SIZE]; /* Output not yet passed to the output stream */
+  size_t staging_len;
+  
   const char *err; /* Location of error within input buf, NULL if no error */
   
   const char *buf; /* Start of current buffer */
+  const char *buf_end; /* End of current buffer */
   size_t starting_offset; /* Offset from start of document of 1st byte of current buffer */
   
   size_t subtoken_offset; /* Offset from start of document of current subtoken */
   
-  jitify_array_t *attrs; /* Array of jitify_attr_t* */
-  jitify_attr_t *current_attr; /* Points into attrs or is NULL */
+  jitify_attr_t inline_attrs[JITIFY_INLINE_ATTRS]; /* First attributes of the current tag */
+  jitify_array_t *attrs; /* Array of jitify_attr_t holding any further attributes */
+  size_t num_attrs; /* Total number of attributes of the current tag */
+  jitify_attr_t *current_attr; /* Points into inline_attrs or attrs, or is NULL */
   int attrs_resolved; /* whether the keys and values in attrs have been converted from offsets to char* */
   
+#ifdef JITIFY_PROFILE
+  jitify_profile_t profile;
+#endif
+  
   /* The following fields support Ragel-generated parsers */
   int cs;
   int act;
@@ -89,10 +245,167 @@ struct jitify_lexer_s {
 
 extern jitify_lexer_t *jitify_lexer_create(jitify_pool_t *pool, jitify_output_stream_t *out);
 
+/**
+ * Pass any output held in the staging buffer to the output stream
+ * @return a negative number if the output stream reported an error
+ */
+extern int jitify_flush(jitify_lexer_t *lexer);
+
 extern void jitify_transform_with_setaside(jitify_lexer_t *lexer, const char *p);
 
+extern jitify_attr_t *jitify_lexer_push_attr(jitify_lexer_t *lexer);
+
+/**
+ * @return the index'th attribute of the current tag, or NULL if there are fewer
+ */
+extern jitify_attr_t *jitify_lexer_get_attr(jitify_lexer_t *lexer, size_t index);
+
 extern void jitify_lexer_resolve_attrs(jitify_lexer_t *lexer, const char *buf, size_t starting_offset);
 
+#ifdef JITIFY_PROFILE
+
+extern void jitify_profile_enter(jitify_lexer_t *lexer, jitify_profile_rule_t rule, size_t offset);
+extern void jitify_profile_leave(jitify_lexer_t *lexer, jitify_profile_rule_t rule, size_t offset);
+
+/* Stop and restart the clock around each call into a Ragel machine */
+extern void jitify_profile_pause(jitify_lexer_t *lexer);
+extern void jitify_profile_resume(jitify_lexer_t *lexer);
+
+/* Close all open rules, e.g. on a syntax error */
+extern void jitify_profile_abort(jitify_lexer_t *lexer, size_t offset);
+
+extern void jitify_profile_dump(jitify_lexer_t *lexer, FILE *out);
+
+#define PROFILE_ENTER(rule)                      \
+  jitify_profile_enter(lexer, jitify_rule_##rule, CURRENT_OFFSET(p))
+
+#define PROFILE_LEAVE(rule)                      \
+  jitify_profile_leave(lexer, jitify_rule_##rule, CURRENT_OFFSET(p))
+
+/* For finishing actions, which run on the last byte of the rule */
+#define PROFILE_FINISH(rule)                     \
+  jitify_profile_leave(lexer, jitify_rule_##rule, CURRENT_OFFSET(p) + 1)
+
+#define PROFILE_ABORT                            \
+  jitify_profile_abort(lexer, CURRENT_OFFSET(p))
+
+#else
+
+#define PROFILE_ENTER(rule)
+#define PROFILE_LEAVE(rule)
+#define PROFILE_FINISH(rule)
+#define PROFILE_ABORT
+
+#endif /* JITIFY_PROFILE */
+
+/* Sets of "interesting" bytes for the bulk scanner in jitify_scan.c */
+
+#define JITIFY_CHARSET_MAX_LEN 8
+
+typedef struct {
+  const char *bytes;          /* Members of the set, for the vectorized search */
+  size_t len;                 /* Number of members; searches vectorize only up to JITIFY_CHARSET_MAX_LEN */
+  const unsigned char *table; /* 256-entry membership table, for the scalar search */
+} jitify_charset_t;
+
+extern const jitify_charset_t jitify_charset_space;
+extern const jitify_charset_t jitify_charset_newline;
+extern const jitify_charset_t jitify_charset_html_content_end;
+extern const jitify_charset_t jitify_charset_js_space;
+extern const jitify_charset_t jitify_charset_js_misc_end;
+extern const jitify_charset_t jitify_charset_html_comment_hold;
+extern const jitify_charset_t jitify_charset_html_comment_end;
+extern const jitify_charset_t jitify_charset_script_close_hold;
+extern const jitify_charset_t jitify_charset_less_than;
+extern const jitify_charset_t jitify_charset_css_comment_end;
+extern const jitify_charset_t jitify_charset_star;
+extern const jitify_charset_t jitify_charset_js_line_comment_hold;
+extern const jitify_charset_t jitify_charset_js_line_comment_end;
+extern const jitify_charset_t jitify_charset_single_quoted_end;
+extern const jitify_charset_t jitify_charset_double_quoted_end;
+extern const jitify_charset_t jitify_charset_single_quote;
+extern const jitify_charset_t jitify_charset_double_quote;
+
+/**
+ * @return pointer to the first byte in [p, pe) that is in set, or pe if there is none
+ */
+extern const char *jitify_find_first_of(const char *p, const char *pe, const jitify_charset_t *set);
+
+/**
+ * @return pointer to the first byte in [p, pe) that is not in set, or pe if there is none
+ */
+extern const char *jitify_find_first_not_of(const char *p, const char *pe, const jitify_charset_t *set);
+
+/* Each lexer provides a copy of its transform specialized for every
+ * combination of minification rules, so the per-token code doesn't
+ * have to test the rules; jitify_lexer_set_minify_rules() picks one.
+ */
+#define NUM_MINIFY_VARIANTS 4
+
+#define MINIFY_VARIANT(remove_space, remove_comments)                     \
+  (((remove_space) ? 1 : 0) | ((remove_comments) ? 2 : 0))
+
+#if defined(__GNUC__)
+#define JITIFY_INLINE inline __attribute__((always_inline))
+#else
+#define JITIFY_INLINE inline
+#endif
+
+extern void jitify_lexer_trace(jitify_lexer_t *lexer, jitify_token_type_t type, const void *data,
+  size_t offset, size_t length_in, size_t length_out, int setaside);
+
+/* Pass a token to the lexer's transform, counting it and its input
+ * and output bytes against the current token type.  setaside is
+ * nonzero if the token spanned input buffers.
+ */
+static JITIFY_INLINE jitify_status_t jitify_lexer_transform(jitify_lexer_t *lexer,
+  const void *data, size_t length, size_t offset, int setaside)
+{
+  jitify_token_type_t type = lexer->token_type;
+  jitify_token_counts_t *counts = &(lexer->token_counts[type]);
+  size_t bytes_out = lexer->bytes_out;
+  jitify_status_t rc = lexer->transform(lexer, data, length, offset);
+  if (rc == JITIFY_ERROR) {
+    lexer->output_failed = 1;
+  }
+  counts->tokens++;
+  counts->bytes_in += length;
+  counts->bytes_out += lexer->bytes_out - bytes_out;
+  if (lexer->trace) {
+    jitify_lexer_trace(lexer, type, data, offset, length, lexer->bytes_out - bytes_out, setaside);
+  }
+  return rc;
+}
+
+/* Defines name##_variants[] from a function
+ *   static JITIFY_INLINE jitify_status_t name(jitify_lexer_t *lexer, const void *data,
+ *     size_t length, size_t offset, int remove_space, int remove_comments)
+ */
+#define TRANSFORM_VARIANTS(name)                                          \
+  static jitify_status_t name##_00(jitify_lexer_t *lexer,                 \
+    const void *data, size_t length, size_t offset)                       \
+  {                                                                       \
+    return name(lexer, data, length, offset, 0, 0);                       \
+  }                                                                       \
+  static jitify_status_t name##_10(jitify_lexer_t *lexer,                 \
+    const void *data, size_t length, size_t offset)                       \
+  {                                                                       \
+    return name(lexer, data, length, offset, 1, 0);                       \
+  }                                                                       \
+  static jitify_status_t name##_01(jitify_lexer_t *lexer,                 \
+    const void *data, size_t length, size_t offset)                       \
+  {                                                                       \
+    return name(lexer, data, length, offset, 0, 1);                       \
+  }                                                                       \
+  static jitify_status_t name##_11(jitify_lexer_t *lexer,                 \
+    const void *data, size_t length, size_t offset)                       \
+  {                                                                       \
+    return name(lexer, data, length, offset, 1, 1);                       \
+  }                                                                       \
+  static const jitify_transform_t name##_variants[NUM_MINIFY_VARIANTS] = { \
+    name##_00, name##_10, name##_01, name##_11                            \
+  }
+
 #define CURRENT_OFFSET(ptr)                      \
   (lexer->starting_offset + (ptr - lexer->buf))
 
@@ -108,9 +421,10 @@ extern void jitify_lexer_resolve_attrs(jitify_lexer_t *lexer, const char *buf, s
     jitify_transform_with_setaside(lexer, p);    \
   }                                              \
   else {                                         \
-    lexer->transform(lexer, lexer->token_start,  \
+    jitify_lexer_transform(lexer,                \
+      lexer->token_start,                        \
       p - lexer->token_start,                    \
-      CURRENT_OFFSET(lexer->token_start));       \
+      CURRENT_OFFSET(lexer->token_start), 0);    \
   }                                              \
   TOKEN_START(jitify_token_type_misc);           \
   lexer->current_attr = NULL
@@ -118,7 +432,7 @@ extern void jitify_lexer_resolve_attrs(jitify_lexer_t *lexer, const char *buf, s
 #define ADD_ATTR                                 \
   if (!lexer->current_attr) {                    \
     lexer->current_attr =                        \
-      jitify_array_push(lexer->attrs);           \
+      jitify_lexer_push_attr(lexer);             \
   }
 
 #define ATTR_SET_QUOTE(q)                        \
@@ -148,8 +462,32 @@ extern void jitify_lexer_resolve_attrs(jitify_lexer_t *lexer, const char *buf, s
     CURRENT_OFFSET(p) - lexer->subtoken_offset;  \
   ATTR_END
 
+/* Fast-forward the machine across the rest of a run of bytes
+ * that would only take it around an action-free self-loop.  Use
+ * only in an action on the first byte of such a run: p is left
+ * on the last byte of the run, so the machine's own p++ resumes
+ * at the first byte that can change its state (or at pe).
+ */
+#define SKIP_UNTIL(set)                          \
+  p = jitify_find_first_of(p + 1, pe, &(set)) - 1
+
+#define SKIP_WHILE(set)                          \
+  p = jitify_find_first_not_of(p + 1, pe, &(set)) - 1
+
+/* Skip through the interior of a comment, script body or string
+ * up to the next byte that could start its terminator.  The skip
+ * is only safe when the current byte (in hold) can't be part of a
+ * partially matched terminator.  A terminator that straddles two
+ * buffers needs no special handling: the skip stops at its first
+ * byte, and the machine matches the rest one byte at a time.
+ */
+#define SKIP_UNTIL_UNLESS(hold, set)             \
+  if (!(hold).table[(unsigned char)*p]) {        \
+    SKIP_UNTIL(set);                             \
+  }
+
 #define RESET_ATTRS                              \
-  jitify_array_clear(lexer->attrs);              \
+  lexer->num_attrs = 0;                          \
   lexer->attrs_resolved = 0
 
 #endif /* JITIFY_INTERNAL */
@@ -1,3 +1,4 @@
+#include <string.h>
 #define JITIFY_INTERNAL
 #include "jitify.h"
 
@@ -23,6 +24,24 @@ void jitify_pool_destroy(jitify_pool_t *pool)
   }
 }
 
+jitify_status_t jitify_pool_reset(jitify_pool_t *pool)
+{
+  if (!pool->reset) {
+    return JITIFY_ERROR;
+  }
+  pool->reset(pool);
+  return JITIFY_OK;
+}
+
+jitify_status_t jitify_pool_get_stats(jitify_pool_t *pool, jitify_pool_stats_t *stats)
+{
+  if (!pool->stats) {
+    return JITIFY_ERROR;
+  }
+  pool->stats(pool, stats);
+  return JITIFY_OK;
+}
+
 static void *malloc_wrapper(jitify_pool_t *pool, size_t length)
 {
   return malloc(length);
@@ -52,6 +71,284 @@ jitify_pool_t *jitify_malloc_pool_create()
     p->calloc = calloc_wrapper;
     p->free = free_wrapper;
     p->cleanup = malloc_pool_cleanup;
+    p->reset = NULL;
+    p->stats = NULL;
+  }
+  return p;
+}
+
+/* Arena pool */
+
+#define DEFAULT_ARENA_CHUNK_SIZE 16384
+#define DEFAULT_ARENA_ALIGNMENT (2 * sizeof(void *))
+
+typedef struct arena_chunk_s arena_chunk_t;
+
+struct arena_chunk_s {
+  arena_chunk_t *next;
+  size_t size; /* Usable bytes following the header */
+};
+
+/* Space reserved for the chunk header, keeping the data that follows
+ * it aligned for any alignment up to 16
+ */
+#define CHUNK_HEADER_SIZE ((sizeof(arena_chunk_t) + 15) & ~(size_t)15)
+#define CHUNK_DATA(chunk) ((char *)(chunk) + CHUNK_HEADER_SIZE)
+
+typedef struct {
+  size_t chunk_size;
+  size_t alignment;
+  arena_chunk_t *chunks;    /* Chunks in use; the first is the one being carved up */
+  arena_chunk_t *spare;     /* Chunks retained for reuse by the last reset */
+  arena_chunk_t *oversized; /* Dedicated chunks for requests too large to share one */
+  char *next;               /* Bump pointer within the current chunk */
+  char *end;
+  jitify_pool_stats_t stats;
+} arena_t;
+
+static arena_chunk_t *arena_chunk_create(arena_t *arena, size_t size)
+{
+  arena_chunk_t *chunk = malloc(CHUNK_HEADER_SIZE + size);
+  if (chunk) {
+    chunk->size = size;
+    arena->stats.chunks++;
+    arena->stats.bytes_reserved += CHUNK_HEADER_SIZE + size;
+  }
+  return chunk;
+}
+
+static void arena_chunks_free(arena_t *arena, arena_chunk_t *chunk)
+{
+  while (chunk) {
+    arena_chunk_t *next = chunk->next;
+    arena->stats.chunks--;
+    arena->stats.bytes_reserved -= CHUNK_HEADER_SIZE + chunk->size;
+    free(chunk);
+    chunk = next;
+  }
+}
+
+static void *arena_malloc(jitify_pool_t *pool, size_t length)
+{
+  arena_t *arena = pool->state;
+  size_t mask = arena->alignment - 1;
+  arena_chunk_t *chunk;
+  char *block;
+  
+  arena->stats.allocs++;
+  arena->stats.bytes_allocated += length;
+  if (arena->stats.bytes_high_water < arena->stats.bytes_allocated) {
+    arena->stats.bytes_high_water = arena->stats.bytes_allocated;
+  }
+  length = (length + mask) & ~mask;
+  
+  /* Requests bigger than a quarter chunk would waste too much of the
+   * current chunk, so they get a chunk of their own
+   */
+  if (length > arena->chunk_size / 4) {
+    chunk = arena_chunk_create(arena, length);
+    if (!chunk) {
+      return NULL;
+    }
+    chunk->next = arena->oversized;
+    arena->oversized = chunk;
+    return CHUNK_DATA(chunk);
+  }
+  
+  block = (char *)(((size_t)arena->next + mask) & ~mask);
+  if (!arena->next || (length > (size_t)(arena->end - block))) {
+    if (arena->spare) {
+      chunk = arena->spare;
+      arena->spare = chunk->next;
+    }
+    else {
+      chunk = arena_chunk_create(arena, arena->chunk_size);
+      if (!chunk) {
+        return NULL;
+      }
+    }
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+    block = CHUNK_DATA(chunk);
+    arena->end = block + chunk->size;
+  }
+  arena->next = block + length;
+  return block;
+}
+
+static void *arena_calloc(jitify_pool_t *pool, size_t length)
+{
+  void *block = arena_malloc(pool, length);
+  if (block) {
+    memset(block, 0, length);
+  }
+  return block;
+}
+
+static void arena_free(jitify_pool_t *pool, void *object)
+{
+}
+
+/* Regular chunks are kept for reuse, so a pool that is reset between
+ * documents stops calling malloc once it has grown to fit the largest
+ */
+static void arena_reset(jitify_pool_t *pool)
+{
+  arena_t *arena = pool->state;
+  while (arena->chunks) {
+    arena_chunk_t *chunk = arena->chunks;
+    arena->chunks = chunk->next;
+    chunk->next = arena->spare;
+    arena->spare = chunk;
+  }
+  arena_chunks_free(arena, arena->oversized);
+  arena->oversized = NULL;
+  arena->next = arena->end = NULL;
+  arena->stats.allocs = 0;
+  arena->stats.bytes_allocated = 0;
+}
+
+static void arena_stats(jitify_pool_t *pool, jitify_pool_stats_t *stats)
+{
+  arena_t *arena = pool->state;
+  *stats = arena->stats;
+  stats->bytes_live = arena->stats.bytes_allocated;
+}
+
+static void arena_cleanup(jitify_pool_t *pool)
+{
+  arena_t *arena = pool->state;
+  arena_chunks_free(arena, arena->chunks);
+  arena_chunks_free(arena, arena->spare);
+  arena_chunks_free(arena, arena->oversized);
+  free(arena);
+  free(pool);
+}
+
+jitify_pool_t *jitify_arena_pool_create(size_t chunk_size, size_t alignment)
+{
+  jitify_pool_t *p;
+  arena_t *arena;
+  if (alignment == 0) {
+    alignment = DEFAULT_ARENA_ALIGNMENT;
+  }
+  if ((alignment & (alignment - 1)) || (alignment > 16)) {
+    return NULL;
+  }
+  if (chunk_size == 0) {
+    chunk_size = DEFAULT_ARENA_CHUNK_SIZE;
+  }
+  p = malloc(sizeof(*p));
+  arena = calloc(1, sizeof(*arena));
+  if (!p || !arena) {
+    free(p);
+    free(arena);
+    return NULL;
+  }
+  arena->chunk_size = chunk_size;
+  arena->alignment = alignment;
+  p->state = arena;
+  p->malloc = arena_malloc;
+  p->calloc = arena_calloc;
+  p->free = arena_free;
+  p->cleanup = arena_cleanup;
+  p->reset = arena_reset;
+  p->stats = arena_stats;
+  return p;
+}
+
+/* Counting pool */
+
+typedef struct {
+  jitify_pool_t *parent;
+  jitify_pool_stats_t stats;
+} counting_pool_t;
+
+/* Each block is preceded by its length, so that frees can be counted;
+ * the header is padded to keep the block aligned for any type
+ */
+#define COUNT_HEADER_SIZE ((sizeof(size_t) + 15) & ~(size_t)15)
+
+static void *counting_malloc(jitify_pool_t *pool, size_t length)
+{
+  counting_pool_t *counter = pool->state;
+  char *block = jitify_malloc(counter->parent, COUNT_HEADER_SIZE + length);
+  if (!block) {
+    return NULL;
+  }
+  *(size_t *)block = length;
+  counter->stats.allocs++;
+  counter->stats.bytes_allocated += length;
+  counter->stats.bytes_live += length;
+  if (counter->stats.bytes_high_water < counter->stats.bytes_live) {
+    counter->stats.bytes_high_water = counter->stats.bytes_live;
+  }
+  return block + COUNT_HEADER_SIZE;
+}
+
+static void *counting_calloc(jitify_pool_t *pool, size_t length)
+{
+  void *block = counting_malloc(pool, length);
+  if (block) {
+    memset(block, 0, length);
+  }
+  return block;
+}
+
+static void counting_free(jitify_pool_t *pool, void *object)
+{
+  counting_pool_t *counter = pool->state;
+  char *block;
+  if (!object) {
+    return;
+  }
+  block = (char *)object - COUNT_HEADER_SIZE;
+  counter->stats.bytes_live -= *(size_t *)block;
+  jitify_free(counter->parent, block);
+}
+
+static void counting_reset(jitify_pool_t *pool)
+{
+  counting_pool_t *counter = pool->state;
+  jitify_pool_reset(counter->parent);
+  counter->stats.allocs = 0;
+  counter->stats.bytes_allocated = 0;
+  counter->stats.bytes_live = 0;
+}
+
+static void counting_stats(jitify_pool_t *pool, jitify_pool_stats_t *stats)
+{
+  counting_pool_t *counter = pool->state;
+  jitify_pool_stats_t parent_stats;
+  *stats = counter->stats;
+  if (jitify_pool_get_stats(counter->parent, &parent_stats) == JITIFY_OK) {
+    stats->bytes_reserved = parent_stats.bytes_reserved;
+    stats->chunks = parent_stats.chunks;
+  }
+}
+
+static void counting_cleanup(jitify_pool_t *pool)
+{
+  free(pool->state);
+  free(pool);
+}
+
+jitify_pool_t *jitify_counting_pool_create(jitify_pool_t *parent)
+{
+  jitify_pool_t *p = malloc(sizeof(*p));
+  counting_pool_t *counter = calloc(1, sizeof(*counter));
+  if (!p || !counter) {
+    free(p);
+    free(counter);
+    return NULL;
   }
+  counter->parent = parent;
+  p->state = counter;
+  p->malloc = counting_malloc;
+  p->calloc = counting_calloc;
+  p->free = counting_free;
+  p->cleanup = counting_cleanup;
+  p->reset = parent->reset ? counting_reset : NULL;
+  p->stats = counting_stats;
   return p;
 }
@@ -0,0 +1,134 @@
+#include <time.h>
+#define JITIFY_INTERNAL
+#include "jitify_lexer.h"
+
+static const char *profile_rule_names[JITIFY_NUM_PROFILE_RULES] = {
+  [jitify_rule_css_at_rule] = "css_at_rule",
+  [jitify_rule_css_comment] = "css_comment",
+  [jitify_rule_css_declaration] = "css_declaration",
+  [jitify_rule_css_function_args] = "css_function_args",
+  [jitify_rule_css_ruleset] = "css_ruleset",
+  [jitify_rule_css_selector] = "css_selector",
+  [jitify_rule_css_space] = "css_space",
+  [jitify_rule_css_term] = "css_term",
+  [jitify_rule_html_attrs] = "html_attrs",
+  [jitify_rule_html_comment] = "html_comment",
+  [jitify_rule_html_content] = "html_content",
+  [jitify_rule_html_script] = "html_script",
+  [jitify_rule_html_space] = "html_space",
+  [jitify_rule_html_style] = "html_style",
+  [jitify_rule_html_tag] = "html_tag",
+  [jitify_rule_js_block_comment] = "js_block_comment",
+  [jitify_rule_js_line_comment] = "js_line_comment",
+  [jitify_rule_js_line_end] = "js_line_end",
+  [jitify_rule_js_misc] = "js_misc",
+  [jitify_rule_js_regex] = "js_regex",
+  [jitify_rule_js_space] = "js_space",
+  [jitify_rule_js_string] = "js_string"
+};
+
+const char *jitify_profile_rule_name(jitify_profile_rule_t rule)
+{
+  if ((unsigned)rule >= JITIFY_NUM_PROFILE_RULES) {
+    return NULL;
+  }
+  return profile_rule_names[rule];
+}
+
+#ifdef JITIFY_PROFILE
+
+/* Profiling wants the precise clock even though reading it costs more */
+static unsigned long long clock_nsec()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/* Charge the time since the last event to the innermost open rule */
+static void profile_charge(jitify_profile_t *profile, unsigned long long now)
+{
+  if (profile->depth) {
+    profile->rules[profile->stack[profile->depth - 1]].nsec += now - profile->last_event;
+  }
+  profile->last_event = now;
+}
+
+/* Close the open rules at index depth and above */
+static void profile_pop(jitify_profile_t *profile, size_t depth, size_t offset)
+{
+  while (profile->depth > depth) {
+    profile->depth--;
+    profile->rules[profile->stack[profile->depth]].bytes += offset - profile->start_offset[profile->depth];
+  }
+}
+
+void jitify_profile_enter(jitify_lexer_t *lexer, jitify_profile_rule_t rule, size_t offset)
+{
+  jitify_profile_t *profile = &(lexer->profile);
+  size_t top = profile->depth;
+  /* Alternatives that share a rule may each enter it on the same byte */
+  if (top && (profile->stack[top - 1] == rule) && (profile->start_offset[top - 1] == offset)) {
+    return;
+  }
+  profile_charge(profile, clock_nsec());
+  profile->rules[rule].entries++;
+  if (top < JITIFY_PROFILE_MAX_DEPTH) {
+    profile->stack[top] = rule;
+    profile->start_offset[top] = offset;
+    profile->depth++;
+  }
+}
+
+void jitify_profile_leave(jitify_lexer_t *lexer, jitify_profile_rule_t rule, size_t offset)
+{
+  jitify_profile_t *profile = &(lexer->profile);
+  size_t i = profile->depth;
+  while (i > 0) {
+    i--;
+    if (profile->stack[i] == rule) {
+      profile_charge(profile, clock_nsec());
+      profile_pop(profile, i, offset);
+      return;
+    }
+  }
+}
+
+void jitify_profile_pause(jitify_lexer_t *lexer)
+{
+  profile_charge(&(lexer->profile), clock_nsec());
+}
+
+void jitify_profile_resume(jitify_lexer_t *lexer)
+{
+  lexer->profile.last_event = clock_nsec();
+}
+
+void jitify_profile_abort(jitify_lexer_t *lexer, size_t offset)
+{
+  jitify_profile_t *profile = &(lexer->profile);
+  profile_charge(profile, clock_nsec());
+  profile_pop(profile, 0, offset);
+}
+
+void jitify_profile_dump(jitify_lexer_t *lexer, FILE *out)
+{
+  const jitify_profile_t *profile = &(lexer->profile);
+  size_t i;
+  int first = 1;
+  for (i = 0; i < JITIFY_NUM_PROFILE_RULES; i++) {
+    const jitify_profile_counts_t *counts = &(profile->rules[i]);
+    if (!counts->entries) {
+      continue;
+    }
+    if (first) {
+      fprintf(out, "%-20s %10s %12s %14s %10s\n", "rule", "entries", "bytes", "nsec", "nsec/byte");
+      first = 0;
+    }
+    fprintf(out, "%-20s %10lu %12lu %14llu %10.2f\n", profile_rule_names[i],
+      (unsigned long)counts->entries, (unsigned long)counts->bytes, counts->nsec,
+      counts->bytes ? (double)counts->nsec / counts->bytes : 0.0);
+  }
+}
+
+#endif /* JITIFY_PROFILE */
@@ -0,0 +1,191 @@
+#define JITIFY_INTERNAL
+#include "jitify_lexer.h"
+
+/* Bulk character-class search used by the lexers to skip over runs
+ * of bytes that can't change the state of the Ragel machine.  The
+ * x86-64 build uses SSE2 (always available there) or, if the CPU
+ * supports it, AVX2; other platforms use a table-driven loop.
+ */
+
+#if defined(__GNUC__) && defined(__x86_64__) && !defined(JITIFY_NO_SIMD)
+#define JITIFY_SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+#define SPACE_TABLE_ENTRIES                      \
+  ['\t'] = 1, ['\n'] = 1, ['\v'] = 1,            \
+  ['\f'] = 1, ['\r'] = 1, [' '] = 1
+
+static const unsigned char space_table[256] = { SPACE_TABLE_ENTRIES };
+const jitify_charset_t jitify_charset_space = { "\t\n\v\f\r ", 6, space_table };
+
+static const unsigned char newline_table[256] = { ['\n'] = 1, ['\r'] = 1 };
+const jitify_charset_t jitify_charset_newline = { "\n\r", 2, newline_table };
+
+static const unsigned char html_content_end_table[256] = { SPACE_TABLE_ENTRIES, ['<'] = 1 };
+const jitify_charset_t jitify_charset_html_content_end = { "<\t\n\v\f\r ", 7, html_content_end_table };
+
+static const unsigned char js_space_table[256] = { ['\t'] = 1, [' '] = 1 };
+const jitify_charset_t jitify_charset_js_space = { "\t ", 2, js_space_table };
+
+static const unsigned char js_misc_end_table[256] = {
+  ['\t'] = 1, ['\n'] = 1, ['\r'] = 1, [' '] = 1, ['\''] = 1, ['"'] = 1, ['/'] = 1
+};
+const jitify_charset_t jitify_charset_js_misc_end = { "\t\n\r '\"/", 7, js_misc_end_table };
+
+/* Terminators of comments, script bodies and quoted strings.  The
+ * "hold" sets list the bytes after which the machine may be part way
+ * through matching a terminator, so it mustn't be skipped ahead.
+ */
+
+/* '>' is included because "<!--" is also a prefix of a misc
+ * directive, which ends at the first '>'
+ */
+static const unsigned char html_comment_hold_table[256] = { ['-'] = 1, ['['] = 1, ['i'] = 1, ['f'] = 1, ['>'] = 1 };
+const jitify_charset_t jitify_charset_html_comment_hold = { "-[if>", 5, html_comment_hold_table };
+
+static const unsigned char html_comment_end_table[256] = { ['-'] = 1, ['['] = 1, ['>'] = 1 };
+const jitify_charset_t jitify_charset_html_comment_end = { "-[>", 3, html_comment_end_table };
+
+static const unsigned char script_close_hold_table[256] = {
+  ['<'] = 1, ['/'] = 1, ['>'] = 1,
+  ['s'] = 1, ['c'] = 1, ['r'] = 1, ['i'] = 1, ['p'] = 1, ['t'] = 1,
+  ['S'] = 1, ['C'] = 1, ['R'] = 1, ['I'] = 1, ['P'] = 1, ['T'] = 1
+};
+const jitify_charset_t jitify_charset_script_close_hold = { "</>scriptSCRIPT", 15, script_close_hold_table };
+
+static const unsigned char less_than_table[256] = { ['<'] = 1 };
+const jitify_charset_t jitify_charset_less_than = { "<", 1, less_than_table };
+
+/* '{' is included because a comment after "@media" is also a
+ * prefix of the media list, which ends at the first '{'
+ */
+static const unsigned char css_comment_end_table[256] = { ['*'] = 1, ['{'] = 1 };
+const jitify_charset_t jitify_charset_css_comment_end = { "*{", 2, css_comment_end_table };
+
+static const unsigned char star_table[256] = { ['*'] = 1 };
+const jitify_charset_t jitify_charset_star = { "*", 1, star_table };
+
+static const unsigned char js_line_comment_hold_table[256] = { ['\n'] = 1, ['\r'] = 1, ['-'] = 1, ['>'] = 1 };
+const jitify_charset_t jitify_charset_js_line_comment_hold = { "\n\r->", 4, js_line_comment_hold_table };
+
+static const unsigned char js_line_comment_end_table[256] = { ['\n'] = 1, ['\r'] = 1, ['-'] = 1 };
+const jitify_charset_t jitify_charset_js_line_comment_end = { "\n\r-", 3, js_line_comment_end_table };
+
+static const unsigned char single_quoted_end_table[256] = { ['\''] = 1, ['\\'] = 1 };
+const jitify_charset_t jitify_charset_single_quoted_end = { "'\\", 2, single_quoted_end_table };
+
+static const unsigned char double_quoted_end_table[256] = { ['"'] = 1, ['\\'] = 1 };
+const jitify_charset_t jitify_charset_double_quoted_end = { "\"\\", 2, double_quoted_end_table };
+
+static const unsigned char single_quote_table[256] = { ['\''] = 1 };
+const jitify_charset_t jitify_charset_single_quote = { "'", 1, single_quote_table };
+
+static const unsigned char double_quote_table[256] = { ['"'] = 1 };
+const jitify_charset_t jitify_charset_double_quote = { "\"", 1, double_quote_table };
+
+typedef const char *(*find_fn_t)(const char *p, const char *pe, const jitify_charset_t *set, int invert);
+
+static const char *find_scalar(const char *p, const char *pe, const jitify_charset_t *set, int invert)
+{
+  const unsigned char *table = set->table;
+  unsigned char wanted = invert ? 0 : 1;
+  for (; p < pe; p++) {
+    if (table[(unsigned char)*p] == wanted) {
+      return p;
+    }
+  }
+  return pe;
+}
+
+#ifdef JITIFY_SCAN_X86
+
+static const char *find_sse2(const char *p, const char *pe, const jitify_charset_t *set, int invert)
+{
+  __m128i needles[JITIFY_CHARSET_MAX_LEN];
+  unsigned int flip = invert ? 0xffff : 0;
+  size_t i, num_needles = set->len;
+  if (num_needles > JITIFY_CHARSET_MAX_LEN) {
+    return find_scalar(p, pe, set, invert);
+  }
+  for (i = 0; i < num_needles; i++) {
+    needles[i] = _mm_set1_epi8(set->bytes[i]);
+  }
+  while (pe - p >= 16) {
+    __m128i block = _mm_loadu_si128((const __m128i *)p);
+    __m128i hits = _mm_cmpeq_epi8(block, needles[0]);
+    unsigned int mask;
+    for (i = 1; i < num_needles; i++) {
+      hits = _mm_or_si128(hits, _mm_cmpeq_epi8(block, needles[i]));
+    }
+    mask = (unsigned int)_mm_movemask_epi8(hits) ^ flip;
+    if (mask) {
+      return p + __builtin_ctz(mask);
+    }
+    p += 16;
+  }
+  return find_scalar(p, pe, set, invert);
+}
+
+__attribute__((target("avx2")))
+static const char *find_avx2(const char *p, const char *pe, const jitify_charset_t *set, int invert)
+{
+  __m256i needles[JITIFY_CHARSET_MAX_LEN];
+  unsigned int flip = invert ? 0xffffffff : 0;
+  size_t i, num_needles = set->len;
+  if (num_needles > JITIFY_CHARSET_MAX_LEN) {
+    return find_scalar(p, pe, set, invert);
+  }
+  for (i = 0; i < num_needles; i++) {
+    needles[i] = _mm256_set1_epi8(set->bytes[i]);
+  }
+  while (pe - p >= 32) {
+    __m256i block = _mm256_loadu_si256((const __m256i *)p);
+    __m256i hits = _mm256_cmpeq_epi8(block, needles[0]);
+    unsigned int mask;
+    for (i = 1; i < num_needles; i++) {
+      hits = _mm256_or_si256(hits, _mm256_cmpeq_epi8(block, needles[i]));
+    }
+    mask = (unsigned int)_mm256_movemask_epi8(hits) ^ flip;
+    if (mask) {
+      return p + __builtin_ctz(mask);
+    }
+    p += 32;
+  }
+  return find_scalar(p, pe, set, invert);
+}
+
+#endif /* JITIFY_SCAN_X86 */
+
+static const char *find_resolve(const char *p, const char *pe, const jitify_charset_t *set, int invert);
+
+/* Chosen on first use; the race between threads resolving it
+ * concurrently is harmless because they all pick the same function.
+ */
+static find_fn_t find_impl = find_resolve;
+
+static const char *find_resolve(const char *p, const char *pe, const jitify_charset_t *set, int invert)
+{
+#ifdef JITIFY_SCAN_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    find_impl = find_avx2;
+  }
+  else {
+    find_impl = find_sse2;
+  }
+#else
+  find_impl = find_scalar;
+#endif
+  return find_impl(p, pe, set, invert);
+}
+
+const char *jitify_find_first_of(const char *p, const char *pe, const jitify_charset_t *set)
+{
+  return find_impl(p, pe, set, 0);
+}
+
+const char *jitify_find_first_not_of(const char *p, const char *pe, const jitify_charset_t *set)
+{
+  return find_impl(p, pe, set, 1);
+}
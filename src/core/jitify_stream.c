@@ -2,13 +2,59 @@
 #include "jitify.h"
 #include "jitify_lexer.h"
 
+/* Writes up to this size are staged; larger ones go straight to the
+ * output stream, since copying them buys nothing.  The same bound
+ * keeps short spans from being passed to write_ref, as they're cheaper
+ * to copy than to describe with a buffer of their own.
+ */
+#define MAX_STAGED_WRITE (JITIFY_STAGING_SIZE / 2)
+
+int jitify_flush(jitify_lexer_t *lexer)
+{
+  int rv = 0;
+  if (lexer->staging_len) {
+    rv = lexer->out->write(lexer->out, lexer->staging, lexer->staging_len);
+    lexer->staging_len = 0;
+  }
+  return rv;
+}
 
 int jitify_write(jitify_lexer_t *lexer, const void *data, size_t length)
 {
   int rv;
-  rv = lexer->out->write(lexer->out, data, length);
   lexer->bytes_out += length;
-  return rv;
+  if (length <= MAX_STAGED_WRITE) {
+    if (lexer->staging_len + length > JITIFY_STAGING_SIZE) {
+      rv = jitify_flush(lexer);
+      if (rv < 0) {
+        return rv;
+      }
+    }
+    memcpy(lexer->staging + lexer->staging_len, data, length);
+    lexer->staging_len += length;
+    return (int)length;
+  }
+  rv = jitify_flush(lexer);
+  if (rv < 0) {
+    return rv;
+  }
+  return lexer->out->write(lexer->out, data, length);
+}
+
+int jitify_write_ref(jitify_lexer_t *lexer, const void *data, size_t length)
+{
+  const char *cdata = data;
+  int rv;
+  if (!lexer->out->write_ref || (length <= MAX_STAGED_WRITE) ||
+      (cdata < lexer->buf) || (cdata + length > lexer->buf_end)) {
+    return jitify_write(lexer, data, length);
+  }
+  rv = jitify_flush(lexer);
+  if (rv < 0) {
+    return rv;
+  }
+  lexer->bytes_out += length;
+  return lexer->out->write_ref(lexer->out, data, length);
 }
 
 void jitify_output_stream_destroy(jitify_output_stream_t *stream)
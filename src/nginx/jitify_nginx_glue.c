@@ -17,8 +17,14 @@ static void *nginx_calloc_wrapper(jitify_pool_t *pool, size_t len)
   return ngx_pcalloc(pool->state, len);
 }
 
+/* Only blocks too large for the pool's own pages can be given back,
+ * but those are the ones the lexer regrows
+ */
 static void nginx_free_wrapper(jitify_pool_t *pool, void *block)
 {
+  if (block) {
+    ngx_pfree(pool->state, block);
+  }
 }
 
 jitify_pool_t *jitify_nginx_pool_create(ngx_pool_t *pool)
@@ -31,6 +37,81 @@ jitify_pool_t *jitify_nginx_pool_create(ngx_pool_t *pool)
   return jpool;
 }
 
+static ngx_int_t append_link(jitify_nginx_chain_t *chain, ngx_buf_t *buf)
+{
+  ngx_chain_t *link = ngx_alloc_chain_link(chain->pool);
+  if (!link) {
+    return NGX_ERROR;
+  }
+  link->next = NULL;
+  link->buf = buf;
+  if (chain->last) {
+    chain->last->next = link;
+  }
+  else {
+    chain->first = link;
+  }
+  chain->last = link;
+  return NGX_OK;
+}
+
+/* Append an empty temporary buffer to the chain, reusing a free one
+ * if there is one
+ */
+static ngx_buf_t *add_output_buf(jitify_nginx_chain_t *chain)
+{
+  jitify_nginx_output_bufs_t *bufs = chain->bufs;
+  ngx_chain_t *link;
+  ngx_buf_t *buf;
+  size_t size;
+
+  if (!bufs) {
+    buf = ngx_create_temp_buf(chain->pool, ngx_pagesize);
+    if (!buf || (append_link(chain, buf) != NGX_OK)) {
+      return NULL;
+    }
+    buf->tag = (ngx_buf_tag_t)&jitify_module;
+    return buf;
+  }
+  size = bufs->bufs.size;
+  link = bufs->free;
+  if (link) {
+    bufs->free = link->next;
+    buf = link->buf;
+  }
+  else {
+    buf = ngx_calloc_buf(chain->pool);
+    link = ngx_alloc_chain_link(chain->pool);
+    if (!buf || !link) {
+      return NULL;
+    }
+    buf->temporary = 1;
+    buf->tag = (ngx_buf_tag_t)&jitify_module;
+    link->buf = buf;
+  }
+  if (!buf->start) {
+    buf->start = ngx_palloc(chain->pool, size);
+    if (!buf->start) {
+      link->next = bufs->free;
+      bufs->free = link;
+      return NULL;
+    }
+    buf->end = buf->start + size;
+    bufs->allocated++;
+  }
+  buf->pos = buf->last = buf->start;
+  bufs->busy++;
+  link->next = NULL;
+  if (chain->last) {
+    chain->last->next = link;
+  }
+  else {
+    chain->first = link;
+  }
+  chain->last = link;
+  return buf;
+}
+
 static int nginx_buf_write(jitify_output_stream_t *stream, const void *data, size_t len)
 {
   jitify_nginx_chain_t *chain = stream->state;
@@ -45,17 +126,10 @@ static int nginx_buf_write(jitify_output_stream_t *stream, const void *data, siz
     size_t write_size;
     link = chain->last;
     if (!link || !link->buf->temporary || (link->buf->last == link->buf->end)) {
-      ngx_buf_t *buf = ngx_create_temp_buf(chain->pool, ngx_pagesize);
-      link = ngx_alloc_chain_link(chain->pool);
-      link->next = NULL;
-      link->buf = buf;
-      if (chain->last) {
-        chain->last->next = link;
+      if (!add_output_buf(chain)) {
+        return -1;
       }
-      else {
-        chain->first = link;
-      }
-      chain->last = link;
+      link = chain->last;
     }
     write_size = link->buf->end - link->buf->last;
     if (write_size > bytes_remaining) {
@@ -69,11 +143,34 @@ static int nginx_buf_write(jitify_output_stream_t *stream, const void *data, siz
   return len;
 }
 
+static int nginx_buf_write_ref(jitify_output_stream_t *stream, const void *data, size_t len)
+{
+  jitify_nginx_chain_t *chain = stream->state;
+  ngx_buf_t *buf;
+  if (!chain->input) {
+    return nginx_buf_write(stream, data, len);
+  }
+  buf = ngx_calloc_buf(chain->pool);
+  if (!buf) {
+    return -1;
+  }
+  buf->memory = 1;
+  buf->pos = (u_char *)data;
+  buf->last = buf->pos + len;
+  buf->tag = (ngx_buf_tag_t)&jitify_module;
+  if (append_link(chain, buf) != NGX_OK) {
+    return -1;
+  }
+  chain->input_referenced = 1;
+  return len;
+}
+
 jitify_output_stream_t *jitify_nginx_output_stream_create(jitify_pool_t *pool)
 {
   jitify_output_stream_t *stream = jitify_calloc(pool, sizeof(*stream));
   stream->pool = pool;
   stream->write = nginx_buf_write;
+  stream->write_ref = nginx_buf_write_ref;
   return stream;
 }
 
@@ -91,17 +188,56 @@ char *jitify_nginx_strdup(jitify_pool_t *pool, ngx_str_t *str)
   return buf;
 }
 
-void jitify_nginx_add_eof(jitify_nginx_chain_t *chain)
+ngx_int_t jitify_nginx_add_eof(jitify_nginx_chain_t *chain)
 {
-  ngx_chain_t *link = ngx_pcalloc(chain->pool, sizeof(*chain));
   ngx_buf_t *buf = ngx_calloc_buf(chain->pool);
+  if (!buf) {
+    return NGX_ERROR;
+  }
   buf->last_buf = 1;
-  link->buf = buf;
-  if (chain->last) {
-    chain->last->next = link;
+  return append_link(chain, buf);
+}
+
+ngx_int_t jitify_nginx_add_flush(jitify_nginx_chain_t *chain)
+{
+  ngx_buf_t *buf = ngx_calloc_buf(chain->pool);
+  if (!buf) {
+    return NGX_ERROR;
   }
-  else {
-    chain->first = link;
+  buf->flush = 1;
+  return append_link(chain, buf);
+}
+
+/* Buffers beyond the configured number give their memory back to the
+ * pool, so that what a response holds doesn't grow with its length.
+ * ngx_pfree() only frees blocks larger than the pool's pages; a smaller
+ * buffer keeps its memory and is reused from the free list instead.
+ */
+void jitify_nginx_recycle(jitify_nginx_output_bufs_t *bufs, ngx_pool_t *pool, ngx_chain_t *link)
+{
+  ngx_buf_t *buf = link->buf;
+  bufs->busy--;
+  if ((bufs->allocated > (ngx_uint_t)bufs->bufs.num) && (ngx_pfree(pool, buf->start) == NGX_OK)) {
+    buf->start = buf->end = NULL;
+    bufs->allocated--;
   }
-  chain->last = link;
+  buf->pos = buf->last = buf->start;
+  buf->flush = 0;
+  buf->last_buf = 0;
+  link->next = bufs->free;
+  bufs->free = link;
+}
+
+ngx_int_t jitify_nginx_add_shadow(jitify_nginx_chain_t *chain, ngx_buf_t *input)
+{
+  ngx_buf_t *buf = ngx_calloc_buf(chain->pool);
+  if (!buf) {
+    return NGX_ERROR;
+  }
+  buf->sync = 1;
+  buf->shadow = input;
+  /* Input that is refilled once released has downstream send it now */
+  buf->recycled = input->recycled;
+  buf->tag = (ngx_buf_tag_t)&jitify_module;
+  return append_link(chain, buf);
 }
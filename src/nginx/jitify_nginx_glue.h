@@ -25,13 +25,35 @@ extern jitify_output_stream_t *jitify_nginx_output_stream_create(jitify_pool_t *
 /* Utility function to allocate, from a pool, a null-terminated copy of one of nginx's pointer/length strings */
 extern char *jitify_nginx_strdup(jitify_pool_t *pool, ngx_str_t *str);
 
+/* Output buffers recycled across the calls that write one response */
+typedef struct {
+  ngx_chain_t      *free;             /* Sent buffers ready for reuse; start is NULL if the memory was released */
+  ngx_bufs_t        bufs;             /* How many buffers keep their memory, and their size */
+  ngx_uint_t        allocated;        /* Buffers that currently have memory, in use or free */
+  ngx_uint_t        busy;             /* Buffers written but not yet sent */
+} jitify_nginx_output_bufs_t;
+
 /* Wrapper for an expandable list of buffers */
 typedef struct {
   ngx_chain_t      *first;
   ngx_chain_t      *last;
   ngx_pool_t       *pool;
+  ngx_buf_t        *input;            /* First input buffer being scanned, or NULL */
+  int               input_referenced; /* Whether the output points into the input buffers */
+  jitify_nginx_output_bufs_t *bufs;   /* Source of output buffers, or NULL to allocate new ones */
 } jitify_nginx_chain_t;
 
-extern void jitify_nginx_add_eof(jitify_nginx_chain_t *chain);
+extern ngx_int_t jitify_nginx_add_eof(jitify_nginx_chain_t *chain);
+
+/* Append an empty buffer that makes downstream send everything before it */
+extern ngx_int_t jitify_nginx_add_flush(jitify_nginx_chain_t *chain);
+
+/* Return a sent output buffer, and its link, to bufs for reuse */
+extern void jitify_nginx_recycle(jitify_nginx_output_bufs_t *bufs, ngx_pool_t *pool, ngx_chain_t *link);
+
+/* Append an empty buffer whose shadow is input, so that input can be
+ * released once everything before it in the chain has been sent
+ */
+extern ngx_int_t jitify_nginx_add_shadow(jitify_nginx_chain_t *chain, ngx_buf_t *input);
 
 #endif /* !defined(jitify_nginx_glue_h) */
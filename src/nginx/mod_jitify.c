@@ -10,16 +10,639 @@ static ngx_http_output_body_filter_pt   jitify_next_body_filter;
 
 ngx_module_t jitify_module;
 
+/* Upper bounds of the scan time histogram buckets, in usec; the last
+ * bucket, for anything slower, has no bound
+ */
+#define JITIFY_STATS_BUCKETS 7
+
+static const ngx_uint_t jitify_stats_bounds[JITIFY_STATS_BUCKETS - 1] = {
+  10, 100, 1000, 10000, 100000, 1000000
+};
+
+static const char *jitify_stats_bounds_in_sec[JITIFY_STATS_BUCKETS] = {
+  "0.00001", "0.0001", "0.001", "0.01", "0.1", "1", "+Inf"
+};
+
+/* Counters for the responses of one content type in one location.
+ * They live in shared memory and are updated by all the workers.
+ */
+typedef struct {
+  ngx_atomic_t requests;
+  ngx_atomic_t bytes_in;
+  ngx_atomic_t bytes_out;
+  ngx_atomic_t failsafe;
+  ngx_atomic_t setaside_overflows;
+  ngx_atomic_t scan_usec;
+  ngx_atomic_t scan_time[JITIFY_STATS_BUCKETS]; /* Responses per histogram bucket */
+  ngx_atomic_t cache_hits;
+} jitify_stats_t;
+
+typedef struct {
+  const char *name;
+  const char *help;
+  size_t offset;
+} jitify_stats_counter_t;
+
+static const jitify_stats_counter_t jitify_stats_counters[] = {
+  { "requests", "Responses scanned", offsetof(jitify_stats_t, requests) },
+  { "bytes_in", "Bytes scanned", offsetof(jitify_stats_t, bytes_in) },
+  { "bytes_out", "Bytes written after minification", offsetof(jitify_stats_t, bytes_out) },
+  { "failsafe", "Responses passed through unmodified after a parse error", offsetof(jitify_stats_t, failsafe) },
+  { "setaside_overflows", "Tokens sent unmodified because they exceeded the max setaside",
+    offsetof(jitify_stats_t, setaside_overflows) },
+  { "cache_hits", "Responses served from the jitify cache without scanning", offsetof(jitify_stats_t, cache_hits) },
+  { NULL, NULL, 0 }
+};
+
+#define JITIFY_STATUS_JSON       1
+#define JITIFY_STATUS_PROMETHEUS 2
+
+typedef struct {
+  ngx_flag_t stats;
+  ngx_array_t *labels; /* ngx_str_t, one per location that has stats */
+  ngx_shm_zone_t *stats_zone;
+  jitify_stats_t *counters; /* In stats_zone, indexed by label and then content type */
+} jitify_main_conf_t;
+
 typedef struct {
   ngx_flag_t minify;
+  ngx_open_file_t *capture; /* Chunk boundary trace file, or NULL */
+  ngx_str_t stats_label;
+  ngx_int_t stats_slot; /* Index of this location's label, or -1 for no stats */
+  ngx_uint_t status_format; /* Output of the jitify_status handler */
+#if (NGX_THREADS)
+  ngx_thread_pool_t *thread_pool; /* Where large bodies are scanned, or NULL to scan inline */
+#endif
+  size_t thread_threshold; /* Minimum input, in bytes, worth handing to the thread pool */
+  ngx_bufs_t output_bufs; /* Output buffers kept per response */
+  size_t max_setaside; /* Longest token held across input buffers, or NGX_CONF_UNSET_SIZE for the default */
+  ngx_shm_zone_t *cache; /* Zone of minified responses, or NULL */
+  size_t cache_max_size; /* Largest minified body stored in the cache */
+  uint32_t fingerprint; /* Of the settings that shape the output, for ETags and cache keys */
+  ngx_flag_t serve_static; /* Serve the .min siblings of static files in place of the files */
+  size_t flush_bytes; /* Flush once this much output is unflushed, or 0 */
+  ngx_msec_t flush_time; /* Flush output left unflushed this long, or 0 */
+  ngx_flag_t flush_head; /* Flush HTML once the head has been scanned */
 } jitify_conf_t;
 
+/* Minified responses shared by all the workers, found by key in the
+ * tree and ordered most recently used first in the queue
+ */
+typedef struct {
+  ngx_rbtree_t rbtree;
+  ngx_rbtree_node_t sentinel;
+  ngx_queue_t lru;
+} jitify_cache_sh_t;
+
+typedef struct {
+  jitify_cache_sh_t *sh;
+  ngx_slab_pool_t *shpool;
+} jitify_cache_t;
+
+/* A cached response: sn.str points at the key at the start of data,
+ * and the minified body follows it
+ */
+typedef struct {
+  ngx_str_node_t sn;
+  ngx_queue_t queue;
+  size_t len; /* Of the body */
+  u_char data[1];
+} jitify_cache_node_t;
+
+/* Bit of r->buffered set while input waits for a thread pool task or
+ * for downstream to take more output; the image filter uses the same
+ * bit, but never sees text responses
+ */
+#define JITIFY_BUFFERED 0x08
+
+/* Bodies or batches of input smaller than this are scanned inline
+ * unless jitify_thread_pool says otherwise
+ */
+#define DEFAULT_THREAD_THRESHOLD (256 * 1024)
+
+/* Output buffers, each ngx_pagesize bytes, that a response keeps for
+ * reuse unless jitify_output_buffers says otherwise
+ */
+#define DEFAULT_OUTPUT_BUFS 16
+
+/* Largest minified body stored unless jitify_cache says otherwise */
+#define DEFAULT_CACHE_MAX_SIZE (1024 * 1024)
+
+/* Initial size of the copy of a response being collected for the
+ * cache when its length isn't known in advance
+ */
+#define CACHE_COLLECT_SIZE (16 * 1024)
+
+#define JITIFY_TASK_IDLE    0
+#define JITIFY_TASK_RUNNING 1
+#define JITIFY_TASK_DONE    2
+
+/* Input passed to the lexer in one call: the data of the links from
+ * start to end, less what earlier batches scanned of start and what is
+ * left for later batches of end
+ */
+typedef struct {
+  jitify_iovec_t *segs;
+  size_t num_segs;
+  size_t max_segs;
+  ngx_chain_t *start;
+  size_t start_offset; /* Bytes of start's buffer scanned by earlier batches */
+  ngx_chain_t *end; /* First link not scanned to its end, or NULL */
+  size_t end_offset; /* Bytes of end's buffer scanned once this batch is */
+  int flush;
+  int eof;
+} jitify_batch_t;
+
+/* A window of a file buffer, queued as pending input ahead of the
+ * rest of the file buffer.  It's mapped or, if the file can't be,
+ * read into the response's read buffer; either way the memory is
+ * given up once buf has been released and no output refers to it.
+ */
+typedef struct jitify_window_s jitify_window_t;
+
+struct jitify_window_s {
+  jitify_window_t *next;
+  ngx_buf_t buf;
+  void *addr; /* Of the mapping, or NULL if read */
+  size_t len; /* Of the mapping */
+  ngx_log_t *log;
+};
+
+/* Work handed to the thread pool: the lexer scans the whole batch,
+ * writing into out, while the event loop goes on with other requests
+ */
+typedef struct {
+  jitify_lexer_t *lexer;
+  jitify_batch_t batch; /* segs is reused by later batches */
+  int rc; /* Result of the scan */
+  jitify_nginx_chain_t out;
+} jitify_thread_ctx_t;
+
 typedef struct {
   jitify_pool_t *pool;
   jitify_lexer_t *lexer;
   jitify_output_stream_t *out;
+  ngx_chain_t *busy; /* Output passed downstream but not yet sent */
+  ngx_array_t *chunks; /* Lengths of the input buffers, if capturing */
+  jitify_stats_t *stats; /* Counters for this response, or NULL */
+  ngx_pool_t *out_pool; /* Memory for output buffers */
+  jitify_nginx_output_bufs_t bufs;
+  ngx_chain_t *pending; /* Input not yet scanned, waiting for downstream or a task */
+  size_t pending_offset; /* Bytes of the first pending buffer already scanned */
+  jitify_window_t *windows; /* Of file buffers, in order, until their memory is given up */
+  jitify_window_t *free_windows;
+  u_char *read_buf; /* Where windows are read once mapping has failed */
+  size_t read_size;
+  int read_buf_busy; /* Whether a window in read_buf hasn't been released */
+  int map_failed;
+  ngx_buf_t *cached; /* Body of a cache hit, sent in place of the input */
+  ngx_shm_zone_t *cache; /* Where to store the output, or NULL */
+  ngx_str_t cache_key;
+  u_char *cache_body; /* Copy of the output sent so far */
+  size_t cache_len;
+  size_t cache_size; /* Allocated for cache_body */
+  size_t cache_max_size;
+  size_t flush_bytes;
+  ngx_msec_t flush_time;
+  size_t unflushed; /* Output passed downstream since the last flush */
+  ngx_event_t flush_timer;
+  int head_end; /* Set by jitify_head_trace once the HTML head has been scanned */
+#if (NGX_THREADS)
+  ngx_thread_pool_t *thread_pool; /* Set iff this response may be scanned in a thread */
+  size_t thread_threshold;
+  ngx_thread_task_t *task;
+  int task_state;
+  int offload_all; /* Whether the body is large enough to scan only in threads */
+#endif
 } jitify_filter_ctx_t;
 
+/* Lexers are reused across requests within each worker process */
+#define MAX_IDLE_LEXERS 32
+
+static jitify_lexer_cache_t *lexer_cache;
+
+static void jitify_release_lexer(void *data)
+{
+  jitify_lexer_cache_release(lexer_cache, data);
+}
+
+#if (NGX_THREADS)
+
+static void jitify_destroy_pool(void *data)
+{
+  ngx_destroy_pool(data);
+}
+
+/* nginx pools aren't thread-safe, so a response that may be scanned
+ * in a thread pool takes its lexer and output memory from a pool of
+ * its own rather than r->pool; it's destroyed with the request
+ */
+static ngx_pool_t *jitify_create_task_pool(ngx_http_request_t *r)
+{
+  ngx_pool_cleanup_t *cleanup = ngx_pool_cleanup_add(r->pool, 0);
+  ngx_pool_t *pool;
+  if (!cleanup) {
+    return NULL;
+  }
+  pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, r->connection->log);
+  if (!pool) {
+    return NULL;
+  }
+  cleanup->handler = jitify_destroy_pool;
+  cleanup->data = pool;
+  return pool;
+}
+
+#endif
+
+/* The key covers everything the minified body depends on: the jitify
+ * settings, by their fingerprint, the virtual server, the content type,
+ * the URI, and the version of the original by its ETag or else its
+ * mtime and length.  The zone may be shared by servers whose files
+ * have the same path, mtime and length.  Responses without a validator
+ * could change unnoticed, so they aren't cached.
+ * @return NGX_DECLINED if the response can't be cached
+ */
+static ngx_int_t jitify_cache_key(ngx_http_request_t *r, jitify_conf_t *jconf, ngx_str_t *key)
+{
+  ngx_str_t *etag = NULL;
+  size_t len;
+  u_char *p;
+
+  if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD)) || (r->headers_out.status != NGX_HTTP_OK)) {
+    return NGX_DECLINED;
+  }
+  if (r->headers_out.etag && r->headers_out.etag->hash) {
+    etag = &(r->headers_out.etag->value);
+  }
+  else if ((r->headers_out.last_modified_time == -1) || (r->headers_out.content_length_n < 0)) {
+    return NGX_DECLINED;
+  }
+  len = 8 + r->headers_in.server.len + r->headers_out.content_type.len + r->unparsed_uri.len + 5;
+  len += etag ? etag->len : NGX_TIME_T_LEN + NGX_OFF_T_LEN + 1;
+  key->data = ngx_pnalloc(r->pool, len);
+  if (!key->data) {
+    return NGX_ERROR;
+  }
+  p = ngx_sprintf(key->data, "%08xD:%V:%V:", jconf->fingerprint, &(r->headers_in.server),
+                  &(r->headers_out.content_type));
+  if (etag) {
+    p = ngx_sprintf(p, "%V:", etag);
+  }
+  else {
+    p = ngx_sprintf(p, "%T-%O:", r->headers_out.last_modified_time, r->headers_out.content_length_n);
+  }
+  p = ngx_cpymem(p, r->unparsed_uri.data, r->unparsed_uri.len);
+  key->len = p - key->data;
+  return NGX_OK;
+}
+
+/* Copy the body cached under key, if any, into a buffer in r->pool
+ * and mark the entry as the most recently used
+ */
+static ngx_buf_t *jitify_cache_lookup(ngx_http_request_t *r, ngx_shm_zone_t *zone, ngx_str_t *key)
+{
+  jitify_cache_t *cache = zone->data;
+  uint32_t hash = ngx_crc32_long(key->data, key->len);
+  jitify_cache_node_t *node;
+  ngx_buf_t *buf = NULL;
+
+  ngx_shmtx_lock(&(cache->shpool->mutex));
+  node = (jitify_cache_node_t *)ngx_str_rbtree_lookup(&(cache->sh->rbtree), key, hash);
+  if (node) {
+    buf = ngx_calloc_buf(r->pool);
+    if (buf && node->len) {
+      buf->start = ngx_pnalloc(r->pool, node->len);
+      if (buf->start) {
+        buf->pos = buf->start;
+        buf->last = buf->end = ngx_cpymem(buf->start, node->data + key->len, node->len);
+        buf->temporary = 1;
+      }
+      else {
+        buf = NULL;
+      }
+    }
+    if (buf) {
+      ngx_queue_remove(&(node->queue));
+      ngx_queue_insert_head(&(cache->sh->lru), &(node->queue));
+    }
+  }
+  ngx_shmtx_unlock(&(cache->shpool->mutex));
+  return buf;
+}
+
+/* Add the output about to be sent to the copy that will be cached,
+ * giving up on the copy once it outgrows the cache's max_size
+ */
+static void jitify_cache_collect(ngx_http_request_t *r, jitify_filter_ctx_t *jctx, ngx_chain_t *out)
+{
+  for (; out && jctx->cache; out = out->next) {
+    ngx_buf_t *buf = out->buf;
+    size_t len = (buf->last > buf->pos) ? (size_t)(buf->last - buf->pos) : 0;
+    if (jctx->cache_len + len > jctx->cache_size) {
+      size_t size = jctx->cache_size ? jctx->cache_size : CACHE_COLLECT_SIZE;
+      u_char *body = NULL;
+      while (size < jctx->cache_len + len) {
+        size *= 2;
+      }
+      if (size > jctx->cache_max_size) {
+        size = jctx->cache_max_size;
+      }
+      if (jctx->cache_len + len <= size) {
+        body = ngx_pnalloc(r->pool, size);
+      }
+      if (!body) {
+        ngx_pfree(r->pool, jctx->cache_body);
+        jctx->cache_body = NULL;
+        jctx->cache = NULL;
+        return;
+      }
+      if (jctx->cache_body) {
+        ngx_memcpy(body, jctx->cache_body, jctx->cache_len);
+        ngx_pfree(r->pool, jctx->cache_body);
+      }
+      jctx->cache_body = body;
+      jctx->cache_size = size;
+    }
+    if (len) {
+      ngx_memcpy(jctx->cache_body + jctx->cache_len, buf->pos, len);
+      jctx->cache_len += len;
+    }
+  }
+}
+
+/* Store the collected output, evicting the least recently used
+ * entries until it fits.  An entry that would take more than half the
+ * zone isn't worth flushing everything else for.
+ */
+static void jitify_cache_store(ngx_http_request_t *r, jitify_filter_ctx_t *jctx)
+{
+  jitify_cache_t *cache = jctx->cache->data;
+  ngx_str_t *key = &(jctx->cache_key);
+  uint32_t hash = ngx_crc32_long(key->data, key->len);
+  size_t size = offsetof(jitify_cache_node_t, data) + key->len + jctx->cache_len;
+  jitify_cache_node_t *node;
+
+  if (size > jctx->cache->shm.size / 2) {
+    return;
+  }
+  ngx_shmtx_lock(&(cache->shpool->mutex));
+  if (!ngx_str_rbtree_lookup(&(cache->sh->rbtree), key, hash)) {
+    node = ngx_slab_alloc_locked(cache->shpool, size);
+    while (!node && !ngx_queue_empty(&(cache->sh->lru))) {
+      ngx_queue_t *q = ngx_queue_last(&(cache->sh->lru));
+      jitify_cache_node_t *victim = ngx_queue_data(q, jitify_cache_node_t, queue);
+      ngx_queue_remove(q);
+      ngx_rbtree_delete(&(cache->sh->rbtree), &(victim->sn.node));
+      ngx_slab_free_locked(cache->shpool, victim);
+      node = ngx_slab_alloc_locked(cache->shpool, size);
+    }
+    if (node) {
+      node->sn.node.key = hash;
+      node->sn.str.len = key->len;
+      node->sn.str.data = node->data;
+      ngx_memcpy(node->data, key->data, key->len);
+      if (jctx->cache_len) {
+        ngx_memcpy(node->data + key->len, jctx->cache_body, jctx->cache_len);
+      }
+      node->len = jctx->cache_len;
+      ngx_rbtree_insert(&(cache->sh->rbtree), &(node->sn.node));
+      ngx_queue_insert_head(&(cache->sh->lru), &(node->queue));
+    }
+  }
+  ngx_shmtx_unlock(&(cache->shpool->mutex));
+}
+
+/* Whether a Vary header names nothing but Accept-Encoding, which the
+ * cache key needn't cover since compression comes after this filter
+ */
+static int jitify_vary_encoding_only(ngx_str_t *value)
+{
+  u_char *p = value->data, *last = p + value->len;
+  while (p < last) {
+    u_char *start;
+    while ((p < last) && ((*p == ' ') || (*p == '\t') || (*p == ','))) {
+      p++;
+    }
+    start = p;
+    while ((p < last) && (*p != ' ') && (*p != '\t') && (*p != ',')) {
+      p++;
+    }
+    if ((p > start) && ((p - start != 15) || ngx_strncasecmp(start, (u_char *)"accept-encoding", 15))) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* Whether the response may be served to other clients: it sets no
+ * cookie, isn't marked private or uncacheable, and doesn't vary with
+ * anything the key doesn't cover
+ */
+static int jitify_cache_shareable(ngx_http_request_t *r)
+{
+  ngx_list_part_t *part = &(r->headers_out.headers.part);
+  ngx_table_elt_t *header = part->elts;
+  ngx_uint_t i;
+
+  for (i = 0; /* void */; i++) {
+    if (i >= part->nelts) {
+      if (!part->next) {
+        break;
+      }
+      part = part->next;
+      header = part->elts;
+      i = 0;
+    }
+    if (!header[i].hash) {
+      continue;
+    }
+    if ((header[i].key.len == 10) && !ngx_strncasecmp(header[i].key.data, (u_char *)"set-cookie", 10)) {
+      return 0;
+    }
+    if ((header[i].key.len == 13) && !ngx_strncasecmp(header[i].key.data, (u_char *)"cache-control", 13)) {
+      u_char *last = header[i].value.data + header[i].value.len;
+      if (ngx_strlcasestrn(header[i].value.data, last, (u_char *)"private", 7 - 1) ||
+          ngx_strlcasestrn(header[i].value.data, last, (u_char *)"no-store", 8 - 1) ||
+          ngx_strlcasestrn(header[i].value.data, last, (u_char *)"no-cache", 8 - 1)) {
+        return 0;
+      }
+    }
+    if ((header[i].key.len == 4) && !ngx_strncasecmp(header[i].key.data, (u_char *)"vary", 4) &&
+        !jitify_vary_encoding_only(&(header[i].value))) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* Look the response up in the cache; on a miss, arrange for its output
+ * to be stored as it's sent.  A response meant for one client is
+ * neither served from the cache nor stored in it.
+ */
+static void jitify_cache_start(ngx_http_request_t *r, jitify_conf_t *jconf, jitify_filter_ctx_t *jctx)
+{
+  ngx_str_t key;
+  if (!jitify_cache_shareable(r)) {
+    return;
+  }
+  if (jitify_cache_key(r, jconf, &key) != NGX_OK) {
+    return;
+  }
+  jctx->cached = jitify_cache_lookup(r, jconf->cache, &key);
+  if (jctx->cached) {
+    if (jctx->stats) {
+      ngx_atomic_fetch_add(&(jctx->stats->cache_hits), 1);
+    }
+  }
+  else if ((r->method & NGX_HTTP_GET) && !r->header_only) {
+    jctx->cache = jconf->cache;
+    jctx->cache_key = key;
+    jctx->cache_max_size = jconf->cache_max_size;
+    if ((r->headers_out.content_length_n > 0) && (r->headers_out.content_length_n < (off_t)jconf->cache_max_size)) {
+      jctx->cache_size = (size_t)r->headers_out.content_length_n;
+      jctx->cache_body = ngx_pnalloc(r->pool, jctx->cache_size);
+      if (!jctx->cache_body) {
+        jctx->cache = NULL;
+      }
+    }
+  }
+}
+
+/* Derive the ETag of the minified response from the origin's by
+ * appending the fingerprint of the settings, so that it changes with
+ * either; a weak origin ETag stays weak
+ * @return NGX_DECLINED if the origin has no usable ETag
+ */
+static ngx_int_t jitify_derive_etag(ngx_http_request_t *r, jitify_conf_t *jconf, ngx_str_t *etag)
+{
+  ngx_table_elt_t *origin = r->headers_out.etag;
+  ngx_str_t value;
+  int weak = 0;
+
+  if (!origin || !origin->hash) {
+    return NGX_DECLINED;
+  }
+  value = origin->value;
+  if ((value.len > 2) && (value.data[0] == 'W') && (value.data[1] == '/')) {
+    weak = 1;
+    value.data += 2;
+    value.len -= 2;
+  }
+  if ((value.len < 2) || (value.data[0] != '"') || (value.data[value.len - 1] != '"')) {
+    return NGX_DECLINED;
+  }
+  etag->data = ngx_pnalloc(r->pool, value.len + 12);
+  if (!etag->data) {
+    return NGX_ERROR;
+  }
+  etag->len = ngx_sprintf(etag->data, "%s%*s-j%08xD\"", weak ? "W/" : "", value.len - 1, value.data,
+                          jconf->fingerprint) - etag->data;
+  return NGX_OK;
+}
+
+/* Whether an If-None-Match header lists etag, by the weak comparison
+ * RFC 7232 prescribes for it
+ */
+static int jitify_etag_listed(ngx_table_elt_t *header, ngx_str_t *etag)
+{
+  u_char *p = header->value.data, *last = p + header->value.len;
+  ngx_str_t opaque = *etag;
+
+  if ((header->value.len == 1) && (*p == '*')) {
+    return 1;
+  }
+  if ((opaque.len > 2) && (opaque.data[0] == 'W') && (opaque.data[1] == '/')) {
+    opaque.data += 2;
+    opaque.len -= 2;
+  }
+  while (p < last) {
+    u_char *start;
+    while ((p < last) && ((*p == ' ') || (*p == '\t') || (*p == ','))) {
+      p++;
+    }
+    if ((last - p > 2) && (p[0] == 'W') && (p[1] == '/')) {
+      p += 2;
+    }
+    if ((p == last) || (*p != '"')) {
+      return 0;
+    }
+    start = p;
+    p = ngx_strlchr(p + 1, last, '"');
+    if (!p) {
+      return 0;
+    }
+    p++;
+    if (((size_t)(p - start) == opaque.len) && !ngx_strncmp(start, opaque.data, opaque.len)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* The not_modified filter compares If-Match with the origin's ETag,
+ * before the header filter derives ours, and would refuse a client
+ * holding our ETag with 412.  So ahead of that, the fingerprint is
+ * taken off every ETag the header lists that ends with the current
+ * one; ETags from other settings still fail, as they should.
+ */
+static ngx_int_t jitify_if_match_handler(ngx_http_request_t *r)
+{
+  jitify_conf_t *jconf = ngx_http_get_module_loc_conf(r, jitify_module);
+  ngx_table_elt_t *header = r->headers_in.if_match;
+  u_char suffix[sizeof("-j00000000\"")];
+  u_char *p, *last, *q;
+  size_t suffix_len;
+
+  if ((r != r->main) || !jconf->minify || !header) {
+    return NGX_DECLINED;
+  }
+  suffix_len = ngx_sprintf(suffix, "-j%08xD\"", jconf->fingerprint) - suffix;
+  q = ngx_pnalloc(r->pool, header->value.len);
+  if (!q) {
+    return NGX_ERROR;
+  }
+  p = header->value.data;
+  last = p + header->value.len;
+  header->value.data = q;
+  while (p < last) {
+    if (((size_t)(last - p) >= suffix_len) && !ngx_strncmp(p, suffix, suffix_len)) {
+      p += suffix_len - 1;
+    }
+    else {
+      *q++ = *p++;
+    }
+  }
+  header->value.len = q - header->value.data;
+  return NGX_DECLINED;
+}
+
+/* Token trace callback that watches for the end of the HTML head.  The
+ * flush follows the slice that held the tag, and runs on the event loop
+ * even if the slice was scanned in a thread.
+ */
+static void jitify_head_trace(const jitify_token_trace_t *token, void *arg)
+{
+  jitify_filter_ctx_t *jctx = arg;
+  if (jitify_html_head_end(token)) {
+    jctx->head_end = 1;
+    jitify_lexer_set_trace(jctx->lexer, NULL, NULL);
+  }
+}
+
+/* Answer with 304 in place of the response, as the not_modified filter
+ * would have if the client's validator had been the origin's
+ */
+static ngx_int_t jitify_send_not_modified(ngx_http_request_t *r)
+{
+  r->headers_out.status = NGX_HTTP_NOT_MODIFIED;
+  r->headers_out.status_line.len = 0;
+  r->headers_out.content_type.len = 0;
+  ngx_http_clear_content_length(r);
+  ngx_http_clear_accept_ranges(r);
+  return jitify_next_header_filter(r);
+}
+
 static ngx_int_t jitify_header_filter(ngx_http_request_t *r)
 {
   ngx_log_t *log = r->connection->log;
@@ -27,6 +650,11 @@ static ngx_int_t jitify_header_filter(ngx_http_request_t *r)
   if (r != r->main) {
     return jitify_next_header_filter(r);
   }
+  /* Already minified by jitify_static, or compressed */
+  if (ngx_http_get_module_ctx(r, jitify_module) || (r->headers_out.content_encoding &&
+                                                     r->headers_out.content_encoding->value.len)) {
+    return jitify_next_header_filter(r);
+  }
   jconf = ngx_http_get_module_loc_conf(r, jitify_module);
   if (!jconf) {
     ngx_log_error(NGX_LOG_WARN, log, 0, "internal error: mod_jitify configuration missing");
@@ -34,11 +662,36 @@ static ngx_int_t jitify_header_filter(ngx_http_request_t *r)
   }
   if (jconf->minify) {
     jitify_filter_ctx_t *jctx = ngx_pcalloc(r->pool, sizeof(*jctx));
-    jctx->pool = jitify_nginx_pool_create(r->pool);
+    int content_type_index = -1;
+    jctx->out_pool = r->pool;
+#if (NGX_THREADS)
+    if (jconf->thread_pool) {
+      ngx_pool_t *task_pool = jitify_create_task_pool(r);
+      if (task_pool) {
+        jctx->out_pool = task_pool;
+        jctx->thread_pool = jconf->thread_pool;
+        jctx->thread_threshold = jconf->thread_threshold;
+        jctx->offload_all = (r->headers_out.content_length_n >= (off_t)jconf->thread_threshold);
+      }
+    }
+#endif
+    jctx->pool = jitify_nginx_pool_create(jctx->out_pool);
+    jctx->bufs.bufs = jconf->output_bufs;
     if (r->headers_out.content_type.data) {
       jitify_output_stream_t *out = jitify_nginx_output_stream_create(jctx->pool);
-      jctx->lexer = jitify_lexer_for_content_type(jitify_nginx_strdup(jctx->pool, &(r->headers_out.content_type)),
-        jctx->pool, out);
+      const char *content_type = jitify_nginx_strdup(jctx->pool, &(r->headers_out.content_type));
+      content_type_index = jitify_content_type_index(content_type);
+      if (lexer_cache) {
+        ngx_pool_cleanup_t *cleanup = ngx_pool_cleanup_add(r->pool, 0);
+        if (cleanup) {
+          jctx->lexer = jitify_lexer_cache_acquire(lexer_cache, content_type, out);
+          cleanup->handler = jitify_release_lexer;
+          cleanup->data = jctx->lexer;
+        }
+      }
+      else {
+        jctx->lexer = jitify_lexer_for_content_type(content_type, jctx->pool, out);
+      }
       jctx->out = out;
     }
   
@@ -47,104 +700,1569 @@ static ngx_int_t jitify_header_filter(ngx_http_request_t *r)
          when the response body is modified */
       ngx_log_error(NGX_LOG_DEBUG, log, 0, "enabling content scanning for uri=%V content-type=%V",
                     &(r->uri), &(r->headers_out.content_type));
+      if (jconf->stats_slot >= 0) {
+        jitify_main_conf_t *jmcf = ngx_http_get_module_main_conf(r, jitify_module);
+        if (jmcf->counters) {
+          jctx->stats = &(jmcf->counters[jconf->stats_slot * jitify_num_content_types() + content_type_index]);
+        }
+      }
+      jctx->flush_bytes = jconf->flush_bytes;
+      jctx->flush_time = jconf->flush_time;
+      if (jconf->flush_head && (content_type_index >= 0) &&
+          !ngx_strcmp(jitify_content_type_name(content_type_index), "text/html")) {
+        jitify_lexer_set_trace(jctx->lexer, jitify_head_trace, jctx);
+      }
+      /* Minification is deterministic, so the output changes only when
+       * the origin or the settings do: Last-Modified stays valid, and
+       * the ETag is replaced by one derived from both.  The
+       * not_modified filter has already compared If-None-Match with the
+       * origin's ETag, so a client holding our ETag is answered here;
+       * If-Match was mapped back to the origin's by
+       * jitify_if_match_handler.
+       */
+      if ((r->headers_out.status == NGX_HTTP_OK) && (r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+        ngx_str_t etag;
+        ngx_int_t rc = jitify_derive_etag(r, jconf, &etag);
+        if (rc == NGX_ERROR) {
+          return NGX_ERROR;
+        }
+        if ((rc == NGX_OK) && r->headers_in.if_none_match &&
+            jitify_etag_listed(r->headers_in.if_none_match, &etag)) {
+          r->headers_out.etag->value = etag;
+          return jitify_send_not_modified(r);
+        }
+        /* The cache key needs the origin's validators */
+        if (jconf->cache) {
+          jitify_cache_start(r, jconf, jctx);
+        }
+        if (rc == NGX_OK) {
+          r->headers_out.etag->value = etag;
+        }
+        else {
+          ngx_http_clear_etag(r);
+        }
+      }
+      else {
+        ngx_http_clear_etag(r);
+      }
       ngx_http_clear_content_length(r);
-      ngx_http_clear_last_modified(r);
       ngx_http_clear_accept_ranges(r);
+      if (jctx->cached) {
+        r->headers_out.content_length_n = ngx_buf_size(jctx->cached);
+      }
       
       jitify_lexer_set_minify_rules(jctx->lexer, jconf->minify, jconf->minify);
+      if (jconf->max_setaside != NGX_CONF_UNSET_SIZE) {
+        jitify_lexer_set_max_setaside(jctx->lexer, jconf->max_setaside);
+      }
+      if (jconf->capture) {
+        jctx->chunks = ngx_array_create(r->pool, 16, sizeof(size_t));
+      }
       ngx_http_set_ctx(r, jctx, jitify_module);
-      
-      r->main_filter_need_in_memory = 1;
     }
     else {
       ngx_log_error(NGX_LOG_DEBUG, log, 0, "no lexer for uri=%V content-type=%V",
                     &(r->uri), &(r->headers_out.content_type));
     }
   }
-  return jitify_next_header_filter(r);
+  return jitify_next_header_filter(r);
+}
+
+#define DEFAULT_ERR_LEN 80
+
+/* Append a record of the chunk boundaries of this response to the
+ * capture file, in the format read by "jitify --replay":
+ *   <uri> <len> <len> ...
+ */
+static void jitify_write_capture(ngx_http_request_t *r, jitify_filter_ctx_t *jctx)
+{
+  jitify_conf_t *jconf = ngx_http_get_module_loc_conf(r, jitify_module);
+  size_t *chunks = jctx->chunks->elts;
+  ngx_uint_t i;
+  u_char *record, *p;
+  size_t len;
+
+  len = r->unparsed_uri.len + jctx->chunks->nelts * (NGX_SIZE_T_LEN + 1) + 1;
+  record = ngx_pnalloc(r->pool, len);
+  if (!record) {
+    return;
+  }
+  p = ngx_cpymem(record, r->unparsed_uri.data, r->unparsed_uri.len);
+  for (i = 0; i < jctx->chunks->nelts; i++) {
+    p = ngx_sprintf(p, " %uz", chunks[i]);
+  }
+  *p++ = '\n';
+  if (ngx_write_fd(jconf->capture->fd, record, p - record) == NGX_FILE_ERROR) {
+    ngx_log_error(NGX_LOG_WARN, r->connection->log, ngx_errno, "cannot write to jitify capture file %V",
+                  &(jconf->capture->name));
+  }
+}
+
+static void jitify_update_stats(jitify_stats_t *stats, jitify_lexer_t *lexer)
+{
+  jitify_lexer_stats_t lexer_stats;
+  ngx_uint_t usec, i;
+
+  jitify_lexer_get_stats(lexer, &lexer_stats);
+  usec = (ngx_uint_t)(lexer_stats.processing_time / 1000);
+  ngx_atomic_fetch_add(&(stats->requests), 1);
+  ngx_atomic_fetch_add(&(stats->bytes_in), lexer_stats.bytes_in);
+  ngx_atomic_fetch_add(&(stats->bytes_out), lexer_stats.bytes_out);
+  if (lexer_stats.failsafe_events) {
+    ngx_atomic_fetch_add(&(stats->failsafe), 1);
+  }
+  ngx_atomic_fetch_add(&(stats->setaside_overflows), lexer_stats.setaside_overflows);
+  ngx_atomic_fetch_add(&(stats->scan_usec), usec);
+  for (i = 0; (i < JITIFY_STATS_BUCKETS - 1) && (usec > jitify_stats_bounds[i]); i++);
+  ngx_atomic_fetch_add(&(stats->scan_time[i]), 1);
+}
+
+/* Maximum number of buffers passed to the lexer in one call */
+#define MAX_SCAN_SEGS 16
+
+static void jitify_free_window(jitify_filter_ctx_t *jctx, jitify_window_t *window)
+{
+  if (!window->addr) {
+    jctx->read_buf_busy = 0;
+  }
+  else if (munmap(window->addr, window->len) == -1) {
+    ngx_log_error(NGX_LOG_ALERT, window->log, ngx_errno, "munmap(%p, %uz) failed", window->addr, window->len);
+  }
+}
+
+/* Give up the memory of the windows that have been released, which
+ * happens in order
+ */
+static void jitify_release_windows(jitify_filter_ctx_t *jctx)
+{
+  while (jctx->windows && (jctx->windows->buf.pos == jctx->windows->buf.last)) {
+    jitify_window_t *window = jctx->windows;
+    jctx->windows = window->next;
+    jitify_free_window(jctx, window);
+    window->next = jctx->free_windows;
+    jctx->free_windows = window;
+  }
+}
+
+/* Give up the windows still held when the request ends */
+static void jitify_cleanup_windows(void *data)
+{
+  jitify_filter_ctx_t *jctx = data;
+  while (jctx->windows) {
+    jitify_free_window(jctx, jctx->windows);
+    jctx->windows = jctx->windows->next;
+  }
+}
+
+/* Pass output downstream, then release any input buffers whose
+ * memory is no longer referenced by unsent output and recycle the
+ * output buffers that have been sent, as ngx_chain_update_chains()
+ * does
+ */
+static ngx_int_t jitify_send(ngx_http_request_t *r, jitify_filter_ctx_t *jctx, ngx_chain_t *out)
+{
+  ngx_int_t rc;
+  ngx_chain_t *link;
+
+  rc = jitify_next_body_filter(r, out);
+
+  if (out) {
+    if (jctx->busy) {
+      for (link = jctx->busy; link->next; link = link->next);
+      link->next = out;
+    }
+    else {
+      jctx->busy = out;
+    }
+  }
+  while (jctx->busy) {
+    ngx_buf_t *buf;
+    link = jctx->busy;
+    buf = link->buf;
+    if (ngx_buf_size(buf) != 0) {
+      break;
+    }
+    if (buf->shadow) {
+      buf->shadow->pos = buf->shadow->last;
+    }
+    jctx->busy = link->next;
+    if (buf->temporary && (buf->tag == (ngx_buf_tag_t)&jitify_module)) {
+      jitify_nginx_recycle(&(jctx->bufs), jctx->out_pool, link);
+    }
+    else {
+      ngx_free_chain(jctx->out_pool, link);
+    }
+  }
+  jitify_release_windows(jctx);
+  return rc;
+}
+
+/* File buffers are mapped in windows of this size, aligned to
+ * multiples of it within the file
+ */
+#define FILE_WINDOW_SIZE (4 * 1024 * 1024)
+
+/* Files that can't be mapped are read on the event loop, in windows of
+ * at most this size
+ */
+#define FILE_READ_SIZE (256 * 1024)
+
+/* Whether buf holds file data that hasn't been queued in windows yet */
+#define jitify_file_unread(buf) \
+  (!ngx_buf_in_memory(buf) && (buf)->in_file && ((buf)->file_pos < (buf)->file_last))
+
+/* Queue the next window of the file buffer at *link ahead of it, once
+ * the lexer has reached it.  The file's size is checked first, since
+ * touching a mapping beyond the end of a truncated file raises SIGBUS.
+ * The read buffer is marked recycled, so that output that refers to it
+ * is sent right away rather than held downstream.
+ * @return NGX_AGAIN if the window has to be read into the read buffer
+ * while an earlier window there is still in use
+ */
+static ngx_int_t jitify_map_window(ngx_http_request_t *r, jitify_filter_ctx_t *jctx, ngx_chain_t **link)
+{
+  ngx_buf_t *file_buf = (*link)->buf;
+  ngx_file_t *file = file_buf->file;
+  off_t offset = file_buf->file_pos;
+  off_t window_end = (offset & ~((off_t)FILE_WINDOW_SIZE - 1)) + FILE_WINDOW_SIZE;
+  size_t len = (size_t)(ngx_min(file_buf->file_last, window_end) - offset);
+  off_t start = offset & ~((off_t)ngx_pagesize - 1);
+  jitify_window_t *window;
+  ngx_chain_t *window_link, **last;
+  ngx_file_info_t fi;
+  void *addr = MAP_FAILED;
+
+  if (jctx->map_failed && jctx->read_buf_busy) {
+    return NGX_AGAIN;
+  }
+  if (ngx_fd_info(file->fd, &fi) == NGX_FILE_ERROR) {
+    ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno, ngx_fd_info_n " \"%V\" failed", &(file->name));
+    return NGX_ERROR;
+  }
+  if (ngx_file_size(&fi) < offset + (off_t)len) {
+    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "%V was truncated while being read for uri=%V",
+                  &(file->name), &(r->uri));
+    return NGX_ERROR;
+  }
+  window = jctx->free_windows;
+  if (window) {
+    jctx->free_windows = window->next;
+  }
+  else {
+    if (!jctx->windows) {
+      ngx_pool_cleanup_t *cleanup = ngx_pool_cleanup_add(r->pool, 0);
+      if (!cleanup) {
+        return NGX_ERROR;
+      }
+      cleanup->handler = jitify_cleanup_windows;
+      cleanup->data = jctx;
+    }
+    window = ngx_palloc(r->pool, sizeof(*window));
+    if (!window) {
+      return NGX_ERROR;
+    }
+  }
+  window_link = ngx_alloc_chain_link(r->pool);
+  if (!window_link) {
+    return NGX_ERROR;
+  }
+  ngx_memzero(&(window->buf), sizeof(ngx_buf_t));
+  if (!jctx->map_failed) {
+    addr = mmap(NULL, len + (size_t)(offset - start), PROT_READ, MAP_PRIVATE, file->fd, start);
+    jctx->map_failed = (addr == MAP_FAILED);
+  }
+  if (addr != MAP_FAILED) {
+#ifdef MADV_SEQUENTIAL
+    madvise(addr, len + (size_t)(offset - start), MADV_SEQUENTIAL);
+#endif
+    window->addr = addr;
+    window->len = len + (size_t)(offset - start);
+    window->buf.pos = (u_char *)addr + (offset - start);
+  }
+  else {
+    if (len > FILE_READ_SIZE) {
+      len = FILE_READ_SIZE;
+    }
+    if (jctx->read_size < len) {
+      if (jctx->read_buf) {
+        ngx_pfree(r->pool, jctx->read_buf);
+      }
+      jctx->read_size = 0;
+      jctx->read_buf = ngx_palloc(r->pool, len);
+      if (!jctx->read_buf) {
+        return NGX_ERROR;
+      }
+      jctx->read_size = len;
+    }
+    if (ngx_read_file(file, jctx->read_buf, len, offset) != (ssize_t)len) {
+      ngx_log_error(NGX_LOG_ERR, r->connection->log, ngx_errno, "cannot read %V for uri=%V",
+                    &(file->name), &(r->uri));
+      return NGX_ERROR;
+    }
+    window->addr = NULL;
+    window->buf.pos = jctx->read_buf;
+    window->buf.recycled = 1;
+    jctx->read_buf_busy = 1;
+  }
+  window->buf.last = window->buf.pos + len;
+  window->buf.memory = 1;
+  window->buf.tag = (ngx_buf_tag_t)&jitify_module;
+  window->log = r->connection->log;
+  for (last = &(jctx->windows); *last; last = &((*last)->next));
+  *last = window;
+  window->next = NULL;
+  window_link->buf = &(window->buf);
+  window_link->next = *link;
+  *link = window_link;
+  file_buf->file_pos += len;
+  return NGX_OK;
+}
+
+/* Queue the links of in as pending input.  Without
+ * r->main_filter_need_in_memory, static files arrive as file buffers;
+ * rather than have nginx read them into small memory buffers, each
+ * stays pending until the lexer reaches it, and is then queued a
+ * mapped window at a time.
+ */
+static ngx_int_t jitify_queue_input(ngx_http_request_t *r, jitify_filter_ctx_t *jctx, ngx_chain_t *in)
+{
+  return in ? ngx_chain_add_copy(r->pool, &(jctx->pending), in) : NGX_OK;
+}
+
+/* Collect up to limit bytes of pending input into batch, noting any
+ * flush or end of stream on the way; a buffer may be split between
+ * batches.  File buffers are mapped as the batch reaches them.
+ */
+static ngx_int_t jitify_gather(ngx_http_request_t *r, jitify_filter_ctx_t *jctx, jitify_batch_t *batch,
+                               size_t limit)
+{
+  ngx_chain_t **next = &(jctx->pending);
+  size_t offset = jctx->pending_offset;
+  size_t total = 0;
+
+  batch->start_offset = offset;
+  batch->num_segs = 0;
+  batch->flush = batch->eof = 0;
+  while (*next && (batch->num_segs < batch->max_segs) && (total < limit)) {
+    ngx_chain_t *link;
+    ngx_buf_t *buf;
+    size_t len;
+    if (jitify_file_unread((*next)->buf)) {
+      ngx_int_t rc = jitify_map_window(r, jctx, next);
+      if (rc == NGX_ERROR) {
+        return NGX_ERROR;
+      }
+      if (rc == NGX_AGAIN) {
+        break;
+      }
+    }
+    link = *next;
+    buf = link->buf;
+    len = (buf->last > buf->pos) ? (size_t)(buf->last - buf->pos) - offset : 0;
+    if (len) {
+      jitify_iovec_t *seg = &(batch->segs[batch->num_segs++]);
+      if (jctx->chunks && !offset) {
+        size_t *chunk = ngx_array_push(jctx->chunks);
+        if (chunk) {
+          *chunk = buf->last - buf->pos;
+        }
+      }
+      if (len > limit - total) {
+        len = limit - total;
+      }
+      seg->data = buf->pos + offset;
+      seg->len = len;
+      total += len;
+      if (buf->pos + offset + len < buf->last) {
+        offset += len;
+        break;
+      }
+    }
+    if (buf->flush) {
+      batch->flush = 1;
+    }
+    if (buf->last_buf) {
+      batch->eof = 1;
+    }
+    next = &(link->next);
+    offset = 0;
+  }
+  batch->start = jctx->pending;
+  batch->end = *next;
+  batch->end_offset = offset;
+  return NGX_OK;
+}
+
+static void jitify_log_err(ngx_http_request_t *r, jitify_filter_ctx_t *jctx, jitify_batch_t *batch)
+{
+  const char *err = jitify_lexer_get_err(jctx->lexer);
+  size_t i;
+  for (i = 0; err && (i < batch->num_segs); i++) {
+    const char *seg_start = batch->segs[i].data;
+    const char *seg_end = seg_start + batch->segs[i].len;
+    if ((err >= seg_start) && (err < seg_end)) {
+      char err_buf[DEFAULT_ERR_LEN + 1];
+      size_t err_len = DEFAULT_ERR_LEN;
+      size_t max_err_len = seg_end - err;
+      if (err_len > max_err_len) {
+        err_len = max_err_len;
+      }
+      memcpy(err_buf, err, err_len);
+      err_buf[err_len] = 0;
+      ngx_log_error(NGX_LOG_WARN, r->connection->log, 0, "parse error in %V near '%s', entering failsafe mode",
+                    &(r->uri), err_buf);
+    }
+  }
+}
+
+/* Remove the scanned links from the pending input.  Setting
+ * buf->pos=buf->last enables the nginx core to recycle a buffer, which
+ * has to wait if our output still points into it; a buffer scanned
+ * over several batches may be referenced by output of any of them.
+ */
+static ngx_int_t jitify_release_input(ngx_http_request_t *r, jitify_filter_ctx_t *jctx, jitify_nginx_chain_t *out,
+                                      jitify_batch_t *batch)
+{
+  ngx_chain_t *link = batch->start;
+  while (link != batch->end) {
+    ngx_chain_t *next = link->next;
+    ngx_buf_t *buf = link->buf;
+    if (buf->pos < buf->last) {
+      if (out->input_referenced || ((link == batch->start) && batch->start_offset)) {
+        if (jitify_nginx_add_shadow(out, buf) != NGX_OK) {
+          return NGX_ERROR;
+        }
+      }
+      else {
+        buf->pos = buf->last;
+      }
+    }
+    ngx_free_chain(r->pool, link);
+    link = next;
+  }
+  /* A batch scanned in a thread was detached from the pending input */
+  if (jctx->pending == batch->start) {
+    jctx->pending = batch->end;
+    jctx->pending_offset = batch->end_offset;
+  }
+  out->input = NULL;
+  jitify_release_windows(jctx);
+  return NGX_OK;
+}
+
+static void jitify_flush_timer_handler(ngx_event_t *ev)
+{
+  ngx_http_request_t *r = ev->data;
+  ngx_connection_t *c = r->connection;
+
+  ngx_http_set_log_request(c->log, r);
+  /* The flush goes through this filter, behind any pending input */
+  if (ngx_http_send_special(r, NGX_HTTP_FLUSH) == NGX_ERROR) {
+    ngx_http_finalize_request(r, NGX_ERROR);
+  }
+  ngx_http_run_posted_requests(c);
+}
+
+static void jitify_cancel_flush_timer(void *data)
+{
+  jitify_filter_ctx_t *jctx = data;
+  if (jctx->flush_timer.timer_set) {
+    ngx_del_timer(&(jctx->flush_timer));
+  }
+}
+
+/* Apply the flush policy of jitify_flush to output about to be sent:
+ * flush once the HTML head or enough output has built up, or start the
+ * clock on it
+ */
+static ngx_int_t jitify_flush_policy(ngx_http_request_t *r, jitify_filter_ctx_t *jctx, jitify_nginx_chain_t *out,
+                                     int *send_flush)
+{
+  ngx_chain_t *link;
+  for (link = out->first; link; link = link->next) {
+    if (ngx_buf_in_memory(link->buf)) {
+      jctx->unflushed += link->buf->last - link->buf->pos;
+    }
+  }
+  if (jctx->head_end) {
+    jctx->head_end = 0;
+    *send_flush = 1;
+  }
+  if (jctx->flush_bytes && (jctx->unflushed >= jctx->flush_bytes)) {
+    *send_flush = 1;
+  }
+  if (*send_flush || !jctx->unflushed || !jctx->flush_time || jctx->flush_timer.timer_set) {
+    return NGX_OK;
+  }
+  if (!jctx->flush_timer.handler) {
+    ngx_pool_cleanup_t *cleanup = ngx_pool_cleanup_add(r->pool, 0);
+    if (!cleanup) {
+      return NGX_ERROR;
+    }
+    cleanup->handler = jitify_cancel_flush_timer;
+    cleanup->data = jctx;
+    jctx->flush_timer.handler = jitify_flush_timer_handler;
+    jctx->flush_timer.data = r;
+    jctx->flush_timer.log = r->connection->log;
+  }
+  ngx_add_timer(&(jctx->flush_timer), jctx->flush_time);
+  return NGX_OK;
+}
+
+/* Finish the response if eof, then pass along whatever output there is */
+static ngx_int_t jitify_send_output(ngx_http_request_t *r, jitify_filter_ctx_t *jctx, jitify_nginx_chain_t *out,
+                                    int send_flush, int send_eof)
+{
+  if (!send_eof && (jitify_flush_policy(r, jctx, out, &send_flush) != NGX_OK)) {
+    return NGX_ERROR;
+  }
+  if (jctx->cache) {
+    jitify_cache_collect(r->main, jctx, out->first);
+    if (send_eof && jctx->cache) {
+      jitify_cache_store(r->main, jctx);
+    }
+  }
+  if (send_eof) {
+    size_t processing_time_in_usec = jitify_lexer_get_processing_time(jctx->lexer);
+    size_t bytes_in = jitify_lexer_get_bytes_in(jctx->lexer);
+    size_t bytes_out = jitify_lexer_get_bytes_out(jctx->lexer);
+    ngx_log_error(NGX_LOG_INFO, r->connection->log, 0, "Jitify stats: bytes_in=%l bytes_out=%l, nsec/byte=%l for %V",
+        (long)bytes_in, (long)bytes_out,
+        (long)(bytes_in ? processing_time_in_usec * 1000 / bytes_in : 0),
+        &(r->uri));
+    if (jctx->chunks) {
+      jitify_write_capture(r->main, jctx);
+    }
+    if (jctx->stats) {
+      jitify_update_stats(jctx->stats, jctx->lexer);
+    }
+    if (jitify_nginx_add_eof(out) != NGX_OK) {
+      return NGX_ERROR;
+    }
+  }
+  if (send_flush || send_eof) {
+    jctx->unflushed = 0;
+    jitify_cancel_flush_timer(jctx);
+  }
+  /* A flush from upstream is passed on even when it comes with no output,
+   * as output of earlier calls may be waiting downstream
+   */
+  if (send_flush && !send_eof) {
+    if (out->last) {
+      out->last->buf->flush = 1;
+    }
+    else if (jitify_nginx_add_flush(out) != NGX_OK) {
+      return NGX_ERROR;
+    }
+  }
+  if (out->first || jctx->busy) {
+    return jitify_send(r, jctx, out->first);
+  }
+  else {
+    return NGX_OK;
+  }
+}
+
+/* Whether downstream holds as many of our output buffers as a response
+ * may keep, or still holds output that refers to the read buffer the
+ * next window of a file has to be read into; scanning stops until some
+ * of them have been sent
+ */
+static int jitify_output_blocked(jitify_filter_ctx_t *jctx)
+{
+  if (jctx->bufs.busy >= (ngx_uint_t)jctx->bufs.bufs.num) {
+    return 1;
+  }
+  return (jctx->pending && jctx->map_failed && jctx->read_buf_busy && jitify_file_unread(jctx->pending->buf));
+}
+
+/* Input is scanned a slice at a time, whether inline or in a thread.
+ * Output is about as long as input, so a slice fills at most the
+ * buffers a response keeps.
+ */
+#define jitify_slice_size(jctx) ((size_t)(jctx)->bufs.bufs.num * (jctx)->bufs.bufs.size)
+
+/* Scan the pending input on the event loop, a slice at a time.  Input
+ * that would produce more output than downstream can take is left
+ * pending, and its buffers unreleased, which in turn stops upstream
+ * from reading more; nginx calls the filter again on write events.
+ */
+static ngx_int_t jitify_scan_inline(ngx_http_request_t *r, jitify_filter_ctx_t *jctx)
+{
+  size_t limit = jitify_slice_size(jctx);
+  ngx_int_t rc = NGX_OK;
+
+  /* Let downstream send what it can, which may unblock us */
+  if (jctx->busy) {
+    rc = jitify_send(r, jctx, NULL);
+    if (rc == NGX_ERROR) {
+      return rc;
+    }
+  }
+  while (jctx->pending && !jitify_output_blocked(jctx)) {
+    jitify_iovec_t segs[MAX_SCAN_SEGS];
+    jitify_batch_t batch;
+    jitify_nginx_chain_t out;
+
+    out.first = out.last = NULL;
+    out.pool = jctx->out_pool;
+    out.input_referenced = 0;
+    out.bufs = &(jctx->bufs);
+    jctx->out->state = &out;
+
+    /* Gather the buffers in the chain so the lexer can scan them in one call */
+    batch.segs = segs;
+    batch.max_segs = MAX_SCAN_SEGS;
+    if (jitify_gather(r, jctx, &batch, limit) != NGX_OK) {
+      return NGX_ERROR;
+    }
+    out.input = batch.start->buf;
+    if (batch.num_segs || batch.eof) {
+      int scanned = jitify_lexer_scanv(jctx->lexer, batch.segs, batch.num_segs, batch.eof);
+      jitify_log_err(r, jctx, &batch);
+      if (scanned < 0) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "cannot write the output of %V", &(r->uri));
+        return NGX_ERROR;
+      }
+    }
+    if (jitify_release_input(r, jctx, &out, &batch) != NGX_OK) {
+      return NGX_ERROR;
+    }
+    rc = jitify_send_output(r, jctx, &out, batch.flush, batch.eof);
+    if (rc == NGX_ERROR) {
+      return rc;
+    }
+  }
+  if (jctx->pending) {
+    r->buffered |= JITIFY_BUFFERED;
+    return NGX_AGAIN;
+  }
+  r->buffered &= ~JITIFY_BUFFERED;
+  return rc;
+}
+
+#if (NGX_THREADS)
+
+static void jitify_thread_handler(void *data, ngx_log_t *log)
+{
+  jitify_thread_ctx_t *tctx = data;
+  tctx->rc = jitify_lexer_scanv(tctx->lexer, tctx->batch.segs, tctx->batch.num_segs, tctx->batch.eof);
+}
+
+/* Back on the event loop once a task completes: resume the request so
+ * that its output goes out through the body filter
+ */
+static void jitify_thread_event_handler(ngx_event_t *ev)
+{
+  ngx_http_request_t *r = ev->data;
+  ngx_connection_t *c = r->connection;
+  jitify_filter_ctx_t *jctx = ngx_http_get_module_ctx(r->main, jitify_module);
+
+  ngx_http_set_log_request(c->log, r);
+  r->main->blocked--;
+  r->aio = 0;
+  jctx->task_state = JITIFY_TASK_DONE;
+  r->write_event_handler(r);
+  ngx_http_run_posted_requests(c);
+}
+
+/* Hand the next slice of the pending input to the thread pool; the
+ * rest waits for the task to finish and downstream to take its output
+ */
+static ngx_int_t jitify_thread_post(ngx_http_request_t *r, jitify_filter_ctx_t *jctx)
+{
+  jitify_thread_ctx_t *tctx;
+
+  if (!jctx->task) {
+    jctx->task = ngx_thread_task_alloc(r->pool, sizeof(jitify_thread_ctx_t));
+    if (!jctx->task) {
+      return NGX_ERROR;
+    }
+    jctx->task->handler = jitify_thread_handler;
+  }
+  tctx = jctx->task->ctx;
+  if (!tctx->batch.segs) {
+    tctx->batch.segs = ngx_palloc(r->pool, MAX_SCAN_SEGS * sizeof(jitify_iovec_t));
+    if (!tctx->batch.segs) {
+      return NGX_ERROR;
+    }
+    tctx->batch.max_segs = MAX_SCAN_SEGS;
+  }
+  tctx->lexer = jctx->lexer;
+  if (jitify_gather(r, jctx, &(tctx->batch), jitify_slice_size(jctx)) != NGX_OK) {
+    return NGX_ERROR;
+  }
+  /* Input beyond the slice waits for the next task */
+  jctx->pending = tctx->batch.end;
+  jctx->pending_offset = tctx->batch.end_offset;
+
+  tctx->out.first = tctx->out.last = NULL;
+  tctx->out.pool = jctx->out_pool;
+  tctx->out.input = tctx->batch.start->buf;
+  tctx->out.input_referenced = 0;
+  tctx->out.bufs = &(jctx->bufs);
+  jctx->out->state = &(tctx->out);
+
+  jctx->task->event.data = r;
+  jctx->task->event.handler = jitify_thread_event_handler;
+  if (ngx_thread_task_post(jctx->thread_pool, jctx->task) != NGX_OK) {
+    return NGX_ERROR;
+  }
+  r->main->blocked++;
+  r->aio = 1;
+  jctx->task_state = JITIFY_TASK_RUNNING;
+  return NGX_OK;
+}
+
+static ngx_int_t jitify_thread_finish(ngx_http_request_t *r, jitify_filter_ctx_t *jctx)
+{
+  jitify_thread_ctx_t *tctx = jctx->task->ctx;
+
+  jctx->task_state = JITIFY_TASK_IDLE;
+  jitify_log_err(r, jctx, &(tctx->batch));
+  if (tctx->rc < 0) {
+    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "cannot write the output of %V", &(r->uri));
+    return NGX_ERROR;
+  }
+  if (jitify_release_input(r, jctx, &(tctx->out), &(tctx->batch)) != NGX_OK) {
+    return NGX_ERROR;
+  }
+  return jitify_send_output(r, jctx, &(tctx->out), tctx->batch.flush, tctx->batch.eof);
+}
+
+/* At most one task per response runs at a time, and input that arrives
+ * meanwhile waits in jctx->pending, so the output stays in order and
+ * the input buffers aren't recycled until the lexer is done with them
+ */
+static ngx_int_t jitify_thread_body_filter(ngx_http_request_t *r, jitify_filter_ctx_t *jctx)
+{
+  ngx_int_t rc = NGX_OK;
+  ngx_chain_t *link;
+  off_t size = 0;
+
+  if (jctx->task_state == JITIFY_TASK_RUNNING) {
+    return NGX_AGAIN;
+  }
+  if (jctx->task_state == JITIFY_TASK_DONE) {
+    rc = jitify_thread_finish(r, jctx);
+    if (rc == NGX_ERROR) {
+      return rc;
+    }
+  }
+  else if (jctx->busy) {
+    rc = jitify_send(r, jctx, NULL);
+    if (rc == NGX_ERROR) {
+      return rc;
+    }
+  }
+  if (!jctx->pending) {
+    r->buffered &= ~JITIFY_BUFFERED;
+    return rc;
+  }
+  if (jitify_output_blocked(jctx)) {
+    r->buffered |= JITIFY_BUFFERED;
+    return NGX_AGAIN;
+  }
+
+  /* Small batches cost less to scan than to hand off */
+  for (link = jctx->pending; link; link = link->next) {
+    size += ngx_buf_size(link->buf);
+  }
+  size -= jctx->pending_offset;
+  if (!jctx->offload_all && (size < (off_t)jctx->thread_threshold)) {
+    return jitify_scan_inline(r, jctx);
+  }
+  if (jitify_thread_post(r, jctx) != NGX_OK) {
+    return NGX_ERROR;
+  }
+  r->buffered |= JITIFY_BUFFERED;
+  return NGX_AGAIN;
+}
+
+#endif /* NGX_THREADS */
+
+/* Serve a cache hit: the input is consumed unread, and the cached body
+ * sent in its place once the input ends
+ */
+static ngx_int_t jitify_send_cached(ngx_http_request_t *r, jitify_filter_ctx_t *jctx, ngx_chain_t *in)
+{
+  ngx_chain_t out;
+  int eof = 0;
+
+  for (; in; in = in->next) {
+    ngx_buf_t *buf = in->buf;
+    buf->pos = buf->last;
+    buf->file_pos = buf->file_last;
+    if (buf->last_buf) {
+      eof = 1;
+    }
+  }
+  if (!eof) {
+    return jitify_next_body_filter(r, NULL);
+  }
+  jctx->cached->last_buf = 1;
+  out.buf = jctx->cached;
+  out.next = NULL;
+  return jitify_next_body_filter(r, &out);
 }
 
-#define DEFAULT_ERR_LEN 80
-
 static ngx_int_t jitify_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
 {
   ngx_log_t *log = r->connection->log;
   jitify_filter_ctx_t *jctx;
-  jitify_nginx_chain_t out;
-  int send_flush, send_eof;
   jctx = ngx_http_get_module_ctx(r->main, jitify_module);
   if (!jctx || !jctx->lexer) {
     ngx_log_error(NGX_LOG_DEBUG, log, 0, "jitify filter skipping request for uri=%V",
                   &(r->uri));
     return jitify_next_body_filter(r, in);
   }
-  out.first = out.last = NULL;
-  out.pool = r->pool;
-  jctx->out->state = &out;
-  send_flush = send_eof = 0;
+  if (jctx->cached) {
+    return jitify_send_cached(r, jctx, in);
+  }
+  if (jitify_queue_input(r, jctx, in) != NGX_OK) {
+    return NGX_ERROR;
+  }
+#if (NGX_THREADS)
+  if (jctx->thread_pool) {
+    return jitify_thread_body_filter(r, jctx);
+  }
+#endif
+  return jitify_scan_inline(r, jctx);
+}
 
-  while (in) {
-    ngx_buf_t *buf = in->buf;
-    if (buf->last_buf) {
-      send_eof = 1;
-    }
-    if (buf->last_buf || (buf->last > buf->pos)) {
-      const char *err;
-      jitify_lexer_scan(jctx->lexer, buf->pos, buf->last - buf->pos, buf->last_buf);
-      err = jitify_lexer_get_err(jctx->lexer);
-      if (err) {
-        char err_buf[DEFAULT_ERR_LEN + 1];
-        size_t err_len = DEFAULT_ERR_LEN;
-        size_t max_err_len = (const char*)(buf->last) - err;
-        if (err_len > max_err_len) {
-          err_len = max_err_len;
+/* Copy a label into a JSON string or Prometheus label value */
+static u_char *jitify_escape_label(u_char *p, u_char *last, ngx_str_t *label)
+{
+  size_t i;
+  for (i = 0; (i < label->len) && (p + 2 <= last); i++) {
+    u_char c = label->data[i];
+    if ((c == '"') || (c == '\\')) {
+      *p++ = '\\';
+      *p++ = c;
+    }
+    else if (c == '\n') {
+      *p++ = '\\';
+      *p++ = 'n';
+    }
+    else {
+      *p++ = (c < 0x20) ? ' ' : c;
+    }
+  }
+  return p;
+}
+
+#define STATS_COUNTER(stats, counter) \
+  (*(ngx_atomic_t *)((u_char *)(stats) + (counter)->offset))
+
+static u_char *jitify_status_json(jitify_main_conf_t *jmcf, u_char *p, u_char *last)
+{
+  ngx_str_t *labels = jmcf->labels->elts;
+  int num_types = jitify_num_content_types();
+  const jitify_stats_counter_t *counter;
+  ngx_uint_t i, j;
+  int type, first = 1;
+
+  p = ngx_slprintf(p, last, "{\"scan_time_bounds_usec\":[");
+  for (j = 0; j < JITIFY_STATS_BUCKETS - 1; j++) {
+    p = ngx_slprintf(p, last, "%s%ui", j ? "," : "", jitify_stats_bounds[j]);
+  }
+  p = ngx_slprintf(p, last, "],\"stats\":[");
+  for (i = 0; jmcf->counters && (i < jmcf->labels->nelts); i++) {
+    for (type = 0; type < num_types; type++) {
+      jitify_stats_t *stats = &(jmcf->counters[i * num_types + type]);
+      if (!stats->requests && !stats->cache_hits) {
+        continue;
+      }
+      p = ngx_slprintf(p, last, "%s{\"location\":\"", first ? "" : ",");
+      p = jitify_escape_label(p, last, &(labels[i]));
+      p = ngx_slprintf(p, last, "\",\"content_type\":\"%s\"", jitify_content_type_name(type));
+      for (counter = jitify_stats_counters; counter->name; counter++) {
+        p = ngx_slprintf(p, last, ",\"%s\":%uA", counter->name, STATS_COUNTER(stats, counter));
+      }
+      p = ngx_slprintf(p, last, ",\"scan_usec\":%uA,\"scan_time_buckets\":[", stats->scan_usec);
+      for (j = 0; j < JITIFY_STATS_BUCKETS; j++) {
+        p = ngx_slprintf(p, last, "%s%uA", j ? "," : "", stats->scan_time[j]);
+      }
+      p = ngx_slprintf(p, last, "]}");
+      first = 0;
+    }
+  }
+  return ngx_slprintf(p, last, "]}\n");
+}
+
+static u_char *jitify_prometheus_labels(u_char *p, u_char *last, ngx_str_t *label, int type)
+{
+  p = ngx_slprintf(p, last, "{location=\"");
+  p = jitify_escape_label(p, last, label);
+  return ngx_slprintf(p, last, "\",content_type=\"%s\"", jitify_content_type_name(type));
+}
+
+static u_char *jitify_status_prometheus(jitify_main_conf_t *jmcf, u_char *p, u_char *last)
+{
+  ngx_str_t *labels = jmcf->labels->elts;
+  int num_types = jitify_num_content_types();
+  const jitify_stats_counter_t *counter;
+  ngx_uint_t i, j;
+  int type;
+
+  if (!jmcf->counters) {
+    return p;
+  }
+  for (counter = jitify_stats_counters; counter->name; counter++) {
+    p = ngx_slprintf(p, last, "# HELP jitify_%s_total %s\n# TYPE jitify_%s_total counter\n",
+                     counter->name, counter->help, counter->name);
+    for (i = 0; i < jmcf->labels->nelts; i++) {
+      for (type = 0; type < num_types; type++) {
+        jitify_stats_t *stats = &(jmcf->counters[i * num_types + type]);
+        if (stats->requests || stats->cache_hits) {
+          p = ngx_slprintf(p, last, "jitify_%s_total", counter->name);
+          p = jitify_prometheus_labels(p, last, &(labels[i]), type);
+          p = ngx_slprintf(p, last, "} %uA\n", STATS_COUNTER(stats, counter));
         }
-        memcpy(err_buf, err, err_len);
-        err_buf[err_len] = 0;
-        ngx_log_error(NGX_LOG_WARN, log, 0, "parse error in %V near '%s', entering failsafe mode", &(r->uri), err_buf);
       }
     }
-    if (buf->flush) {
-      send_flush = 1;
+  }
+  p = ngx_slprintf(p, last, "# HELP jitify_scan_seconds Time spent scanning each response\n"
+                   "# TYPE jitify_scan_seconds histogram\n");
+  for (i = 0; i < jmcf->labels->nelts; i++) {
+    for (type = 0; type < num_types; type++) {
+      jitify_stats_t *stats = &(jmcf->counters[i * num_types + type]);
+      ngx_atomic_uint_t cumulative = 0;
+      if (!stats->requests && !stats->cache_hits) {
+        continue;
+      }
+      for (j = 0; j < JITIFY_STATS_BUCKETS; j++) {
+        cumulative += stats->scan_time[j];
+        p = ngx_slprintf(p, last, "jitify_scan_seconds_bucket");
+        p = jitify_prometheus_labels(p, last, &(labels[i]), type);
+        p = ngx_slprintf(p, last, ",le=\"%s\"} %uA\n", jitify_stats_bounds_in_sec[j], cumulative);
+      }
+      p = ngx_slprintf(p, last, "jitify_scan_seconds_sum");
+      p = jitify_prometheus_labels(p, last, &(labels[i]), type);
+      p = ngx_slprintf(p, last, "} %uA.%06uA\n", stats->scan_usec / 1000000, stats->scan_usec % 1000000);
+      p = ngx_slprintf(p, last, "jitify_scan_seconds_count");
+      p = jitify_prometheus_labels(p, last, &(labels[i]), type);
+      p = ngx_slprintf(p, last, "} %uA\n", cumulative);
     }
+  }
+  return p;
+}
 
-    /* Setting buf->pos=buf->last enables the nginx core to recycle this buffer */
-    if (buf->pos < buf->last) {
-      buf->pos = buf->last;
+/* Serve the counters of every location, as JSON or in the Prometheus
+ * text format; "?format=json" or "?format=prometheus" overrides the
+ * format given to the jitify_status directive
+ */
+static ngx_int_t jitify_status_handler(ngx_http_request_t *r)
+{
+  jitify_main_conf_t *jmcf = ngx_http_get_module_main_conf(r, jitify_module);
+  jitify_conf_t *jconf = ngx_http_get_module_loc_conf(r, jitify_module);
+  ngx_uint_t format = jconf->status_format;
+  ngx_str_t *labels = jmcf->labels->elts;
+  ngx_str_t arg;
+  ngx_buf_t *b;
+  ngx_chain_t out;
+  ngx_int_t rc;
+  ngx_uint_t i;
+  size_t size;
+
+  if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+    return NGX_HTTP_NOT_ALLOWED;
+  }
+  rc = ngx_http_discard_request_body(r);
+  if (rc != NGX_OK) {
+    return rc;
+  }
+  if (ngx_http_arg(r, (u_char *)"format", 6, &arg) == NGX_OK) {
+    if ((arg.len == 4) && !ngx_strncmp(arg.data, "json", 4)) {
+      format = JITIFY_STATUS_JSON;
+    }
+    else if ((arg.len == 10) && !ngx_strncmp(arg.data, "prometheus", 10)) {
+      format = JITIFY_STATUS_PROMETHEUS;
     }
-    in = in->next;
   }
 
-  if (send_eof) {
-    size_t processing_time_in_usec = jitify_lexer_get_processing_time(jctx->lexer);
-    size_t bytes_in = jitify_lexer_get_bytes_in(jctx->lexer);
-    size_t bytes_out = jitify_lexer_get_bytes_out(jctx->lexer);
-    ngx_log_error(NGX_LOG_INFO, log, 0, "Jitify stats: bytes_in=%l bytes_out=%l, nsec/byte=%l for %V",
-        (long)bytes_in, (long)bytes_out,
-        (long)(bytes_in ? processing_time_in_usec * 1000 / bytes_in : 0),
-        &(r->uri));
-    jitify_nginx_add_eof(&out);
+  /* Each row of counters takes at most a few hundred bytes plus its
+   * escaped label, repeated on every line of the Prometheus format
+   */
+  size = 1024;
+  for (i = 0; i < jmcf->labels->nelts; i++) {
+    size += jitify_num_content_types() * (JITIFY_STATS_BUCKETS + 8) * (128 + 2 * labels[i].len);
   }
-  if (send_flush && out.last) {
-    out.last->buf->flush = 1;
+  b = ngx_create_temp_buf(r->pool, size);
+  if (!b) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
   }
-  if (out.first) {
-    return jitify_next_body_filter(r, out.first);
+  if (format == JITIFY_STATUS_PROMETHEUS) {
+    static ngx_str_t content_type = ngx_string("text/plain; version=0.0.4");
+    b->last = jitify_status_prometheus(jmcf, b->pos, b->end);
+    r->headers_out.content_type = content_type;
   }
   else {
+    static ngx_str_t content_type = ngx_string("application/json");
+    b->last = jitify_status_json(jmcf, b->pos, b->end);
+    r->headers_out.content_type = content_type;
+  }
+  r->headers_out.content_type_len = r->headers_out.content_type.len;
+  r->headers_out.status = NGX_HTTP_OK;
+  r->headers_out.content_length_n = b->last - b->pos;
+  rc = ngx_http_send_header(r);
+  if ((rc == NGX_ERROR) || (rc > NGX_OK) || r->header_only) {
+    return rc;
+  }
+  b->last_buf = (r == r->main) ? 1 : 0;
+  b->last_in_chain = 1;
+  out.buf = b;
+  out.next = NULL;
+  return ngx_http_output_filter(r, &out);
+}
+
+/* Open a file through the open file cache, as the static module does
+ * @return NGX_DECLINED if it isn't a regular file that can be read
+ */
+static ngx_int_t jitify_open_file(ngx_http_request_t *r, ngx_http_core_loc_conf_t *clcf, ngx_str_t *path,
+                                  ngx_open_file_info_t *of, int test_only)
+{
+  ngx_memzero(of, sizeof(ngx_open_file_info_t));
+  of->read_ahead = clcf->read_ahead;
+  of->directio = clcf->directio;
+  of->valid = clcf->open_file_cache_valid;
+  of->min_uses = clcf->open_file_cache_min_uses;
+  of->errors = clcf->open_file_cache_errors;
+  of->events = clcf->open_file_cache_events;
+  of->test_only = test_only;
+  if (ngx_http_set_disable_symlinks(r, clcf, path, of) != NGX_OK) {
+    return NGX_ERROR;
+  }
+  if (ngx_open_cached_file(clcf->open_file_cache, path, of, r->pool) != NGX_OK) {
+    switch (of->err) {
+      case 0:
+        return NGX_ERROR;
+      case NGX_ENOENT:
+      case NGX_ENOTDIR:
+      case NGX_ENAMETOOLONG:
+        return NGX_DECLINED;
+      default:
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, of->err, "%s \"%s\" failed", of->failed, path->data);
+        return NGX_DECLINED;
+    }
+  }
+  return of->is_file ? NGX_OK : NGX_DECLINED;
+}
+
+/* Find the .min sibling of the requested file, e.g. style.min.css for
+ * style.css, and style.min.css.gz as well if the client takes gzip.
+ * "jitify --docroot" gives the siblings the mtime of the file, so a
+ * sibling with any other mtime wasn't built from this version of it; a
+ * newer mtime wouldn't show an edit made within the same second.
+ * @return NGX_OK with min_path and of set, NGX_DECLINED if there's no
+ * sibling built from the file as it is
+ */
+static ngx_int_t jitify_static_find(ngx_http_request_t *r, ngx_http_core_loc_conf_t *clcf, ngx_str_t *min_path,
+                                    ngx_open_file_info_t *of, int *gzip)
+{
+  ngx_open_file_info_t source_of;
+  ngx_str_t path;
+  size_t root;
+  u_char *last, *dot, *p;
+  ngx_int_t rc;
+  int try_gzip = 0;
+
+  last = ngx_http_map_uri_to_path(r, &path, &root, 0);
+  if (!last) {
+    return NGX_ERROR;
+  }
+  path.len = last - path.data;
+  rc = jitify_open_file(r, clcf, &path, &source_of, 1);
+  if (rc != NGX_OK) {
+    return rc;
+  }
+
+  /* The extension, as r->exten, starts after the last dot of the URI */
+  dot = last - r->exten.len - 1;
+  min_path->data = ngx_pnalloc(r->pool, path.len + sizeof(".min.gz"));
+  if (!min_path->data) {
+    return NGX_ERROR;
+  }
+  p = ngx_cpymem(min_path->data, path.data, dot - path.data);
+  p = ngx_cpymem(p, ".min", 4);
+  p = ngx_cpymem(p, dot, last - dot);
+#if (NGX_HTTP_GZIP)
+  /* As with gzip_static, which file is served depends on
+   * Accept-Encoding, so "gzip_vary on" has to say so whichever it is
+   */
+  r->gzip_vary = 1;
+  try_gzip = (ngx_http_gzip_ok(r) == NGX_OK);
+#endif
+  if (try_gzip) {
+    ngx_memcpy(p, ".gz", sizeof(".gz"));
+    min_path->len = p + 3 - min_path->data;
+    rc = jitify_open_file(r, clcf, min_path, of, 0);
+    if (rc == NGX_ERROR) {
+      return rc;
+    }
+    if ((rc == NGX_OK) && (of->mtime == source_of.mtime)) {
+      *gzip = 1;
+      return NGX_OK;
+    }
+  }
+  *p = '\0';
+  min_path->len = p - min_path->data;
+  rc = jitify_open_file(r, clcf, min_path, of, 0);
+  if (rc != NGX_OK) {
+    return rc;
+  }
+  if (of->mtime != source_of.mtime) {
+    ngx_log_error(NGX_LOG_DEBUG, r->connection->log, 0, "%V wasn't built from %V as it is, not serving it",
+                  min_path, &path);
+    return NGX_DECLINED;
+  }
+  *gzip = 0;
+  return NGX_OK;
+}
+
+/* Content handler for jitify_static: like gzip_static, it serves a
+ * file prepared offline, here by "jitify --docroot", from disk with
+ * sendfile, so the response costs no scanning at all.  Requests it
+ * declines go on to the static module, and get minified on the fly.
+ */
+static ngx_int_t jitify_static_handler(ngx_http_request_t *r)
+{
+  jitify_conf_t *jconf = ngx_http_get_module_loc_conf(r, jitify_module);
+  ngx_http_core_loc_conf_t *clcf;
+  ngx_open_file_info_t of;
+  ngx_str_t min_path;
+  ngx_table_elt_t *h;
+  ngx_buf_t *b;
+  ngx_chain_t out;
+  ngx_int_t rc;
+  u_char *content_type;
+  int gzip;
+
+  if (!jconf->serve_static || !jconf->minify || !r->exten.len ||
+      !(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD)) || (r->uri.data[r->uri.len - 1] == '/')) {
+    return NGX_DECLINED;
+  }
+  /* Only types that have a lexer have minified siblings */
+  if (ngx_http_set_content_type(r) != NGX_OK) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+  content_type = ngx_pnalloc(r->pool, r->headers_out.content_type.len + 1);
+  if (!content_type) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+  ngx_cpystrn(content_type, r->headers_out.content_type.data, r->headers_out.content_type.len + 1);
+  if (jitify_content_type_index((const char *)content_type) < 0) {
+    return NGX_DECLINED;
+  }
+
+  clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+  rc = jitify_static_find(r, clcf, &min_path, &of, &gzip);
+  if (rc != NGX_OK) {
+    return (rc == NGX_ERROR) ? NGX_HTTP_INTERNAL_SERVER_ERROR : NGX_DECLINED;
+  }
+  ngx_log_error(NGX_LOG_DEBUG, r->connection->log, 0, "jitify_static: serving %V for uri=%V", &min_path, &(r->uri));
+
+  r->root_tested = !r->error_page;
+  rc = ngx_http_discard_request_body(r);
+  if (rc != NGX_OK) {
+    return rc;
+  }
+  /* Keeps the jitify filters from scanning the response again */
+  if (!ngx_http_get_module_ctx(r, jitify_module)) {
+    jitify_filter_ctx_t *jctx = ngx_pcalloc(r->pool, sizeof(*jctx));
+    if (!jctx) {
+      return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+    ngx_http_set_ctx(r, jctx, jitify_module);
+  }
+  r->headers_out.status = NGX_HTTP_OK;
+  r->headers_out.content_length_n = of.size;
+  r->headers_out.last_modified_time = of.mtime;
+  if (ngx_http_set_etag(r) != NGX_OK) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+  if (gzip) {
+    h = ngx_list_push(&(r->headers_out.headers));
+    if (!h) {
+      return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+    h->hash = 1;
+    ngx_str_set(&(h->key), "Content-Encoding");
+    ngx_str_set(&(h->value), "gzip");
+    r->headers_out.content_encoding = h;
+  }
+  r->allow_ranges = 1;
+
+  b = ngx_calloc_buf(r->pool);
+  if (!b) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+  b->file = ngx_pcalloc(r->pool, sizeof(ngx_file_t));
+  if (!b->file) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+  rc = ngx_http_send_header(r);
+  if ((rc == NGX_ERROR) || (rc > NGX_OK) || r->header_only) {
+    return rc;
+  }
+  b->file_pos = 0;
+  b->file_last = of.size;
+  b->in_file = b->file_last ? 1 : 0;
+  b->last_buf = (r == r->main) ? 1 : 0;
+  b->last_in_chain = 1;
+  b->sync = (b->last_buf || b->in_file) ? 0 : 1;
+  b->file->fd = of.fd;
+  b->file->name = min_path;
+  b->file->log = r->connection->log;
+  b->file->directio = of.is_directio;
+  out.buf = b;
+  out.next = NULL;
+  return ngx_http_output_filter(r, &out);
+}
+
+static ngx_int_t jitify_init_stats_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+  jitify_main_conf_t *jmcf = shm_zone->data;
+  jitify_main_conf_t *prev = data;
+  ngx_slab_pool_t *shpool = (ngx_slab_pool_t *)shm_zone->shm.addr;
+  size_t size = jmcf->labels->nelts * jitify_num_content_types() * sizeof(jitify_stats_t);
+
+  if (prev) {
+    /* Reloaded configuration: keep counting where the old one left
+     * off if it has the same locations
+     */
+    ngx_str_t *labels = jmcf->labels->elts, *prev_labels = prev->labels->elts;
+    ngx_uint_t i;
+    if (prev->labels->nelts == jmcf->labels->nelts) {
+      for (i = 0; i < jmcf->labels->nelts; i++) {
+        if ((labels[i].len != prev_labels[i].len) ||
+            ngx_strncmp(labels[i].data, prev_labels[i].data, labels[i].len)) {
+          break;
+        }
+      }
+      if (i == jmcf->labels->nelts) {
+        jmcf->counters = prev->counters;
+        return NGX_OK;
+      }
+    }
+    ngx_slab_free(shpool, prev->counters);
+  }
+  else if (shm_zone->shm.exists) {
+    jmcf->counters = shpool->data;
+    return NGX_OK;
+  }
+  jmcf->counters = ngx_slab_alloc(shpool, size);
+  if (!jmcf->counters) {
+    return NGX_ERROR;
+  }
+  ngx_memzero(jmcf->counters, size);
+  shpool->data = jmcf->counters;
+  return NGX_OK;
+}
+
+static ngx_int_t jitify_init_cache_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+  jitify_cache_t *cache = shm_zone->data;
+  jitify_cache_t *prev = data;
+
+  if (prev) {
+    /* Reloaded configuration: the cached responses are still valid */
+    cache->sh = prev->sh;
+    cache->shpool = prev->shpool;
     return NGX_OK;
   }
+  cache->shpool = (ngx_slab_pool_t *)shm_zone->shm.addr;
+  if (shm_zone->shm.exists) {
+    cache->sh = cache->shpool->data;
+    return NGX_OK;
+  }
+  cache->sh = ngx_slab_alloc(cache->shpool, sizeof(jitify_cache_sh_t));
+  if (!cache->sh) {
+    return NGX_ERROR;
+  }
+  cache->shpool->data = cache->sh;
+  ngx_rbtree_init(&(cache->sh->rbtree), &(cache->sh->sentinel), ngx_str_rbtree_insert_value);
+  ngx_queue_init(&(cache->sh->lru));
+  /* Running out of memory is routine; it's how eviction starts */
+  cache->shpool->log_nomem = 0;
+  return NGX_OK;
 }
 
 static ngx_int_t jitify_post_config(ngx_conf_t *cf)
 {
+  jitify_main_conf_t *jmcf = ngx_http_conf_get_module_main_conf(cf, jitify_module);
+  ngx_http_core_main_conf_t *cmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
+  ngx_http_handler_pt *h;
+
+  h = ngx_array_push(&(cmcf->phases[NGX_HTTP_CONTENT_PHASE].handlers));
+  if (!h) {
+    return NGX_ERROR;
+  }
+  *h = jitify_static_handler;
+
+  h = ngx_array_push(&(cmcf->phases[NGX_HTTP_PREACCESS_PHASE].handlers));
+  if (!h) {
+    return NGX_ERROR;
+  }
+  *h = jitify_if_match_handler;
+
   jitify_next_header_filter = ngx_http_top_header_filter;
   ngx_http_top_header_filter = jitify_header_filter;
   jitify_next_body_filter = ngx_http_top_body_filter;
   ngx_http_top_body_filter = jitify_body_filter;
+
+  if (jmcf->stats && jmcf->labels->nelts) {
+    ngx_str_t name = ngx_string("jitify_stats");
+    size_t size = jmcf->labels->nelts * jitify_num_content_types() * sizeof(jitify_stats_t);
+    /* Leave room for the slab allocator's own bookkeeping */
+    size = ngx_align(size, ngx_pagesize) + 8 * ngx_pagesize;
+    jmcf->stats_zone = ngx_shared_memory_add(cf, &name, size, &jitify_module);
+    if (!jmcf->stats_zone) {
+      return NGX_ERROR;
+    }
+    jmcf->stats_zone->init = jitify_init_stats_zone;
+    jmcf->stats_zone->data = jmcf;
+  }
   return NGX_OK;
 }
 
+static ngx_int_t jitify_init_process(ngx_cycle_t *cycle)
+{
+  jitify_pool_t *pool = jitify_malloc_pool_create();
+  if (pool) {
+    lexer_cache = jitify_lexer_cache_create(pool, MAX_IDLE_LEXERS);
+  }
+  return NGX_OK;
+}
+
+static char *jitify_set_capture(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+  jitify_conf_t *jconf = conf;
+  ngx_str_t *value = cf->args->elts;
+
+  if (jconf->capture != NGX_CONF_UNSET_PTR) {
+    return "is duplicate";
+  }
+  if (ngx_strcmp(value[1].data, "off") == 0) {
+    jconf->capture = NULL;
+    return NGX_CONF_OK;
+  }
+  jconf->capture = ngx_conf_open_file(cf->cycle, &value[1]);
+  if (!jconf->capture) {
+    return NGX_CONF_ERROR;
+  }
+  return NGX_CONF_OK;
+}
+
+static char *jitify_set_status(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+  jitify_conf_t *jconf = conf;
+  ngx_str_t *value = cf->args->elts;
+  ngx_http_core_loc_conf_t *clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+
+  jconf->status_format = JITIFY_STATUS_JSON;
+  if (cf->args->nelts > 1) {
+    if (ngx_strcmp(value[1].data, "prometheus") == 0) {
+      jconf->status_format = JITIFY_STATUS_PROMETHEUS;
+    }
+    else if (ngx_strcmp(value[1].data, "json") != 0) {
+      return "takes \"json\" or \"prometheus\"";
+    }
+  }
+  clcf->handler = jitify_status_handler;
+  return NGX_CONF_OK;
+}
+
+/* jitify_thread_pool name [threshold=size] | off */
+static char *jitify_set_thread_pool(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+#if (NGX_THREADS)
+  jitify_conf_t *jconf = conf;
+  ngx_str_t *value = cf->args->elts;
+  ngx_uint_t i;
+
+  if (jconf->thread_pool != NGX_CONF_UNSET_PTR) {
+    return "is duplicate";
+  }
+  if (ngx_strcmp(value[1].data, "off") == 0) {
+    jconf->thread_pool = NULL;
+    return NGX_CONF_OK;
+  }
+  jconf->thread_pool = ngx_thread_pool_add(cf, &value[1]);
+  if (!jconf->thread_pool) {
+    return NGX_CONF_ERROR;
+  }
+  for (i = 2; i < cf->args->nelts; i++) {
+    if (ngx_strncmp(value[i].data, "threshold=", 10) == 0) {
+      ngx_str_t size;
+      ssize_t threshold;
+      size.data = value[i].data + 10;
+      size.len = value[i].len - 10;
+      threshold = ngx_parse_size(&size);
+      if (threshold == NGX_ERROR) {
+        return "has an invalid threshold";
+      }
+      jconf->thread_threshold = threshold;
+      continue;
+    }
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"", &value[i]);
+    return NGX_CONF_ERROR;
+  }
+  return NGX_CONF_OK;
+#else
+  return "requires nginx built with --with-threads";
+#endif
+}
+
+/* jitify_cache zone=name[:size] [max_size=size] | off; the size of a
+ * zone is needed only where it's first named
+ */
+static char *jitify_set_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+  jitify_conf_t *jconf = conf;
+  ngx_str_t *value = cf->args->elts;
+  ngx_str_t name = ngx_null_string;
+  ssize_t size = 0;
+  ngx_uint_t i;
+
+  if (jconf->cache != NGX_CONF_UNSET_PTR) {
+    return "is duplicate";
+  }
+  if (ngx_strcmp(value[1].data, "off") == 0) {
+    if (cf->args->nelts > 2) {
+      return "takes no parameters with \"off\"";
+    }
+    jconf->cache = NULL;
+    return NGX_CONF_OK;
+  }
+  for (i = 1; i < cf->args->nelts; i++) {
+    if (ngx_strncmp(value[i].data, "zone=", 5) == 0) {
+      u_char *colon;
+      name.data = value[i].data + 5;
+      name.len = value[i].len - 5;
+      colon = (u_char *)ngx_strchr(name.data, ':');
+      if (colon) {
+        ngx_str_t size_str;
+        size_str.data = colon + 1;
+        size_str.len = name.data + name.len - size_str.data;
+        name.len = colon - name.data;
+        size = ngx_parse_size(&size_str);
+        if (size == NGX_ERROR) {
+          return "has an invalid zone size";
+        }
+        if (size < (ssize_t)(8 * ngx_pagesize)) {
+          ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "zone \"%V\" is too small", &name);
+          return NGX_CONF_ERROR;
+        }
+      }
+      continue;
+    }
+    if (ngx_strncmp(value[i].data, "max_size=", 9) == 0) {
+      ngx_str_t size_str;
+      ssize_t max_size;
+      size_str.data = value[i].data + 9;
+      size_str.len = value[i].len - 9;
+      max_size = ngx_parse_size(&size_str);
+      if ((max_size == NGX_ERROR) || (max_size == 0)) {
+        return "has an invalid max_size";
+      }
+      jconf->cache_max_size = max_size;
+      continue;
+    }
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"", &value[i]);
+    return NGX_CONF_ERROR;
+  }
+  if (!name.len) {
+    return "requires a zone";
+  }
+  jconf->cache = ngx_shared_memory_add(cf, &name, size, &jitify_module);
+  if (!jconf->cache) {
+    return NGX_CONF_ERROR;
+  }
+  if (!jconf->cache->data) {
+    jitify_cache_t *cache = ngx_pcalloc(cf->pool, sizeof(jitify_cache_t));
+    if (!cache) {
+      return NGX_CONF_ERROR;
+    }
+    jconf->cache->init = jitify_init_cache_zone;
+    jconf->cache->data = cache;
+  }
+  return NGX_CONF_OK;
+}
+
+/* jitify_flush [bytes=size] [time=msec] [head] | off */
+static char *jitify_set_flush(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+  jitify_conf_t *jconf = conf;
+  ngx_str_t *value = cf->args->elts;
+  ngx_uint_t i;
+
+  if (jconf->flush_head != NGX_CONF_UNSET) {
+    return "is duplicate";
+  }
+  jconf->flush_bytes = 0;
+  jconf->flush_time = 0;
+  jconf->flush_head = 0;
+  if (ngx_strcmp(value[1].data, "off") == 0) {
+    return (cf->args->nelts == 2) ? NGX_CONF_OK : "takes no parameters with \"off\"";
+  }
+  for (i = 1; i < cf->args->nelts; i++) {
+    ngx_str_t arg;
+    if (ngx_strncmp(value[i].data, "bytes=", 6) == 0) {
+      ssize_t bytes;
+      arg.data = value[i].data + 6;
+      arg.len = value[i].len - 6;
+      bytes = ngx_parse_size(&arg);
+      if ((bytes == NGX_ERROR) || (bytes == 0)) {
+        return "has an invalid bytes value";
+      }
+      jconf->flush_bytes = bytes;
+      continue;
+    }
+    if (ngx_strncmp(value[i].data, "time=", 5) == 0) {
+      ngx_int_t msec;
+      arg.data = value[i].data + 5;
+      arg.len = value[i].len - 5;
+      msec = ngx_parse_time(&arg, 0);
+      if ((msec == NGX_ERROR) || (msec == 0)) {
+        return "has an invalid time value";
+      }
+      jconf->flush_time = msec;
+      continue;
+    }
+    if (ngx_strcmp(value[i].data, "head") == 0) {
+      jconf->flush_head = 1;
+      continue;
+    }
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"", &value[i]);
+    return NGX_CONF_ERROR;
+  }
+  return NGX_CONF_OK;
+}
+
+static void *jitify_create_main_conf(ngx_conf_t *cf)
+{
+  jitify_main_conf_t *jmcf;
+
+  jmcf = ngx_pcalloc(cf->pool, sizeof(*jmcf));
+  if (jmcf) {
+    jmcf->stats = NGX_CONF_UNSET;
+    jmcf->labels = ngx_array_create(cf->pool, 8, sizeof(ngx_str_t));
+    if (!jmcf->labels) {
+      return NULL;
+    }
+  }
+  return jmcf;
+}
+
+static char *jitify_init_main_conf(ngx_conf_t *cf, void *conf)
+{
+  jitify_main_conf_t *jmcf = conf;
+
+  ngx_conf_init_value(jmcf->stats, 0);
+  return NGX_CONF_OK;
+}
+
 static void *jitify_create_conf(ngx_conf_t *cf)
 {
   jitify_conf_t *conf;
@@ -152,24 +2270,89 @@ static void *jitify_create_conf(ngx_conf_t *cf)
   conf = ngx_pcalloc(cf->pool, sizeof(*conf));
   if (conf) {
     conf->minify = NGX_CONF_UNSET;
+    conf->capture = NGX_CONF_UNSET_PTR;
+#if (NGX_THREADS)
+    conf->thread_pool = NGX_CONF_UNSET_PTR;
+#endif
+    conf->thread_threshold = NGX_CONF_UNSET_SIZE;
+    conf->max_setaside = NGX_CONF_UNSET_SIZE;
+    conf->cache = NGX_CONF_UNSET_PTR;
+    conf->cache_max_size = NGX_CONF_UNSET_SIZE;
+    conf->serve_static = NGX_CONF_UNSET;
+    conf->flush_bytes = NGX_CONF_UNSET_SIZE;
+    conf->flush_time = NGX_CONF_UNSET_MSEC;
+    conf->flush_head = NGX_CONF_UNSET;
   }
   return conf;
 }
 
+/* Find or add the stats label of a location; locations with the same
+ * label share their counters
+ */
+static ngx_int_t jitify_stats_slot(jitify_main_conf_t *jmcf, ngx_str_t *label)
+{
+  ngx_str_t *labels = jmcf->labels->elts, *new_label;
+  ngx_uint_t i;
+
+  for (i = 0; i < jmcf->labels->nelts; i++) {
+    if ((labels[i].len == label->len) && !ngx_strncmp(labels[i].data, label->data, label->len)) {
+      return i;
+    }
+  }
+  new_label = ngx_array_push(jmcf->labels);
+  if (!new_label) {
+    return NGX_ERROR;
+  }
+  *new_label = *label;
+  return jmcf->labels->nelts - 1;
+}
+
 static char *jitify_merge_conf(ngx_conf_t *cf, void *parent, void *child)
 {
   jitify_conf_t *prev = parent;
   jitify_conf_t *conf = child;
+  jitify_main_conf_t *jmcf = ngx_http_conf_get_module_main_conf(cf, jitify_module);
   
   ngx_conf_merge_value(conf->minify, prev->minify, 0);
+  ngx_conf_merge_ptr_value(conf->capture, prev->capture, NULL);
+  ngx_conf_merge_str_value(conf->stats_label, prev->stats_label, "");
+#if (NGX_THREADS)
+  ngx_conf_merge_ptr_value(conf->thread_pool, prev->thread_pool, NULL);
+#endif
+  ngx_conf_merge_size_value(conf->thread_threshold, prev->thread_threshold, DEFAULT_THREAD_THRESHOLD);
+  ngx_conf_merge_bufs_value(conf->output_bufs, prev->output_bufs, DEFAULT_OUTPUT_BUFS, ngx_pagesize);
+  ngx_conf_merge_size_value(conf->max_setaside, prev->max_setaside, NGX_CONF_UNSET_SIZE);
+  ngx_conf_merge_ptr_value(conf->cache, prev->cache, NULL);
+  ngx_conf_merge_size_value(conf->cache_max_size, prev->cache_max_size, DEFAULT_CACHE_MAX_SIZE);
+  ngx_conf_merge_value(conf->serve_static, prev->serve_static, 0);
+  ngx_conf_merge_size_value(conf->flush_bytes, prev->flush_bytes, 0);
+  ngx_conf_merge_msec_value(conf->flush_time, prev->flush_time, 0);
+  ngx_conf_merge_value(conf->flush_head, prev->flush_head, 0);
+  if (conf->minify) {
+    u_char settings[NGX_INT_T_LEN + NGX_SIZE_T_LEN + 2];
+    u_char *p = ngx_sprintf(settings, "%i:%uz", conf->minify, conf->max_setaside);
+    conf->fingerprint = ngx_crc32_short(settings, p - settings);
+  }
+  conf->stats_slot = -1;
+  if (conf->minify && jmcf->stats) {
+    ngx_str_t *label = &(conf->stats_label);
+    if (!label->len) {
+      ngx_http_core_loc_conf_t *clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+      label = &(clcf->name);
+    }
+    conf->stats_slot = jitify_stats_slot(jmcf, label);
+    if (conf->stats_slot == NGX_ERROR) {
+      return NGX_CONF_ERROR;
+    }
+  }
   return NGX_CONF_OK;
 }
 
 static ngx_http_module_t jitify_module_ctx = {
   NULL,                     /* pre-config                            */
   jitify_post_config,       /* post-config                           */
-  NULL,                     /* create main (top-level) config struct */
-  NULL,                     /* init main (top-level) config struct   */
+  jitify_create_main_conf,  /* create main (top-level) config struct */
+  jitify_init_main_conf,    /* init main (top-level) config struct   */
   NULL,                     /* create server-level config struct     */
   NULL,                     /* merge server-level config struct      */
   jitify_create_conf,       /* create location-level config struct   */
@@ -186,6 +2369,96 @@ static ngx_command_t jitify_commands[] = {
     offsetof(jitify_conf_t, minify),
     NULL
   },
+  {
+    /* jitify_capture /path/to/trace | off */
+    ngx_string("jitify_capture"),
+    NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+    jitify_set_capture,
+    NGX_HTTP_LOC_CONF_OFFSET,
+    0,
+    NULL
+  },
+  {
+    /* jitify_stats on|off: count responses per location and content type in shared memory */
+    ngx_string("jitify_stats"),
+    NGX_HTTP_MAIN_CONF|NGX_CONF_FLAG,
+    ngx_conf_set_flag_slot,
+    NGX_HTTP_MAIN_CONF_OFFSET,
+    offsetof(jitify_main_conf_t, stats),
+    NULL
+  },
+  {
+    /* jitify_stats_label name: label for this location's counters (default: the location's URI) */
+    ngx_string("jitify_stats_label"),
+    NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+    ngx_conf_set_str_slot,
+    NGX_HTTP_LOC_CONF_OFFSET,
+    offsetof(jitify_conf_t, stats_label),
+    NULL
+  },
+  {
+    /* jitify_thread_pool name [threshold=size] | off: scan large bodies in a thread pool */
+    ngx_string("jitify_thread_pool"),
+    NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE12,
+    jitify_set_thread_pool,
+    NGX_HTTP_LOC_CONF_OFFSET,
+    0,
+    NULL
+  },
+  {
+    /* jitify_output_buffers number size: output buffers kept for reuse by each response */
+    ngx_string("jitify_output_buffers"),
+    NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE2,
+    ngx_conf_set_bufs_slot,
+    NGX_HTTP_LOC_CONF_OFFSET,
+    offsetof(jitify_conf_t, output_bufs),
+    NULL
+  },
+  {
+    /* jitify_max_setaside size: longest token held while waiting for the rest of it */
+    ngx_string("jitify_max_setaside"),
+    NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+    ngx_conf_set_size_slot,
+    NGX_HTTP_LOC_CONF_OFFSET,
+    offsetof(jitify_conf_t, max_setaside),
+    NULL
+  },
+  {
+    /* jitify_cache zone=name[:size] [max_size=size] | off: keep minified responses in shared memory */
+    ngx_string("jitify_cache"),
+    NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE12,
+    jitify_set_cache,
+    NGX_HTTP_LOC_CONF_OFFSET,
+    0,
+    NULL
+  },
+  {
+    /* jitify_static on|off: serve file.min.css (or .min.css.gz) for file.css if it's at least as new */
+    ngx_string("jitify_static"),
+    NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+    ngx_conf_set_flag_slot,
+    NGX_HTTP_LOC_CONF_OFFSET,
+    offsetof(jitify_conf_t, serve_static),
+    NULL
+  },
+  {
+    /* jitify_flush [bytes=size] [time=msec] [head] | off: flush output early, before buffers fill */
+    ngx_string("jitify_flush"),
+    NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
+    jitify_set_flush,
+    NGX_HTTP_LOC_CONF_OFFSET,
+    0,
+    NULL
+  },
+  {
+    /* jitify_status [json|prometheus]: serve the counters from this location */
+    ngx_string("jitify_status"),
+    NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS|NGX_CONF_TAKE1,
+    jitify_set_status,
+    NGX_HTTP_LOC_CONF_OFFSET,
+    0,
+    NULL
+  },
   ngx_null_command
 };
 
@@ -196,7 +2469,7 @@ ngx_module_t jitify_module = {
   NGX_HTTP_MODULE,
   NULL,                     /* init master     */
   NULL,                     /* init module     */
-  NULL,                     /* init process    */
+  jitify_init_process,      /* init process    */
   NULL,                     /* init thread     */
   NULL,                     /* cleanup thread  */
   NULL,                     /* cleanup process */
@@ -1,10 +1,14 @@
+#include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <unistd.h>
+#include <zlib.h>
 
 #include <jitify.h>
 
@@ -25,11 +29,22 @@ static void usage()
   fprintf(stderr, "usage:\n");
   fprintf(stderr, "  %s [options] (--css | --js | --html)  # read from stdin, write to stdout\n", PROGRAM_NAME);
   fprintf(stderr, "  %s [options] filename                 # read from file, write to stdout\n", PROGRAM_NAME);
+  fprintf(stderr, "  %s [options] --docroot=<dir>         # write file.min.css for each file.css etc. under dir\n",
+          PROGRAM_NAME);
   fprintf(stderr, "options:\n");
   fprintf(stderr, "  --remove-space      # remove unnecessary whitespace\n");
   fprintf(stderr, "  --remove-comments   # remove comments\n");
   fprintf(stderr, "  --minify            # equivalent to \"--remove-space --remove-comments\"\n");
   fprintf(stderr, "  --block-size=<n>    # process the input at most n bytes at a time\n");
+  fprintf(stderr, "  --max-setaside=<n>  # hold at most n bytes of a token that spans blocks\n");
+  fprintf(stderr, "  --iterations=<n>    # process the input file n times\n");
+  fprintf(stderr, "  --stats=text|json   # format of the statistics written to stderr\n");
+  fprintf(stderr, "  --replay=<trace>    # split the input where the buffers in a mod_jitify capture trace ended\n");
+  fprintf(stderr, "  --replay-record=<n> # use the nth record in the trace (default 1)\n");
+  fprintf(stderr, "  --trace=<file>      # write a record for every token of the first iteration to file\n");
+  fprintf(stderr, "  --trace-format=<f>  # format of the token trace: csv (default) or binary\n");
+  fprintf(stderr, "  --check-allocs      # reuse one lexer for every iteration and fail if any after the first allocates\n");
+  fprintf(stderr, "  --gzip              # with --docroot, also write file.min.css.gz etc.\n");
 }
 
 static int get_content_type(const char *filename)
@@ -51,75 +66,751 @@ static int get_content_type(const char *filename)
   return 0;
 }
 
-static void process_file(int fd)
+#define STATS_TEXT 0
+#define STATS_JSON 1
+
+static int iterations = 1;
+static int stats_format = STATS_TEXT;
+
+typedef struct {
+  size_t bytes_in;
+  size_t bytes_out;
+  unsigned long long duration; /* nsec */
+  size_t allocs;
+  size_t pool_bytes;
+  size_t pool_high_water;
+  size_t setasides;
+  size_t setaside_overflows;
+  size_t failsafe_events;
+  size_t num_token_types;
+  jitify_token_stats_t token_types[JITIFY_MAX_TOKEN_TYPES];
+} run_stats_t;
+
+static void add_lexer_stats(run_stats_t *stats, jitify_lexer_t *lexer)
 {
-  jitify_pool_t *p = jitify_malloc_pool_create();
-  jitify_output_stream_t *out = jitify_stdio_output_stream_create(p, stdout);
-  jitify_lexer_t *lexer;
+  jitify_lexer_stats_t lexer_stats;
+  size_t i;
+  jitify_lexer_get_stats(lexer, &lexer_stats);
+  stats->bytes_in += lexer_stats.bytes_in;
+  stats->bytes_out += lexer_stats.bytes_out;
+  stats->duration += lexer_stats.processing_time;
+  stats->setasides += lexer_stats.setasides;
+  stats->setaside_overflows += lexer_stats.setaside_overflows;
+  stats->failsafe_events += lexer_stats.failsafe_events;
+  stats->num_token_types = lexer_stats.num_token_types;
+  for (i = 0; i < lexer_stats.num_token_types; i++) {
+    jitify_token_stats_t *total = &(stats->token_types[i]);
+    total->name = lexer_stats.token_types[i].name;
+    total->tokens += lexer_stats.token_types[i].tokens;
+    total->bytes_in += lexer_stats.token_types[i].bytes_in;
+    total->bytes_out += lexer_stats.token_types[i].bytes_out;
+    total->bytes_removed += lexer_stats.token_types[i].bytes_removed;
+  }
+}
+
+static void print_stats(const run_stats_t *stats)
+{
+  size_t i;
+  int first = 1;
+  if (stats_format == STATS_JSON) {
+    fprintf(stderr, "{\"block_size\":%lu,\"max_setaside\":%d,\"iterations\":%d,"
+      "\"bytes_in\":%lu,\"bytes_out\":%lu,\"usec\":%lu,\"allocs\":%lu,\"pool_bytes\":%lu,\"pool_high_water\":%lu,"
+      "\"setasides\":%lu,\"setaside_overflows\":%lu,\"failsafe_events\":%lu,\"token_types\":{",
+      (unsigned long)block_size, max_setaside, iterations,
+      (unsigned long)stats->bytes_in, (unsigned long)stats->bytes_out, (unsigned long)(stats->duration / 1000),
+      (unsigned long)stats->allocs, (unsigned long)stats->pool_bytes, (unsigned long)stats->pool_high_water,
+      (unsigned long)stats->setasides, (unsigned long)stats->setaside_overflows,
+      (unsigned long)stats->failsafe_events);
+    for (i = 0; i < stats->num_token_types; i++) {
+      const jitify_token_stats_t *t = &(stats->token_types[i]);
+      if (t->tokens) {
+        fprintf(stderr, "%s\"%s\":{\"tokens\":%lu,\"bytes_in\":%lu,\"bytes_out\":%lu,\"bytes_removed\":%lu}",
+          first ? "" : ",", t->name, (unsigned long)t->tokens, (unsigned long)t->bytes_in,
+          (unsigned long)t->bytes_out, (unsigned long)t->bytes_removed);
+        first = 0;
+      }
+    }
+    fprintf(stderr, "}}\n");
+    return;
+  }
+  if (stats->bytes_in) {
+    fprintf(stderr, "%lu bytes in, %lu bytes out, %lu usec (%lu nsec/byte)\n",
+      (unsigned long)stats->bytes_in, (unsigned long)stats->bytes_out, (unsigned long)(stats->duration / 1000),
+      (unsigned long)(stats->duration / stats->bytes_in));
+  }
+  fprintf(stderr, "%lu allocations, %lu bytes in pool, high water %lu bytes\n",
+    (unsigned long)stats->allocs, (unsigned long)stats->pool_bytes, (unsigned long)stats->pool_high_water);
+  if (stats->setasides) {
+    fprintf(stderr, "%lu tokens spanned buffers, %lu exceeded the max setaside\n",
+      (unsigned long)stats->setasides, (unsigned long)stats->setaside_overflows);
+  }
+  if (stats->failsafe_events) {
+    fprintf(stderr, "%lu documents fell back to failsafe mode\n", (unsigned long)stats->failsafe_events);
+  }
+  for (i = 0; i < stats->num_token_types; i++) {
+    const jitify_token_stats_t *t = &(stats->token_types[i]);
+    if (t->tokens) {
+      if (first) {
+        fprintf(stderr, "%-20s %10s %12s %12s %12s\n", "token type", "tokens", "bytes in", "bytes out", "removed");
+        first = 0;
+      }
+      fprintf(stderr, "%-20s %10lu %12lu %12lu %12lu\n", t->name, (unsigned long)t->tokens,
+        (unsigned long)t->bytes_in, (unsigned long)t->bytes_out, (unsigned long)t->bytes_removed);
+    }
+  }
+}
+
+/* Chunk boundaries to replay, from a trace recorded by mod_jitify.
+ * A trace file holds one record per line, "<uri> <len> <len> ...",
+ * listing the lengths of the buffers in which a response body
+ * reached the filter.
+ */
+static const char *replay_file = NULL;
+static int replay_record = 1;
+static size_t *replay_chunks = NULL;
+static size_t num_replay_chunks = 0;
+
+static int load_trace()
+{
+  FILE *trace = fopen(replay_file, "r");
+  char line[65536];
+  int record = 0;
+  size_t size = 0;
+  if (!trace) {
+    fprintf(stderr, "%s: cannot read %s\n", PROGRAM_NAME, replay_file);
+    return -1;
+  }
+  while (fgets(line, sizeof(line), trace)) {
+    char *field;
+    if (++record != replay_record) {
+      continue;
+    }
+    strtok(line, " \t\r\n"); /* Skip the URI */
+    while ((field = strtok(NULL, " \t\r\n"))) {
+      if (num_replay_chunks == size) {
+        size = size ? size * 2 : 64;
+        replay_chunks = realloc(replay_chunks, size * sizeof(size_t));
+      }
+      replay_chunks[num_replay_chunks++] = strtoul(field, NULL, 10);
+    }
+    break;
+  }
+  fclose(trace);
+  if (record != replay_record) {
+    fprintf(stderr, "%s: %s has no record %d\n", PROGRAM_NAME, replay_file, replay_record);
+    return -1;
+  }
+  return 0;
+}
+
+static char *read_all(int fd, size_t *len)
+{
+  size_t size = 65536;
+  char *data = malloc(size);
   int bytes_read;
-  size_t bytes_in, bytes_out, duration;
-  
-  char *block;
-  
+  *len = 0;
+  while ((bytes_read = read(fd, data + *len, size - *len)) > 0) {
+    *len += bytes_read;
+    if (*len == size) {
+      size *= 2;
+      data = realloc(data, size);
+    }
+  }
+  return data;
+}
+
+/* Scan body with the recorded chunk boundaries; any part of the body
+ * beyond the recorded chunks is scanned in blocks of block_size
+ * @return 0, or -1 if the output can't be written
+ */
+static int replay(jitify_lexer_t *lexer, const char *body, size_t body_len)
+{
+  size_t i, offset = 0;
+  for (i = 0; offset < body_len; i++) {
+    size_t len = (i < num_replay_chunks) ? replay_chunks[i] : block_size;
+    if (len > body_len - offset) {
+      len = body_len - offset;
+    }
+    if (jitify_lexer_scan(lexer, body + offset, len, 0) < 0) {
+      return -1;
+    }
+    offset += len;
+  }
+  return 0;
+}
+
+/* Token trace.  The CSV format has a header line followed by one line
+ * per token.  The binary format starts with "JTRACE1\n", a 32-bit count
+ * of token types and, for each type, a length byte and the type's name;
+ * each token is then a 20-byte record holding the 64-bit offset, the
+ * 32-bit input and output lengths, a type byte, a setaside byte and two
+ * bytes of padding.  All integers are little-endian.
+ */
+#define TRACE_CSV    0
+#define TRACE_BINARY 1
+
+static const char *trace_file = NULL;
+static int trace_format = TRACE_CSV;
+static FILE *trace_out = NULL;
+
+static void put_le(unsigned char *buf, unsigned long long value, size_t len)
+{
+  size_t i;
+  for (i = 0; i < len; i++) {
+    buf[i] = (unsigned char)(value >> (8 * i));
+  }
+}
+
+static void write_trace_header(jitify_lexer_t *lexer)
+{
+  jitify_lexer_stats_t lexer_stats;
+  unsigned char count[4];
+  size_t i;
+  if (trace_format == TRACE_CSV) {
+    fprintf(trace_out, "type,offset,length_in,length_out,setaside\n");
+    return;
+  }
+  jitify_lexer_get_stats(lexer, &lexer_stats);
+  fwrite("JTRACE1\n", 1, 8, trace_out);
+  put_le(count, lexer_stats.num_token_types, 4);
+  fwrite(count, 1, 4, trace_out);
+  for (i = 0; i < lexer_stats.num_token_types; i++) {
+    const char *name = lexer_stats.token_types[i].name;
+    size_t len = strlen(name);
+    fputc((int)len, trace_out);
+    fwrite(name, 1, len, trace_out);
+  }
+}
+
+static void trace_token(const jitify_token_trace_t *token, void *arg)
+{
+  FILE *f = arg;
+  unsigned char record[20];
+  if (trace_format == TRACE_CSV) {
+    fprintf(f, "%s,%lu,%lu,%lu,%d\n", token->name, (unsigned long)token->offset,
+      (unsigned long)token->length_in, (unsigned long)token->length_out, token->setaside);
+    return;
+  }
+  put_le(record, token->offset, 8);
+  put_le(record + 8, token->length_in, 4);
+  put_le(record + 12, token->length_out, 4);
+  record[16] = (unsigned char)token->type;
+  record[17] = token->setaside ? 1 : 0;
+  record[18] = record[19] = 0;
+  fwrite(record, 1, sizeof(record), f);
+}
+
+static jitify_lexer_t *create_lexer(jitify_pool_t *p, jitify_output_stream_t *out)
+{
   switch (content_type) {
     case CONTENT_TYPE_CSS:
-      lexer = jitify_css_lexer_create(p, out);
-      break;
+      return jitify_css_lexer_create(p, out);
     case CONTENT_TYPE_JS:
-      lexer = jitify_js_lexer_create(p, out);
-      break;
+      return jitify_js_lexer_create(p, out);
     case CONTENT_TYPE_HTML:
-      lexer = jitify_html_lexer_create(p, out);
-      break;
+      return jitify_html_lexer_create(p, out);
     default:
       fprintf(stderr, "%s: internal error\n", PROGRAM_NAME);
-      return;
+      return NULL;
   }
-  
+}
+
+/* Apply the command-line options to a new or reset lexer */
+static void configure_lexer(jitify_lexer_t *lexer)
+{
   if (max_setaside >= 0) {
     jitify_lexer_set_max_setaside(lexer, (size_t)max_setaside);
   }
   jitify_lexer_set_minify_rules(lexer, remove_space, remove_comments);
+  if (trace_out) {
+    write_trace_header(lexer);
+    jitify_lexer_set_trace(lexer, trace_token, trace_out);
+  }
+}
+
+/* Scan the whole input, either body or what can be read from fd in
+ * blocks of block_size
+ * @return 0, or -1 if the input can't be read or the output written
+ */
+static int scan_input(jitify_lexer_t *lexer, int fd, const char *body, size_t body_len, char *block)
+{
+  ssize_t bytes_read;
+  int rc = 0;
   
-  block = jitify_malloc(p, block_size);
-  while ((bytes_read = read(fd, block, block_size)) > 0) {
+  if (body) {
+    /* The body outlives the lexer, so tokens that span replayed chunks
+     * are held by reference rather than copied
+     */
+    jitify_lexer_set_retain_input(lexer, 1);
+    rc = replay(lexer, body, body_len);
+    bytes_read = 0;
+    block = NULL;
+  }
+  while (block && (rc == 0) && (bytes_read = read(fd, block, block_size)) > 0) {
     const char *err;
-    jitify_lexer_scan(lexer, block, bytes_read, 0);
+    if (jitify_lexer_scan(lexer, block, bytes_read, 0) < 0) {
+      rc = -1;
+    }
     err = jitify_lexer_get_err(lexer);
     if (err) {
-      size_t err_len = 20;
+      char err_buf[21];
+      size_t err_len = sizeof(err_buf) - 1;
       size_t max_len = (block + bytes_read) - err;
-      char *err_buf;
       if (err_len > max_len) {
         err_len = max_len;
       }
-      err_buf = jitify_malloc(p, err_len + 1);
       memcpy(err_buf, err, err_len);
-      err_buf[err_len] = 1;
+      err_buf[err_len] = 0;
       fprintf(stderr, "parsing error detected near '%s'\n", err_buf);
     }
   }
-  if (bytes_read == 0) {
-    jitify_lexer_scan(lexer, "NULL", 0, 1);
+  if (bytes_read < 0) {
+    perror(PROGRAM_NAME);
+    rc = -1;
   }
-  bytes_in = jitify_lexer_get_bytes_in(lexer);
-  bytes_out = jitify_lexer_get_bytes_out(lexer);
-  duration = jitify_lexer_get_processing_time(lexer);
-  if (bytes_in) {
-    fprintf(stderr, "%lu bytes in, %lu bytes out, %lu usec (%lu nsec/byte)\n",
-      (unsigned long)bytes_in, (unsigned long)bytes_out, (unsigned long)duration,
-      (unsigned long)((1000 * duration)/bytes_in));
+  if ((rc == 0) && (jitify_lexer_scan(lexer, "NULL", 0, 1) < 0)) {
+    rc = -1;
+  }
+  return rc;
+}
+
+/* Process the input once, with memory from p */
+static int process_once(int fd, const char *body, size_t body_len, jitify_pool_t *p, run_stats_t *stats)
+{
+  jitify_output_stream_t *out = jitify_stdio_output_stream_create(p, stdout);
+  jitify_lexer_t *lexer = create_lexer(p, out);
+  char *block;
+  int rc;
+  
+  if (!lexer) {
+    return -1;
   }
+  configure_lexer(lexer);
+  block = body ? NULL : jitify_malloc(p, block_size);
+  rc = scan_input(lexer, fd, body, body_len, block);
+  add_lexer_stats(stats, lexer);
   
   jitify_free(p, block);
   jitify_lexer_destroy(lexer);
   jitify_output_stream_destroy(out);
+  return rc;
+}
+
+static int check_allocs = 0;
+
+/* Process the input repeatedly with one lexer, resetting it between
+ * passes as a long-running server does between documents.  Once the
+ * first pass has sized its buffers, later passes must not allocate.
+ * @return the number of passes that allocated memory, or -1 on error
+ */
+static int process_with_reuse(int fd, const char *body, size_t body_len, run_stats_t *stats)
+{
+  jitify_pool_t *system = jitify_malloc_pool_create();
+  jitify_pool_t *p = jitify_counting_pool_create(system);
+  jitify_output_stream_t *out = jitify_stdio_output_stream_create(p, stdout);
+  jitify_lexer_t *lexer = create_lexer(p, out);
+  jitify_pool_stats_t before, after;
+  char *block = body ? NULL : malloc(block_size);
+  int i, failures = 0;
+  
+  if (!lexer) {
+    failures = -1;
+  }
+  for (i = 0; lexer && (i < iterations); i++) {
+    if (i) {
+      if (!body && (lseek(fd, 0, SEEK_SET) < 0)) {
+        fprintf(stderr, "%s: --iterations requires an input file\n", PROGRAM_NAME);
+        failures = -1;
+        break;
+      }
+      jitify_lexer_reset(lexer);
+    }
+    configure_lexer(lexer);
+    jitify_pool_get_stats(p, &before);
+    if (scan_input(lexer, fd, body, body_len, block) < 0) {
+      failures = -1;
+      break;
+    }
+    jitify_pool_get_stats(p, &after);
+    add_lexer_stats(stats, lexer);
+    if (trace_out) {
+      jitify_lexer_set_trace(lexer, NULL, NULL);
+      fclose(trace_out);
+      trace_out = NULL;
+    }
+    if (i && (after.allocs > before.allocs)) {
+      fprintf(stderr, "%s: pass %d made %lu allocations (%lu bytes) after warm-up\n", PROGRAM_NAME, i + 1,
+        (unsigned long)(after.allocs - before.allocs),
+        (unsigned long)(after.bytes_allocated - before.bytes_allocated));
+      failures++;
+    }
+  }
+  jitify_pool_get_stats(p, &after);
+  stats->allocs = after.allocs;
+  stats->pool_bytes = after.bytes_live;
+  stats->pool_high_water = after.bytes_high_water;
+  
+  free(block);
+  jitify_lexer_destroy(lexer);
+  jitify_output_stream_destroy(out);
+  jitify_pool_destroy(p);
+  jitify_pool_destroy(system);
+  return failures;
+}
+
+static int process_file(int fd)
+{
+  jitify_pool_t *p = jitify_arena_pool_create(0, 0);
+  jitify_pool_stats_t pool_stats;
+  run_stats_t stats;
+  char *body = NULL;
+  size_t body_len = 0;
+  int i, rc = 0;
+  
+  memset(&stats, 0, sizeof(stats));
+  if (replay_file) {
+    if (load_trace() < 0) {
+      jitify_pool_destroy(p);
+      return -1;
+    }
+    body = read_all(fd, &body_len);
+  }
+  if (trace_file) {
+    trace_out = fopen(trace_file, "w");
+    if (!trace_out) {
+      perror(trace_file);
+      free(body);
+      jitify_pool_destroy(p);
+      return -1;
+    }
+  }
+  if (check_allocs) {
+    rc = process_with_reuse(fd, body, body_len, &stats);
+  }
+  for (i = 0; !check_allocs && (i < iterations); i++) {
+    if (i && !body && (lseek(fd, 0, SEEK_SET) < 0)) {
+      fprintf(stderr, "%s: --iterations requires an input file\n", PROGRAM_NAME);
+      break;
+    }
+    if (process_once(fd, body, body_len, p, &stats) < 0) {
+      rc = -1;
+      break;
+    }
+    if (trace_out) {
+      fclose(trace_out);
+      trace_out = NULL;
+    }
+    /* The pool is recycled between iterations, as a long-running
+     * application would do between documents
+     */
+    if (jitify_pool_get_stats(p, &pool_stats) == JITIFY_OK) {
+      stats.allocs += pool_stats.allocs;
+      stats.pool_bytes = pool_stats.bytes_reserved;
+      stats.pool_high_water = pool_stats.bytes_high_water;
+    }
+    jitify_pool_reset(p);
+  }
+  if (trace_out) {
+    fclose(trace_out);
+  }
+  print_stats(&stats);
+  free(body);
   jitify_pool_destroy(p);
+  return rc;
+}
+
+/* Docroot build mode: minify every CSS, JS and HTML file under a
+ * directory into a sibling, e.g. style.min.css for style.css, for the
+ * nginx module's jitify_static to serve.  Each sibling is given the
+ * mtime of its source, which is how both the build and the server tell
+ * that it's current; the build can be rerun after each deployment.
+ */
+static const char *docroot = NULL;
+static int docroot_gzip = 0;
+
+typedef struct {
+  run_stats_t stats;
+  unsigned long built;
+  unsigned long current;
+  unsigned long failed;
+} docroot_stats_t;
+
+/* @return whether target exists and has the mtime of source */
+static int is_current(const char *target, const struct stat *source)
+{
+  struct stat st;
+  return (stat(target, &st) == 0) && (st.st_mtim.tv_sec == source->st_mtim.tv_sec) &&
+    (st.st_mtim.tv_nsec == source->st_mtim.tv_nsec);
+}
+
+/* Give target the mtime of source, before it's renamed into place */
+static int copy_mtime(const char *target, const struct stat *source)
+{
+  struct timespec times[2];
+  times[0].tv_sec = 0;
+  times[0].tv_nsec = UTIME_OMIT;
+  times[1] = source->st_mtim;
+  if (utimensat(AT_FDCWD, target, times, 0) != 0) {
+    perror(target);
+    return -1;
+  }
+  return 0;
+}
+
+/* Write to a temporary file and rename it into place, so a server never
+ * sees a partly written sibling
+ */
+static char *temp_name(const char *path)
+{
+  char *tmp = malloc(strlen(path) + sizeof(".tmp"));
+  if (tmp) {
+    strcpy(tmp, path);
+    strcat(tmp, ".tmp");
+  }
+  return tmp;
+}
+
+static int minify_to_file(const char *src, const char *dst, run_stats_t *stats)
+{
+  jitify_pool_t *p = jitify_arena_pool_create(0, 0);
+  char *tmp = temp_name(dst);
+  jitify_output_stream_t *out;
+  jitify_lexer_t *lexer;
+  FILE *file = NULL;
+  struct stat st;
+  char *block;
+  int fd = -1, rc = -1;
+
+  if (!p || !tmp) {
+    goto done;
+  }
+  /* The mtime is taken from the open file, so an edit made while it's
+   * being minified leaves the sibling out of date rather than current
+   */
+  fd = open(src, O_RDONLY);
+  if ((fd < 0) || (fstat(fd, &st) != 0)) {
+    perror(src);
+    goto done;
+  }
+  file = fopen(tmp, "w");
+  if (!file) {
+    perror(tmp);
+    goto done;
+  }
+  out = jitify_stdio_output_stream_create(p, file);
+  lexer = create_lexer(p, out);
+  if (!lexer) {
+    goto done;
+  }
+  configure_lexer(lexer);
+  block = jitify_malloc(p, block_size);
+  /* A partial sibling would be served in place of the whole file */
+  rc = scan_input(lexer, fd, NULL, 0, block);
+  if (rc == 0) {
+    add_lexer_stats(stats, lexer);
+  }
+  else {
+    fprintf(stderr, "%s: cannot minify %s\n", PROGRAM_NAME, src);
+  }
+  jitify_lexer_destroy(lexer);
+  jitify_output_stream_destroy(out);
+
+done:
+  if (fd >= 0) {
+    close(fd);
+  }
+  if (file && (fclose(file) != 0)) {
+    perror(tmp);
+    rc = -1;
+  }
+  if (file && (rc == 0) && (copy_mtime(tmp, &st) != 0)) {
+    rc = -1;
+  }
+  if (file && (rc == 0) && (rename(tmp, dst) != 0)) {
+    perror(dst);
+    rc = -1;
+  }
+  if (file && (rc != 0)) {
+    unlink(tmp);
+  }
+  free(tmp);
+  if (p) {
+    jitify_pool_destroy(p);
+  }
+  return rc;
+}
+
+static int gzip_to_file(const char *src, const char *dst)
+{
+  char *tmp = temp_name(dst);
+  char *block = malloc(block_size);
+  gzFile gz = NULL;
+  struct stat st;
+  int fd = -1, rc = -1;
+  ssize_t bytes_read;
+
+  if (!tmp || !block) {
+    goto done;
+  }
+  fd = open(src, O_RDONLY);
+  if ((fd < 0) || (fstat(fd, &st) != 0)) {
+    perror(src);
+    goto done;
+  }
+  gz = gzopen(tmp, "wb9");
+  if (!gz) {
+    perror(tmp);
+    goto done;
+  }
+  while ((bytes_read = read(fd, block, block_size)) > 0) {
+    if (gzwrite(gz, block, (unsigned)bytes_read) != bytes_read) {
+      break;
+    }
+  }
+  rc = (bytes_read == 0) ? 0 : -1;
+
+done:
+  if (fd >= 0) {
+    close(fd);
+  }
+  if (gz && (gzclose(gz) != Z_OK)) {
+    rc = -1;
+  }
+  if (gz && (rc == 0) && (copy_mtime(tmp, &st) != 0)) {
+    rc = -1;
+  }
+  if (gz && (rc == 0) && (rename(tmp, dst) != 0)) {
+    rc = -1;
+  }
+  if (gz && (rc != 0)) {
+    fprintf(stderr, "%s: cannot write %s\n", PROGRAM_NAME, dst);
+    unlink(tmp);
+  }
+  free(tmp);
+  free(block);
+  return rc;
+}
+
+/* Build the siblings of one file, if it has a lexer and isn't already
+ * a minified sibling itself
+ */
+static void build_file(const char *path, const struct stat *st, docroot_stats_t *totals)
+{
+  const char *dot = strrchr(path, '.');
+  size_t base_len;
+  char *min_path, *gz_path;
+  struct stat min_st;
+
+  content_type = get_content_type(path);
+  if (!content_type || ((dot - path >= 4) && !strncmp(dot - 4, ".min", 4))) {
+    return;
+  }
+  base_len = dot - path;
+  min_path = malloc(strlen(path) + sizeof(".min"));
+  if (!min_path) {
+    totals->failed++;
+    return;
+  }
+  memcpy(min_path, path, base_len);
+  strcpy(min_path + base_len, ".min");
+  strcat(min_path, dot);
+  if (is_current(min_path, st)) {
+    totals->current++;
+  }
+  else if (minify_to_file(path, min_path, &(totals->stats)) == 0) {
+    totals->built++;
+  }
+  else {
+    totals->failed++;
+    free(min_path);
+    return;
+  }
+  if (docroot_gzip && (stat(min_path, &min_st) == 0)) {
+    gz_path = malloc(strlen(min_path) + sizeof(".gz"));
+    if (!gz_path) {
+      totals->failed++;
+    }
+    else {
+      strcpy(gz_path, min_path);
+      strcat(gz_path, ".gz");
+      if (!is_current(gz_path, &min_st) && (gzip_to_file(min_path, gz_path) != 0)) {
+        totals->failed++;
+      }
+      free(gz_path);
+    }
+  }
+  free(min_path);
+}
+
+/* Walk a directory tree; symbolic links aren't followed, so a link
+ * can't lead the walk around in a cycle
+ */
+static void build_dir(const char *dir, docroot_stats_t *totals)
+{
+  DIR *d = opendir(dir);
+  struct dirent *entry;
+
+  if (!d) {
+    perror(dir);
+    totals->failed++;
+    return;
+  }
+  while ((entry = readdir(d)) != NULL) {
+    struct stat st;
+    char *path;
+    if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) {
+      continue;
+    }
+    path = malloc(strlen(dir) + strlen(entry->d_name) + 2);
+    if (!path) {
+      totals->failed++;
+      break;
+    }
+    sprintf(path, "%s/%s", dir, entry->d_name);
+    if (lstat(path, &st) != 0) {
+      perror(path);
+      totals->failed++;
+    }
+    else if (S_ISDIR(st.st_mode)) {
+      build_dir(path, totals);
+    }
+    else if (S_ISREG(st.st_mode)) {
+      build_file(path, &st, totals);
+    }
+    free(path);
+  }
+  closedir(d);
+}
+
+/* @return the number of files that could not be built */
+static unsigned long build_docroot()
+{
+  docroot_stats_t totals;
+
+  memset(&totals, 0, sizeof(totals));
+  /* Siblings are for serving, so minify unless told what to remove */
+  if (!remove_space && !remove_comments) {
+    remove_space = remove_comments = 1;
+  }
+  build_dir(docroot, &totals);
+  fprintf(stderr, "%s: %lu files minified, %lu up to date, %lu failed\n", PROGRAM_NAME,
+          totals.built, totals.current, totals.failed);
+  if (totals.built) {
+    print_stats(&(totals.stats));
+  }
+  return totals.failed;
 }
 
 #define OPT_MINIFY 1
 #define OPT_BLOCK_SIZE 2
 #define OPT_MAX_SETASIDE 3
+#define OPT_STATS 4
+#define OPT_ITERATIONS 5
+#define OPT_REPLAY 6
+#define OPT_REPLAY_RECORD 7
+#define OPT_TRACE 8
+#define OPT_TRACE_FORMAT 9
+#define OPT_DOCROOT 10
 
 int main(int argc, char **argv)
 {
@@ -132,10 +823,20 @@ int main(int argc, char **argv)
     { "remove-comments", no_argument, &remove_comments, 1},
     { "minify", no_argument, NULL, OPT_MINIFY },
     { "block-size", required_argument, NULL, OPT_BLOCK_SIZE },
+    { "stats", required_argument, NULL, OPT_STATS },
+    { "iterations", required_argument, NULL, OPT_ITERATIONS },
+    { "replay", required_argument, NULL, OPT_REPLAY },
+    { "replay-record", required_argument, NULL, OPT_REPLAY_RECORD },
+    { "trace", required_argument, NULL, OPT_TRACE },
+    { "trace-format", required_argument, NULL, OPT_TRACE_FORMAT },
+    { "check-allocs", no_argument, &check_allocs, 1 },
+    { "docroot", required_argument, NULL, OPT_DOCROOT },
+    { "gzip", no_argument, &docroot_gzip, 1 },
     { NULL, 0, 0, 0 }
   };
   int opt;
   int fd;
+  int rc;
   
   do {
     opt = getopt_long(argc, argv, "", opts, NULL);
@@ -150,10 +851,59 @@ int main(int argc, char **argv)
       case OPT_MAX_SETASIDE:
       max_setaside = atoi(optarg);
       break;
+      case OPT_STATS:
+      if (!strcmp(optarg, "json")) {
+        stats_format = STATS_JSON;
+      }
+      else if (!strcmp(optarg, "text")) {
+        stats_format = STATS_TEXT;
+      }
+      else {
+        usage();
+        return 1;
+      }
+      break;
+      case OPT_REPLAY:
+      replay_file = optarg;
+      break;
+      case OPT_REPLAY_RECORD:
+      replay_record = atoi(optarg);
+      break;
+      case OPT_TRACE:
+      trace_file = optarg;
+      break;
+      case OPT_TRACE_FORMAT:
+      if (!strcmp(optarg, "csv")) {
+        trace_format = TRACE_CSV;
+      }
+      else if (!strcmp(optarg, "binary")) {
+        trace_format = TRACE_BINARY;
+      }
+      else {
+        usage();
+        return 1;
+      }
+      break;
+      case OPT_DOCROOT:
+      docroot = optarg;
+      break;
+      case OPT_ITERATIONS:
+      iterations = atoi(optarg);
+      if (iterations < 1) {
+        iterations = 1;
+      }
+      break;
     }
   } while (opt != -1);
   argc -= optind;
   argv += optind;
+  if (docroot) {
+    if (argc || content_type) {
+      usage();
+      return 1;
+    }
+    return (build_docroot() == 0) ? 0 : 4;
+  }
   if (argc > 1) {
     usage();
     return 1;
@@ -180,9 +930,9 @@ int main(int argc, char **argv)
       return 3;
     }
   }
-  process_file(fd);
+  rc = process_file(fd);
   if (fd != 0) {
     close(fd);
   }
-  return 0;
+  return (rc == 0) ? 0 : 4;
 }
@@ -0,0 +1,344 @@
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Generates synthetic documents for benchmarking the lexers.  The
+ * output depends only on the options, so runs are reproducible.
+ */
+
+static const char *PROGRAM_NAME = "jitify-corpus";
+
+#define TYPE_CSS  1
+#define TYPE_HTML 2
+#define TYPE_JS   3
+
+#define SHAPE_TAG_DENSE      1
+#define SHAPE_COMMENT_HEAVY  2
+#define SHAPE_SCRIPT_HEAVY   3
+#define SHAPE_MINIFIED       4
+
+static int content_type = 0;
+static int shape = SHAPE_TAG_DENSE;
+static size_t target_size = 1024 * 1024;
+static uint64_t seed = 1;
+
+static void usage()
+{
+  fprintf(stderr, "usage:\n");
+  fprintf(stderr, "  %s (--css | --js | --html) [options]  # write a document to stdout\n", PROGRAM_NAME);
+  fprintf(stderr, "options:\n");
+  fprintf(stderr, "  --shape=<s>     # tag-dense (default), comment-heavy, script-heavy, or minified\n");
+  fprintf(stderr, "  --size=<n>      # approximate output size in bytes (default 1048576)\n");
+  fprintf(stderr, "  --seed=<n>      # seed for the pseudo-random generator (default 1)\n");
+}
+
+/* xorshift on a 64-bit state whatever the width of long, so the output
+ * doesn't depend on the platform
+ */
+static uint32_t next_random()
+{
+  seed ^= seed << 13;
+  seed ^= seed >> 7;
+  seed ^= seed << 17;
+  return (uint32_t)seed;
+}
+
+static size_t random_below(size_t n)
+{
+  return next_random() % n;
+}
+
+static size_t bytes_written = 0;
+
+static void emit(const char *s)
+{
+  bytes_written += strlen(s);
+  fputs(s, stdout);
+}
+
+static void emit_word(size_t max_len)
+{
+  char word[32];
+  size_t i, len = 1 + random_below(max_len < sizeof(word) ? max_len : sizeof(word) - 1);
+  for (i = 0; i < len; i++) {
+    word[i] = 'a' + random_below(26);
+  }
+  word[len] = 0;
+  emit(word);
+}
+
+/* Whitespace as it appears in hand-written source, or none when minified */
+static void emit_space(const char *space)
+{
+  if (shape != SHAPE_MINIFIED) {
+    emit(space);
+  }
+}
+
+static void emit_comment(const char *open, const char *close)
+{
+  size_t i, words = (shape == SHAPE_COMMENT_HEAVY) ? 20 + random_below(200) : 3;
+  emit(open);
+  for (i = 0; i < words; i++) {
+    emit(" ");
+    emit_word(10);
+  }
+  emit(" ");
+  emit(close);
+  emit_space("\n");
+}
+
+static void css_rule()
+{
+  size_t i, num_decls = 1 + random_below(6);
+  if ((shape == SHAPE_COMMENT_HEAVY) || ((shape != SHAPE_MINIFIED) && !random_below(8))) {
+    emit_comment("/*", "*/");
+  }
+  emit(random_below(2) ? "." : "#");
+  emit_word(12);
+  emit_space(" ");
+  emit("{");
+  emit_space("\n");
+  for (i = 0; i < num_decls; i++) {
+    emit_space("  ");
+    emit_word(10);
+    emit(":");
+    emit_space(" ");
+    switch (random_below(4)) {
+      case 0:
+        emit("0 auto");
+        break;
+      case 1:
+        emit("#3a6b9c");
+        break;
+      case 2:
+        emit("url(\"/img/");
+        emit_word(8);
+        emit(".png\")");
+        break;
+      default:
+        emit("12px");
+    }
+    emit(";");
+    emit_space("\n");
+  }
+  emit("}");
+  emit_space("\n\n");
+}
+
+static void js_statement()
+{
+  if ((shape == SHAPE_COMMENT_HEAVY) || ((shape != SHAPE_MINIFIED) && !random_below(6))) {
+    if (random_below(2)) {
+      emit_comment("/*", "*/");
+    }
+    else {
+      emit("//");
+      emit_word(20);
+      emit(" ");
+      emit_word(20);
+      emit("\n");
+    }
+  }
+  switch (random_below(4)) {
+    case 0:
+      emit("var ");
+      emit_word(8);
+      emit_space(" ");
+      emit("=");
+      emit_space(" ");
+      emit("'");
+      emit_word(20);
+      emit("';");
+      break;
+    case 1:
+      emit("function ");
+      emit_word(8);
+      emit("(a,");
+      emit_space(" ");
+      emit("b)");
+      emit_space(" ");
+      emit("{");
+      emit_space("\n    ");
+      emit("return a");
+      emit_space(" ");
+      emit("+");
+      emit_space(" ");
+      emit("b;");
+      emit_space("\n");
+      emit("}");
+      break;
+    case 2:
+      emit("if");
+      emit_space(" ");
+      emit("(x");
+      emit_space(" ");
+      emit("<");
+      emit_space(" ");
+      emit("10)");
+      emit_space(" ");
+      emit("{");
+      emit_space("\n    ");
+      emit("x++;");
+      emit_space("\n");
+      emit("}");
+      break;
+    default:
+      emit("document.getElementById(\"");
+      emit_word(10);
+      emit("\").className");
+      emit_space(" ");
+      emit("=");
+      emit_space(" ");
+      emit("\"");
+      emit_word(10);
+      emit("\";");
+  }
+  emit_space("\n");
+}
+
+static void html_element(int depth)
+{
+  static const char *tags[] = { "div", "span", "td", "li", "a", "p", "img" };
+  const char *tag = tags[random_below(sizeof(tags) / sizeof(tags[0]))];
+  size_t i, num_attrs = random_below(4);
+
+  if ((shape == SHAPE_COMMENT_HEAVY) && !random_below(3)) {
+    emit_comment("<!--", "-->");
+  }
+  if ((shape == SHAPE_SCRIPT_HEAVY) && !random_below(4)) {
+    emit("<script type=\"text/javascript\">");
+    emit_space("\n");
+    for (i = 0; i < 5 + random_below(20); i++) {
+      js_statement();
+    }
+    emit("</script>");
+    emit_space("\n");
+    return;
+  }
+  for (i = 0; i < (size_t)depth; i++) {
+    emit_space("  ");
+  }
+  emit("<");
+  emit(tag);
+  for (i = 0; i < num_attrs; i++) {
+    emit(" ");
+    emit_word(6);
+    emit("=\"");
+    emit_word(12);
+    emit("\"");
+  }
+  if (!strcmp(tag, "img")) {
+    emit(" src=\"/img/");
+    emit_word(8);
+    emit(".png\">");
+    emit_space("\n");
+    return;
+  }
+  emit(">");
+  if ((depth < 4) && random_below(2)) {
+    emit_space("\n");
+    for (i = 0; i < 1 + random_below(4); i++) {
+      html_element(depth + 1);
+    }
+    for (i = 0; i < (size_t)depth; i++) {
+      emit_space("  ");
+    }
+  }
+  else {
+    emit_word(12);
+    emit(" ");
+    emit_word(12);
+  }
+  emit("</");
+  emit(tag);
+  emit(">");
+  emit_space("\n");
+}
+
+static void generate()
+{
+  switch (content_type) {
+    case TYPE_CSS:
+      while (bytes_written < target_size) {
+        css_rule();
+      }
+      break;
+    case TYPE_JS:
+      while (bytes_written < target_size) {
+        js_statement();
+      }
+      break;
+    case TYPE_HTML:
+      emit("<!DOCTYPE html>\n<html>\n<head>\n<title>");
+      emit_word(20);
+      emit("</title>\n</head>\n<body>\n");
+      while (bytes_written < target_size) {
+        html_element(0);
+      }
+      emit("</body>\n</html>\n");
+      break;
+  }
+}
+
+#define OPT_SHAPE 1
+#define OPT_SIZE  2
+#define OPT_SEED  3
+
+int main(int argc, char **argv)
+{
+  struct option opts[] = {
+    { "css", no_argument, &content_type, TYPE_CSS },
+    { "html", no_argument, &content_type, TYPE_HTML },
+    { "js", no_argument, &content_type, TYPE_JS },
+    { "shape", required_argument, NULL, OPT_SHAPE },
+    { "size", required_argument, NULL, OPT_SIZE },
+    { "seed", required_argument, NULL, OPT_SEED },
+    { NULL, 0, 0, 0 }
+  };
+  int opt;
+
+  do {
+    opt = getopt_long(argc, argv, "", opts, NULL);
+    switch (opt) {
+      case OPT_SHAPE:
+      if (!strcmp(optarg, "tag-dense")) {
+        shape = SHAPE_TAG_DENSE;
+      }
+      else if (!strcmp(optarg, "comment-heavy")) {
+        shape = SHAPE_COMMENT_HEAVY;
+      }
+      else if (!strcmp(optarg, "script-heavy")) {
+        shape = SHAPE_SCRIPT_HEAVY;
+      }
+      else if (!strcmp(optarg, "minified")) {
+        shape = SHAPE_MINIFIED;
+      }
+      else {
+        usage();
+        return 1;
+      }
+      break;
+      case OPT_SIZE:
+      target_size = strtoul(optarg, NULL, 10);
+      break;
+      case OPT_SEED:
+      seed = strtoull(optarg, NULL, 10);
+      if (seed == 0) {
+        seed = 1;
+      }
+      break;
+      case '?':
+      usage();
+      return 1;
+    }
+  } while (opt != -1);
+  if ((content_type == 0) || (optind != argc)) {
+    usage();
+    return 1;
+  }
+  generate();
+  return 0;
+}